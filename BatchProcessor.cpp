@@ -0,0 +1,343 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "BatchProcessor.h"
+#include "DecryptKDB.h"
+#include "FileIO.h"
+#include "ImageHandler.h"
+#include "ImageStore.h"
+#include "ThreadPool.h"
+
+/*
+ * ===================
+ * CONSTANTS
+ * ==================
+*/
+const size_t PREFETCH_STRIDE = 4096;		//Distance between the bytes touched to prefetch a mapped image (one page)
+const long long PREFETCH_LIMIT = 256 << 20;	//Largest image that is prefetched whole by the read stage
+const char* const SKIPPED_EXTENSIONS[] = { ".kdb", ".kdbcache", ".tmp", ".images" };	//Files of a directory that are never images: KDB files, sidecar caches, unfinished writes, checkpoint image logs
+const char* const SKIPPED_FILE_HEADS[] = { "KDBSIDE", "KSCACHE", "SCANCHECKPOINT" };	//Starts of the files the tools write under any name: sidecar caches, key stream caches, checkpoints
+
+/// <summary>A job moving through the pipeline. Each stage fills in its part.</summary>
+struct BatchItem
+{
+	BatchJob job;								//The files of the job
+	MappedFile imageFile;						//read: the mapped image
+	shared_ptr<const PatternMatcher> magic;		//decode: the magic variants of the KDB file
+	vector<MagicJPEG> jpegs;					//scan: the start/end positions and magic variants of the magic jpegs
+	string report;								//extract: the printed output of the job
+	string error;								//The reason the job failed, "" if it did not
+};
+
+typedef unique_ptr<BatchItem> BatchItemPtr;
+
+/// <summary>The result of decoding a KDB file, kept for the other jobs that use it</summary>
+struct DecodedKDB
+{
+	shared_ptr<const PatternMatcher> magic;		//The magic variants, nullptr if decoding failed
+	string error;								//The reason decoding failed, "" if it did not
+};
+
+/// <summary>
+/// RUNS BATCH MODE - Extracts/Repairs/Saves/Outputs the magic jpegs of many files. Arguments: <manifest|directory> [threads] [queue] [hashes] [store]
+/// </summary>
+/// <param name="argc">The number of arguments</param>
+/// <param name="argv">The arguments</param>
+/// <returns>0 if every job succeeded, 1 otherwise</returns>
+int BatchMain(int argc, char* argv[])
+{
+	vector<BatchJob> jobs;
+	BatchOptions options;
+
+	if (argc < 1)
+	{
+		cout << "Usage: batch <manifest|directory> [threads] [queue] [md5,xxh64,blake2b] [store]\n";
+		return 1;
+	}
+	if (argc > 1) options.numThreads = atoi(argv[1]);
+	if (argc > 2) options.queueCapacity = atoi(argv[2]);
+	if (argc > 3 && !parseHashAlgorithms(argv[3], options.hashAlgorithms))
+	{
+		cout << "Unknown Hash Algorithm - " << argv[3] << " (use md5, xxh64, blake2b)\n";
+		return 1;
+	}
+	if (argc > 4) options.storeDir = argv[4];
+	options.kdbSidecar = isSidecarCacheRequested();
+
+	if (!loadBatchJobs(argv[0], jobs))
+	{
+		cout << "Loading Batch Jobs Failed\n";
+		return 1;
+	}
+	return (RunBatch(jobs, options) == 0) ? 0 : 1;
+}
+
+/*
+* ===================
+* HELPER FUNCTIONS
+* ===================
+*/
+
+/// <summary>
+/// Returns true if a file of a directory is not an image: a KDB file or a file written by the tools themselves.
+/// </summary>
+static bool isSkippedFile(const filesystem::path& path)
+{
+	char head[16] = {};
+
+	for (const char* extension : SKIPPED_EXTENSIONS) if (path.extension() == extension) return 1;
+
+	ifstream file(path, ios::binary);
+	if (!file.read(head, sizeof(head) - 1) && file.gcount() == 0) return 0;
+	for (const char* fileHead : SKIPPED_FILE_HEADS) if (strncmp(head, fileHead, strlen(fileHead)) == 0) return 1;
+	return 0;
+}
+
+/// <summary>
+/// Loads the jobs of a directory. Images are processed in name order.
+/// </summary>
+static bool loadDirectoryJobs(const filesystem::path& directory, vector<BatchJob>& jobs)
+{
+	vector<filesystem::path> imagePaths;
+	error_code error;
+
+	for (const filesystem::directory_entry& entry : filesystem::directory_iterator(directory, error))
+	{
+		if (entry.is_regular_file() && !isSkippedFile(entry.path())) imagePaths.push_back(entry.path());
+	}
+	if (error) return 0;
+	sort(imagePaths.begin(), imagePaths.end());
+
+	for (const filesystem::path& imagePath : imagePaths)
+	{
+		filesystem::path kdbPath = imagePath;
+		kdbPath.replace_extension(".kdb");
+		if (!filesystem::exists(kdbPath)) kdbPath = directory / "magic.kdb";
+		if (!filesystem::exists(kdbPath)) continue;
+		jobs.push_back({ kdbPath.string(), imagePath.string() });
+	}
+	return 1;
+}
+
+/// <summary>
+/// Loads the jobs of a manifest file
+/// </summary>
+static bool loadManifestJobs(const string& manifestPath, vector<BatchJob>& jobs)
+{
+	ifstream manifest(manifestPath);
+	string line;
+	size_t separator;
+
+	if (!manifest.is_open()) return 0;
+	while (getline(manifest, line))
+	{
+		if (!line.empty() && line.back() == '\r') line.pop_back();
+		if (line.empty() || line[0] == '#') continue;
+
+		separator = line.find_first_of("\t,");
+		if (separator == string::npos) return 0;
+		jobs.push_back({ line.substr(0, separator), line.substr(separator + 1) });
+	}
+	return 1;
+}
+
+/// <summary>
+/// Loads the jobs of a batch run. source is either a directory or a manifest file.
+/// A manifest has one job per line: the KDB path and the image path separated by a tab or a comma. Empty lines and lines starting with # are skipped.
+/// In a directory, every file is an image except KDB files and the files the tools write (sidecar caches, key stream caches,
+/// checkpoints and their image logs, and .tmp files). Its KDB is <name>.kdb if it exists, otherwise magic.kdb.
+/// </summary>
+/// <param name="source">The manifest file or directory</param>
+/// <param name="jobs">Outputs the jobs</param>
+/// <returns>true on success, false on failed</returns>
+bool loadBatchJobs(const string& source, vector<BatchJob>& jobs)
+{
+	if (filesystem::is_directory(source)) return loadDirectoryJobs(source, jobs);
+	return loadManifestJobs(source, jobs);
+}
+
+/*
+* ===================
+* PIPELINE STAGES
+* ===================
+*/
+
+/// <summary>
+/// Read stage: maps the image and touches one byte per page so the file is read from storage here, not in the scan stage.
+/// An image larger than PREFETCH_LIMIT would not stay resident, so only its start is prefetched and the scan reads the rest as it goes.
+/// </summary>
+static void readStage(BatchItem& item)
+{
+	if (!item.imageFile.open(item.job.imagePath))
+	{
+		item.error = "Image File Does Not Exist";
+		return;
+	}
+
+	if (item.imageFile.size() > PREFETCH_LIMIT)
+	{
+		item.imageFile.adviseSequential();
+		item.imageFile.prefetchRange(0, PREFETCH_LIMIT);
+		return;
+	}
+
+	volatile unsigned char pageSum = 0;
+	for (unsigned long long pos = 0; pos < item.imageFile.size(); pos += PREFETCH_STRIDE) pageSum += item.imageFile.data()[pos];
+}
+
+/// <summary>
+/// Decode stage: decrypts the magic variants of the job's KDB file, through its sidecar cache if kdbSidecar is set.
+/// Each KDB file is only decrypted once per run; a KDB file that fails fails every job that uses it.
+/// </summary>
+static void decodeStage(BatchItem& item, bool kdbSidecar, map<string, DecodedKDB>& magicCache)
+{
+	auto cached = magicCache.find(item.job.kdbPath);
+	if (cached == magicCache.end())
+	{
+		KDBReader kdbReader;
+		DecodedKDB decoded;
+		vector<vector<unsigned char>> magicPatterns;
+		bool error = false;
+
+		if (kdbSidecar ? kdbReader.openCached(item.job.kdbPath) : kdbReader.open(item.job.kdbPath)) magicPatterns = getMagicPatternsFromKDB(kdbReader, error);
+		else error = true;
+
+		if (error) decoded.error = "Decrypting KDB File Failed - " + item.job.kdbPath;
+		else if (magicPatterns.empty()) decoded.error = "No Magic JPEG found in " + item.job.kdbPath;
+		else decoded.magic = make_shared<PatternMatcher>(magicPatterns);
+		cached = magicCache.emplace(item.job.kdbPath, decoded).first;
+	}
+
+	item.magic = cached->second.magic;
+	item.error = cached->second.error;
+}
+
+/// <summary>
+/// Scan stage: finds the start/end positions of the magic jpegs in the mapped image.
+/// </summary>
+static void scanStage(BatchItem& item)
+{
+	searchForMagicJPEGS(item.imageFile, item.jpegs, *item.magic);
+}
+
+/// <summary>
+/// Extract stage: repairs, saves and hashes every magic jpeg and builds the job's report. The jpegs are copied by the kernel
+/// and hashed from the mapping, so hashing overlaps with the scans of later jobs. With a store every job shares it, so a jpeg
+/// found in several images is only written once. The mapping is released at the end.
+/// </summary>
+static void extractStage(BatchItem& item, const vector<HashAlgorithm>& hashAlgorithms, ImageStore& store)
+{
+	vector<ImageDigest> digests;
+	string newParentDir = store.isOpen() ? "" : createRepairedDirectory(item.job.imagePath);
+	string outputPath;
+
+	item.report = "----------------------- REPAIRED JPEGS -----------------------\n";
+	for (const MagicJPEG& jpeg : item.jpegs)
+	{
+		outputPath = newParentDir + to_string(jpeg.startOffset) + ".jpeg";
+		int magicSize = item.magic->getPatternSize(jpeg.variant);
+		bool extracted = store.isOpen() ? 
+			storeJPEG(item.imageFile, item.job.imagePath, jpeg.startOffset, jpeg.endOffset, magicSize, store, hashAlgorithms, digests, outputPath) :
+			extractJPEG(item.imageFile, jpeg.startOffset, jpeg.endOffset, magicSize, outputPath, hashAlgorithms, digests);
+		if (!extracted)
+		{
+			item.error = "Writing " + outputPath + " Failed";
+			break;
+		}
+		item.report += formatImageOutput(jpeg.startOffset, jpeg.endOffset - jpeg.startOffset, digests, outputPath);
+	}
+	item.imageFile.close();
+}
+
+/// <summary>
+/// Starts numWorkers threads that pop items from input, run the stage on items without an error and push them to output.
+/// The last worker to finish closes output.
+/// </summary>
+static void startStage(vector<thread>& threads, int numWorkers, BoundedQueue<BatchItemPtr>& input, BoundedQueue<BatchItemPtr>& output,
+	const function<void(BatchItem&)>& stage)
+{
+	shared_ptr<atomic<int>> runningWorkers = make_shared<atomic<int>>(numWorkers);
+	for (int worker = 0; worker < numWorkers; worker++)
+	{
+		threads.emplace_back([&input, &output, stage, runningWorkers]() {
+			BatchItemPtr item;
+			while (input.pop(item))
+			{
+				if (item->error.empty()) stage(*item);
+				output.push(move(item));
+			}
+			if (--(*runningWorkers) == 0) output.close();
+		});
+	}
+}
+
+/*
+* ===================
+* MAIN FUNCTIONS
+* ===================
+*/
+
+/// <summary>
+/// Runs every job through a pipeline of stages connected by bounded queues: read (map and prefetch the image),
+/// decode (decrypt the magic bytes, cached per KDB file), scan (find the magic jpegs) and extract (repair, save and hash).
+/// Reading and decoding overlap with scanning and extracting of earlier jobs. The report of each job is printed when it completes.
+/// </summary>
+/// <param name="jobs">The jobs to run</param>
+/// <param name="options">The settings of the run</param>
+/// <returns>The number of jobs that failed</returns>
+int RunBatch(const vector<BatchJob>& jobs, const BatchOptions& options)
+{
+	size_t capacity = (size_t)(options.queueCapacity > 0 ? options.queueCapacity : 1);
+	int numWorkers = resolveThreadCount(options.numThreads);
+	BoundedQueue<BatchItemPtr> readQueue(capacity), decodeQueue(capacity), scanQueue(capacity), extractQueue(capacity), doneQueue(capacity);
+	map<string, DecodedKDB> magicCache;							//Only used by the single decode worker
+	ImageStore store;											//Shared by every extract worker when options.storeDir is set
+	vector<thread> threads;
+	int failedJobs = 0;
+
+	if (!options.storeDir.empty() && !store.open(options.storeDir))
+	{
+		cout << "Opening Image Store Failed\n";
+		return (int)jobs.size();
+	}
+
+	//read and decode are single workers: read is bound by storage and decode is cached per KDB file.
+	startStage(threads, 1, readQueue, decodeQueue, readStage);
+	startStage(threads, 1, decodeQueue, scanQueue, [&options, &magicCache](BatchItem& item) { decodeStage(item, options.kdbSidecar, magicCache); });
+	startStage(threads, numWorkers, scanQueue, extractQueue, scanStage);
+	startStage(threads, numWorkers, extractQueue, doneQueue, [&options, &store](BatchItem& item) { extractStage(item, options.hashAlgorithms, store); });
+
+	//Feed the jobs from a separate thread so the reports can be printed while jobs are still being queued.
+	threads.emplace_back([&jobs, &readQueue]() {
+		for (const BatchJob& job : jobs)
+		{
+			BatchItemPtr item(new BatchItem());
+			item->job = job;
+			readQueue.push(move(item));
+		}
+		readQueue.close();
+	});
+
+	BatchItemPtr item;
+	while (doneQueue.pop(item))
+	{
+		cout << "======================= " << item->job.imagePath << " =======================\n";
+		if (item->error.empty()) cout << item->report;
+		else
+		{
+			cout << item->error << "\n\n";
+			failedJobs++;
+		}
+	}
+
+	for (thread& stageThread : threads) stageThread.join();
+	return failedJobs;
+}
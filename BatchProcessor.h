@@ -0,0 +1,52 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "ImageHash.h"
+
+using namespace std;
+
+/// <summary>A KDB file and the image file to extract the magic jpegs from</summary>
+struct BatchJob
+{
+	string kdbPath;			//The filepath of the KDB file
+	string imagePath;		//The filepath of the image
+};
+
+/// <summary>Settings of a batch run</summary>
+struct BatchOptions
+{
+	int numThreads = 0;		//Workers for each of the scan and extract stages. 0 means one per hardware thread
+	int queueCapacity = 8;	//Most jobs waiting between two stages. Bounds the memory of a run
+	vector<HashAlgorithm> hashAlgorithms{ HASH_MD5 };	//The hashes printed for every repaired jpeg
+	string storeDir;		//Save the jpegs of every job into this content-addressed store. "" saves them to <filename>_Repaired/
+	bool kdbSidecar = false;	//Open the KDB files through their sidecar caches (see KDBReader::openCached)
+};
+
+/// <summary>
+/// RUNS BATCH MODE - Extracts/Repairs/Saves/Outputs the magic jpegs of many files. Arguments: <manifest|directory> [threads] [queue] [hashes] [store]
+/// </summary>
+/// <param name="argc">The number of arguments</param>
+/// <param name="argv">The arguments</param>
+/// <returns>0 if every job succeeded, 1 otherwise</returns>
+int BatchMain(int argc, char* argv[]);
+
+/// <summary>
+/// Loads the jobs of a batch run. source is either a directory or a manifest file.
+/// A manifest has one job per line: the KDB path and the image path separated by a tab or a comma. Empty lines and lines starting with # are skipped.
+/// In a directory, every file is an image except KDB files and the files the tools write (sidecar caches, key stream caches,
+/// checkpoints and .tmp files). Its KDB is <name>.kdb if it exists, otherwise magic.kdb.
+/// </summary>
+/// <param name="source">The manifest file or directory</param>
+/// <param name="jobs">Outputs the jobs</param>
+/// <returns>true on success, false on failed</returns>
+bool loadBatchJobs(const string& source, vector<BatchJob>& jobs);
+
+/// <summary>
+/// Runs every job through a pipeline of stages connected by bounded queues: read (map and prefetch the image),
+/// decode (decrypt the magic bytes, cached per KDB file), scan (find the magic jpegs) and extract (repair, save and hash).
+/// Reading and decoding overlap with scanning and extracting of earlier jobs. The report of each job is printed when it completes.
+/// </summary>
+/// <param name="jobs">The jobs to run</param>
+/// <param name="options">The settings of the run</param>
+/// <returns>The number of jobs that failed</returns>
+int RunBatch(const vector<BatchJob>& jobs, const BatchOptions& options);
@@ -0,0 +1,444 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include "Benchmark.h"
+#include "Crypt.h"
+#include "DecryptKDB.h"
+#include "FileIO.h"
+#include "ImageExtractor.h"
+#include "ImageHandler.h"
+#include "KDBWriter.h"
+#include "PatternScanner.h"
+#include "ThreadPool.h"
+
+const double BYTES_PER_MB = 1 << 20;			//Throughput and sizes are reported in MB of 2^20 bytes
+const size_t WRITE_BUFFER_SIZE = 4 << 20;		//Bytes of a synthetic image collected before they are written
+const unsigned char JPEG_HEADER[] = {			//What follows the magic string of a synthetic jpeg: a JFIF APP0 segment and a scan header
+	0xE0, 0x00, 0x10, 'J', 'F', 'I', 'F', 0x00, 0x01, 0x01, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00,
+	0xFF, 0xDA, 0x00, 0x08, 0x01, 0x01, 0x00, 0x00, 0x3F, 0x00 };
+const unsigned char END_BYTES[] = { 0xFF, 0xD9 };	//The end string of a jpeg
+
+/// <summary>
+/// RUNS THE BENCHMARKS - Generates a synthetic KDB file and image, then times LSFR, Crypt, DecryptKDB, KDBReader, the image searches
+/// and full extractions, and reports the throughput and latency percentiles of each. Arguments:
+/// [--dir <dir>] [--generate] [--iterations <n>] [--threads <n>] [--filter <name>] [--seed <n>] [--crypt-size <MB>]
+/// [--entries <n>] [--blocks <n>] [--block-size <n>] [--fragmentation <0-1>] [--magic-size <n>] [--magics <n>]
+/// [--image-size <MB>] [--density <jpegs/MB>] [--jpeg-size <n>] [--false-ends <n/MB>]
+/// --generate only writes magic.kdb and input.bin (to --dir, or the current directory) and exits.
+/// </summary>
+/// <param name="argc">The number of arguments</param>
+/// <param name="argv">The arguments</param>
+/// <returns>0 on success, 1 on failed</returns>
+int BenchmarkMain(int argc, char* argv[])
+{
+	BenchmarkOptions options;
+	bool generateOnly = false;
+
+	for (int index = 0; index < argc; index++)
+	{
+		bool hasValue = index + 1 < argc;
+		if (strcmp(argv[index], "--generate") == 0) generateOnly = true;
+		else if (strcmp(argv[index], "--dir") == 0 && hasValue) options.workDir = argv[++index];
+		else if (strcmp(argv[index], "--iterations") == 0 && hasValue) options.iterations = atoi(argv[++index]);
+		else if (strcmp(argv[index], "--threads") == 0 && hasValue) options.numThreads = atoi(argv[++index]);
+		else if (strcmp(argv[index], "--filter") == 0 && hasValue) options.filter = argv[++index];
+		else if (strcmp(argv[index], "--seed") == 0 && hasValue) options.kdb.seed = options.image.seed = (unsigned int)strtoul(argv[++index], nullptr, 10);
+		else if (strcmp(argv[index], "--crypt-size") == 0 && hasValue) options.cryptSize = (int)(atof(argv[++index]) * BYTES_PER_MB);
+		else if (strcmp(argv[index], "--entries") == 0 && hasValue) options.kdb.numEntries = atoi(argv[++index]);
+		else if (strcmp(argv[index], "--blocks") == 0 && hasValue) options.kdb.blocksPerEntry = atoi(argv[++index]);
+		else if (strcmp(argv[index], "--block-size") == 0 && hasValue) options.kdb.blockSize = atoi(argv[++index]);
+		else if (strcmp(argv[index], "--fragmentation") == 0 && hasValue) options.kdb.fragmentation = atof(argv[++index]);
+		else if (strcmp(argv[index], "--magic-size") == 0 && hasValue) options.kdb.magicSize = atoi(argv[++index]);
+		else if (strcmp(argv[index], "--magics") == 0 && hasValue) options.kdb.numMagics = atoi(argv[++index]);
+		else if (strcmp(argv[index], "--image-size") == 0 && hasValue) options.image.size = (long long)(atof(argv[++index]) * BYTES_PER_MB);
+		else if (strcmp(argv[index], "--density") == 0 && hasValue) options.image.jpegDensity = atof(argv[++index]);
+		else if (strcmp(argv[index], "--jpeg-size") == 0 && hasValue) options.image.jpegSize = atoi(argv[++index]);
+		else if (strcmp(argv[index], "--false-ends") == 0 && hasValue) options.image.falseEndRate = atof(argv[++index]);
+		else
+		{
+			cout << "Unknown Benchmark Argument - " << argv[index] << "\n";
+			return 1;
+		}
+	}
+
+	if (generateOnly)
+	{
+		string workDir = options.workDir == "" ? "." : options.workDir;
+		vector<vector<unsigned char>> magicPatterns;
+		long long numJPEGs;
+		error_code dirError;
+
+		filesystem::create_directories(workDir, dirError);
+		if (!generateSyntheticKDB((filesystem::path(workDir) / "magic.kdb").string(), options.kdb, magicPatterns) ||
+			!generateSyntheticImage((filesystem::path(workDir) / "input.bin").string(), magicPatterns, options.image, numJPEGs))
+		{
+			cout << "Generating Synthetic Files Failed\n";
+			return 1;
+		}
+		cout << "Generated magic.kdb and input.bin (" << numJPEGs << " jpegs) in " << workDir << "\n";
+		return 0;
+	}
+
+	return RunBenchmarks(options) ? 0 : 1;
+}
+
+/*
+* ===================
+* HELPER FUNCTIONS
+* ===================
+*/
+
+/// <summary>
+/// Returns the latency at a percentile of sorted run times, by nearest rank
+/// </summary>
+static double getPercentile(const vector<double>& sortedSeconds, double percentile)
+{
+	size_t rank = (size_t)ceil(percentile / 100.0 * sortedSeconds.size());
+	return sortedSeconds[rank > 0 ? rank - 1 : 0];
+}
+
+/// <summary>
+/// Times a benchmark: one warm-up run, then options.iterations timed runs. Prints its throughput and latencies.
+/// A benchmark that is filtered out is skipped and counts as a success.
+/// </summary>
+/// <param name="options">The settings of the run</param>
+/// <param name="name">The name of the benchmark</param>
+/// <param name="bytes">The bytes processed by one run</param>
+/// <param name="run">One run of the benchmark. Returns false if it failed</param>
+/// <returns>true on success, false if a run failed</returns>
+static bool runBenchmark(const BenchmarkOptions& options, const string& name, long long bytes, const function<bool()>& run)
+{
+	vector<double> seconds;
+	char line[256];
+
+	if (options.filter != "" && name.find(options.filter) == string::npos) return 1;
+
+	if (!run())
+	{
+		cout << name << " FAILED\n";
+		return 0;
+	}
+	for (int iteration = 0; iteration < max(options.iterations, 1); iteration++)
+	{
+		auto start = chrono::steady_clock::now();
+		bool succeeded = run();
+		seconds.push_back(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+		if (!succeeded)
+		{
+			cout << name << " FAILED\n";
+			return 0;
+		}
+	}
+
+	sort(seconds.begin(), seconds.end());
+	double median = getPercentile(seconds, 50);
+	snprintf(line, sizeof(line), "%-16s %10.1f MB/s   p50 %9.3f ms   p90 %9.3f ms   p99 %9.3f ms   max %9.3f ms\n", name.c_str(),
+		median > 0 ? bytes / BYTES_PER_MB / median : 0.0, median * 1000, getPercentile(seconds, 90) * 1000, getPercentile(seconds, 99) * 1000,
+		seconds.back() * 1000);
+	cout << line;
+	cout.flush();
+	return 1;
+}
+
+/// <summary>
+/// Checks that a search or extraction found exactly the planted jpegs, and reports it if not
+/// </summary>
+static bool checkFound(const string& name, long long found, long long planted)
+{
+	if (found == planted) return 1;
+	cout << name << " found " << found << " of " << planted << " jpegs\n";
+	return 0;
+}
+
+/// <summary>
+/// Appends count filler bytes. Filler never holds 0xFF or the first byte of a magic string (see fillerBytes).
+/// </summary>
+static void appendFiller(vector<unsigned char>& output, long long count, mt19937& random, const unsigned char* fillerBytes)
+{
+	for (long long index = 0; index < count; index += 4)
+	{
+		unsigned int value = random();
+		for (int byteIndex = 0; byteIndex < 4 && index + byteIndex < count; byteIndex++)
+		{
+			output.push_back(fillerBytes[(value >> (8 * byteIndex)) & 0xFF]);
+		}
+	}
+}
+
+/*
+* ===================
+* GENERATORS
+* ===================
+*/
+
+/// <summary>
+/// Generates a synthetic KDB file: the MAGIC entries first, then the data entries.
+/// A file without fragmentation is written sequentially by KDBWriter::write.
+/// </summary>
+/// <param name="pathName">The file path</param>
+/// <param name="options">The settings of the file</param>
+/// <param name="magicPatterns">Outputs the magic strings, in entry order</param>
+/// <returns>true on success, false on failed</returns>
+bool generateSyntheticKDB(const string& pathName, const SyntheticKDBOptions& options, vector<vector<unsigned char>>& magicPatterns)
+{
+	KDBWriter writer;
+	mt19937 random(options.seed);
+	uniform_int_distribution<int> magicByte(0, 0xFE);
+	vector<unsigned char> data;
+
+	magicPatterns.clear();
+	if (options.magicSize < 1 || options.numMagics < 1 || options.numEntries < 0 || options.numMagics + options.numEntries > MAX_ENTRIES) return 0;
+
+	//A magic string never starts with D9, so a stray end string in the filler can't be followed by one.
+	while ((int)magicPatterns.size() < options.numMagics)
+	{
+		vector<unsigned char> magic(options.magicSize);
+		for (unsigned char& magicValue : magic) magicValue = (unsigned char)magicByte(random);
+		if (magic[0] == 0xD9 || find(magicPatterns.begin(), magicPatterns.end(), magic) != magicPatterns.end()) continue;
+
+		string name = magicPatterns.empty() ? "MAGIC" : "MAGIC" + to_string(magicPatterns.size());
+		if (!writer.addEntry(name, magic.data(), (int)magic.size())) return 0;
+		magicPatterns.push_back(magic);
+	}
+
+	vector<int> blockSizes(max(options.blocksPerEntry, 0), options.blockSize);
+	data.resize((size_t)max(options.blocksPerEntry, 0) * max(options.blockSize, 0));
+	for (int entryIndex = 0; entryIndex < options.numEntries; entryIndex++)
+	{
+		for (unsigned char& dataValue : data) dataValue = (unsigned char)random();
+		if (!writer.addEntry("ENTRY" + to_string(entryIndex), data.data(), blockSizes)) return 0;
+	}
+
+	return options.fragmentation > 0 ? writer.writeFragmented(pathName, options.fragmentation, options.seed) : writer.write(pathName);
+}
+
+/// <summary>
+/// Generates a synthetic image. The image is split into one slot per jpeg; each jpeg is placed at a random position in its slot.
+/// Stray end strings are spread over the filler at falseEndRate per MB.
+/// </summary>
+/// <param name="pathName">The file path</param>
+/// <param name="magicPatterns">The magic strings. The jpegs use them in turn</param>
+/// <param name="options">The settings of the image</param>
+/// <param name="numJPEGs">Outputs the number of planted jpegs</param>
+/// <returns>true on success, false on failed</returns>
+bool generateSyntheticImage(const string& pathName, const vector<vector<unsigned char>>& magicPatterns, const SyntheticImageOptions& options,
+	long long& numJPEGs)
+{
+	mt19937 random(options.seed);
+	unsigned char fillerBytes[256];			//Maps a random byte to a filler byte
+	bool excluded[256] = {};				//Bytes that filler never holds
+	vector<unsigned char> output;
+	double pendingEnds = 0;					//Stray end strings owed to the filler so far
+	size_t longestMagic = 0;
+
+	numJPEGs = 0;
+	if (magicPatterns.empty() || options.size <= 0) return 0;
+
+	excluded[0xFF] = true;
+	for (const vector<unsigned char>& magic : magicPatterns)
+	{
+		if (magic.empty()) return 0;
+		excluded[magic[0]] = true;
+		longestMagic = max(longestMagic, magic.size());
+	}
+	for (int byteValue = 0; byteValue < 256; byteValue++)
+	{
+		int fillerValue = byteValue;
+		while (excluded[fillerValue]) fillerValue = (fillerValue + 1) & 0xFF;
+		fillerBytes[byteValue] = (unsigned char)fillerValue;
+	}
+
+	long long minJPEGSize = (long long)(longestMagic + sizeof(JPEG_HEADER) + sizeof(END_BYTES)) + 1;
+	long long plannedJPEGs = max(1LL, llround(options.jpegDensity * options.size / BYTES_PER_MB));
+	long long slotSize = options.size / plannedJPEGs;
+	if (options.jpegDensity <= 0 || slotSize < minJPEGSize) return 0;
+
+	ofstream imageFile(pathName, ios::out | ios::binary | ios::trunc);
+	if (!imageFile.is_open()) return 0;
+	output.reserve(WRITE_BUFFER_SIZE + slotSize);
+
+	//Writes filler with its share of stray end strings
+	auto writeFiller = [&](long long count) {
+		size_t fillerStart = output.size();
+		appendFiller(output, count, random, fillerBytes);
+		pendingEnds += options.falseEndRate * count / BYTES_PER_MB;
+		for (; pendingEnds >= 1 && count >= 2; pendingEnds--)
+		{
+			size_t endPos = fillerStart + uniform_int_distribution<long long>(0, count - 2)(random);
+			memcpy(output.data() + endPos, END_BYTES, sizeof(END_BYTES));
+		}
+	};
+
+	for (long long jpegIndex = 0; jpegIndex < plannedJPEGs; jpegIndex++)
+	{
+		const vector<unsigned char>& magic = magicPatterns[jpegIndex % magicPatterns.size()];
+		long long slotEnd = jpegIndex + 1 == plannedJPEGs ? options.size : (jpegIndex + 1) * slotSize;
+		long long slotLength = slotEnd - jpegIndex * slotSize;
+		long long jpegSize = uniform_int_distribution<long long>(options.jpegSize / 2, options.jpegSize * 3 / 2)(random);
+		jpegSize = min(max(jpegSize, minJPEGSize), slotLength);
+		long long gap = uniform_int_distribution<long long>(0, slotLength - jpegSize)(random);
+
+		writeFiller(gap);
+		output.insert(output.end(), magic.begin(), magic.end());
+		output.insert(output.end(), JPEG_HEADER, JPEG_HEADER + sizeof(JPEG_HEADER));
+		appendFiller(output, jpegSize - (long long)(magic.size() + sizeof(JPEG_HEADER) + sizeof(END_BYTES)), random, fillerBytes);
+		output.insert(output.end(), END_BYTES, END_BYTES + sizeof(END_BYTES));
+		writeFiller(slotLength - gap - jpegSize);
+		numJPEGs++;
+
+		if (output.size() >= WRITE_BUFFER_SIZE)
+		{
+			imageFile.write((const char*)output.data(), output.size());
+			output.clear();
+		}
+	}
+	imageFile.write((const char*)output.data(), output.size());
+	imageFile.close();
+	return !imageFile.fail();
+}
+
+/*
+* ===================
+* BENCHMARKS
+* ===================
+*/
+
+/// <summary>
+/// Generates the synthetic files and runs every benchmark that matches the filter.
+/// Micro benchmarks: lsfr, crypt (one thread and every thread), decrypt-kdb (one thread and every thread), kdb-reader,
+/// search (in memory on one thread, mapped on every thread, and the file search).
+/// Macro benchmarks: extract and extract-stream, full ImageExtractor runs (decrypt the KDB file, search, repair, save and hash),
+/// which is the work of an ImageHandler run without its console output.
+/// </summary>
+/// <param name="options">The settings of the run</param>
+/// <returns>true on success, false on failed</returns>
+bool RunBenchmarks(const BenchmarkOptions& options)
+{
+	bool removeWorkDir = options.workDir == "";
+	filesystem::path workDir = options.workDir;
+	string kdbPath, imagePath;
+	vector<vector<unsigned char>> magicPatterns;
+	long long numJPEGs;
+	error_code fileError;
+	bool success = true;
+
+	if (removeWorkDir) workDir = filesystem::temp_directory_path(fileError) / ("kdbbench-" + to_string(chrono::steady_clock::now().time_since_epoch().count()));
+	filesystem::create_directories(workDir, fileError);
+	kdbPath = (workDir / "magic.kdb").string();
+	imagePath = (workDir / "input.bin").string();
+
+	auto generateStart = chrono::steady_clock::now();
+	if (!generateSyntheticKDB(kdbPath, options.kdb, magicPatterns) || !generateSyntheticImage(imagePath, magicPatterns, options.image, numJPEGs))
+	{
+		cout << "Generating Synthetic Files Failed\n";
+		if (removeWorkDir) filesystem::remove_all(workDir, fileError);
+		return 0;
+	}
+	double generateSeconds = chrono::duration<double>(chrono::steady_clock::now() - generateStart).count();
+
+	MappedFile kdbFile, imageMapping;
+	if (!kdbFile.open(kdbPath) || !imageMapping.open(imagePath))
+	{
+		cout << "Mapping Synthetic Files Failed\n";
+		if (removeWorkDir) filesystem::remove_all(workDir, fileError);
+		return 0;
+	}
+	long long kdbSize = (long long)kdbFile.size();
+	long long imageSize = (long long)imageMapping.size();
+
+	char line[256];
+	cout << "------------------------- BENCHMARKS -------------------------\n";
+	snprintf(line, sizeof(line), "Seed %u, %d iterations, %d threads, generated in %.0f ms\n", options.kdb.seed, max(options.iterations, 1),
+		resolveThreadCount(options.numThreads), generateSeconds * 1000);
+	cout << line;
+	snprintf(line, sizeof(line), "KDB   - %d entries of %d x %d bytes, %d magic of %d bytes, fragmentation %.2f: %.1f MB\n",
+		options.kdb.numEntries, options.kdb.blocksPerEntry, options.kdb.blockSize, options.kdb.numMagics, options.kdb.magicSize,
+		options.kdb.fragmentation, kdbSize / BYTES_PER_MB);
+	cout << line;
+	snprintf(line, sizeof(line), "Image - %lld jpegs of ~%d bytes, %.1f false ends/MB: %.1f MB\n\n", numJPEGs, options.image.jpegSize,
+		options.image.falseEndRate, imageSize / BYTES_PER_MB);
+	cout << line;
+
+	//Micro benchmarks - the KDB file
+	vector<unsigned char> cryptBuffer(max(options.cryptSize, 1), 0x5A);
+	success &= runBenchmark(options, "lsfr", (long long)cryptBuffer.size(), [&]() {
+		unsigned char* keyStream = LSFR((int)cryptBuffer.size(), LSFR_INIT_VALUE);
+		delete[] keyStream;
+		return true;
+	});
+	success &= runBenchmark(options, "crypt", (long long)cryptBuffer.size(), [&]() {
+		CryptInPlace(cryptBuffer.data(), (int)cryptBuffer.size(), LSFR_INIT_VALUE);
+		return true;
+	});
+	success &= runBenchmark(options, "crypt-mt", (long long)cryptBuffer.size(), [&]() {
+		CryptInPlaceParallel(cryptBuffer.data(), (int)cryptBuffer.size(), LSFR_INIT_VALUE, options.numThreads);
+		return true;
+	});
+	success &= runBenchmark(options, "decrypt-kdb", kdbSize, [&]() {
+		bool error;
+		KDB kdb = DecryptKDB(kdbFile, error, false, 1);
+		return !error;
+	});
+	success &= runBenchmark(options, "decrypt-kdb-mt", kdbSize, [&]() {
+		bool error;
+		KDB kdb = DecryptKDB(kdbFile, error, false, options.numThreads);
+		return !error;
+	});
+	success &= runBenchmark(options, "kdb-reader", kdbSize, [&]() {
+		KDBReader kdbReader;
+		int numEntries = 0;
+		if (!kdbReader.open(kdbPath)) return false;
+		kdbReader.forEachEntry([&numEntries](int, const KDBEntry&) { numEntries++; return true; });
+		return numEntries == options.kdb.numEntries + options.kdb.numMagics;
+	});
+
+	//Micro benchmarks - the image searches
+	PatternMatcher magic;
+	magic.build(magicPatterns);
+	success &= runBenchmark(options, "search", imageSize, [&]() {
+		vector<MagicJPEG> jpegs;
+		searchForMagicJPEGS(imageMapping.data(), imageSize, jpegs, magic, 1);
+		return checkFound("search", (long long)jpegs.size(), numJPEGs);
+	});
+	success &= runBenchmark(options, "search-mt", imageSize, [&]() {
+		vector<MagicJPEG> jpegs;
+		searchForMagicJPEGS(imageMapping, jpegs, magic, options.numThreads);
+		return checkFound("search-mt", (long long)jpegs.size(), numJPEGs);
+	});
+	success &= runBenchmark(options, "search-file", imageSize, [&]() {
+		vector<MagicJPEG> jpegs;
+		fstream imageFile(imagePath, ios::in | ios::binary);
+		if (!imageFile.is_open()) return false;
+		searchForMagicJPEGS(imageFile, jpegs, magic);
+		return checkFound("search-file", (long long)jpegs.size(), numJPEGs);
+	});
+
+	//Macro benchmarks - full runs
+	for (bool streaming : { false, true })
+	{
+		string name = streaming ? "extract-stream" : "extract";
+		ImageHandlerOptions extractOptions;
+		extractOptions.streaming = streaming;
+		extractOptions.numThreads = options.numThreads;
+
+		success &= runBenchmark(options, name, imageSize, [&]() {
+			ImageExtractor extractor(extractOptions);
+			long long numImages = 0;
+			if (!extractor.open(kdbPath) || !extractor.extract(imagePath, [&numImages](const ExtractedImage&) { numImages++; })) return false;
+			return checkFound(name, numImages, numJPEGs);
+		});
+	}
+
+	kdbFile.close();
+	imageMapping.close();
+	if (removeWorkDir) filesystem::remove_all(workDir, fileError);
+	return success;
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/// <summary>Settings of a synthetic KDB file</summary>
+struct SyntheticKDBOptions
+{
+	int numEntries = 100;			//Data entries besides the MAGIC entries. Together at most MAX_ENTRIES
+	int blocksPerEntry = 32;		//Blocks of every data entry. At most MAX_BLOCKS
+	int blockSize = 8192;			//Bytes of every block. At most 0x7FFF
+	double fragmentation = 0.0;		//The probability that a block is moved away from its entry (see KDBWriter::writeFragmented)
+	int magicSize = 3;				//Length of the magic strings
+	int numMagics = 1;				//Magic variants (MAGIC entries)
+	unsigned int seed = 2018;		//The same seed always gives the same file
+};
+
+/// <summary>Settings of a synthetic image</summary>
+struct SyntheticImageOptions
+{
+	long long size = 64 << 20;		//Bytes of the image
+	double jpegDensity = 32.0;		//Magic jpegs per MB
+	int jpegSize = 16 << 10;		//Average bytes of a magic jpeg. Sizes vary from half to one and a half times this
+	double falseEndRate = 64.0;		//Stray end strings (FF D9) per MB between the jpegs
+	unsigned int seed = 2018;		//The same seed always gives the same image
+};
+
+/// <summary>Settings of a benchmark run</summary>
+struct BenchmarkOptions
+{
+	string workDir;					//Where the synthetic files are generated. "" uses a temporary directory that is removed afterwards
+	int iterations = 10;			//Timed runs of every benchmark, after one warm-up run
+	int numThreads = 0;				//Threads of the parallel benchmarks. 0 means one per hardware thread
+	string filter;					//Only run the benchmarks whose name contains it. "" runs all of them
+	int cryptSize = 16 << 20;		//Bytes processed by the LSFR and Crypt micro benchmarks
+	SyntheticKDBOptions kdb;		//The synthetic KDB file
+	SyntheticImageOptions image;	//The synthetic image
+};
+
+/// <summary>
+/// RUNS THE BENCHMARKS - Generates a synthetic KDB file and image, then times LSFR, Crypt, DecryptKDB, KDBReader, the image searches
+/// and full extractions, and reports the throughput and latency percentiles of each. Arguments:
+/// [--dir <dir>] [--generate] [--iterations <n>] [--threads <n>] [--filter <name>] [--seed <n>] [--crypt-size <MB>]
+/// [--entries <n>] [--blocks <n>] [--block-size <n>] [--fragmentation <0-1>] [--magic-size <n>] [--magics <n>]
+/// [--image-size <MB>] [--density <jpegs/MB>] [--jpeg-size <n>] [--false-ends <n/MB>]
+/// --generate only writes magic.kdb and input.bin (to --dir, or the current directory) and exits.
+/// </summary>
+/// <param name="argc">The number of arguments</param>
+/// <param name="argv">The arguments</param>
+/// <returns>0 on success, 1 on failed</returns>
+int BenchmarkMain(int argc, char* argv[]);
+
+/// <summary>
+/// Generates a synthetic KDB file: numMagics MAGIC entries holding distinct random magic strings, followed by numEntries
+/// entries of random data split into equal blocks. Magic strings never contain 0xFF, so they can't overlap an end string.
+/// </summary>
+/// <param name="pathName">The file path</param>
+/// <param name="options">The settings of the file</param>
+/// <param name="magicPatterns">Outputs the magic strings, in entry order</param>
+/// <returns>true on success, false on failed</returns>
+bool generateSyntheticKDB(const string& pathName, const SyntheticKDBOptions& options, vector<vector<unsigned char>>& magicPatterns);
+
+/// <summary>
+/// Generates a synthetic image: magic jpegs (a magic string, a JFIF and a scan header, entropy-coded data and an end string),
+/// spread evenly with random gaps of filler. The filler holds stray end strings but never a magic string, and the entropy-coded data
+/// holds neither, so every search finds exactly the planted jpegs.
+/// </summary>
+/// <param name="pathName">The file path</param>
+/// <param name="magicPatterns">The magic strings. The jpegs use them in turn</param>
+/// <param name="options">The settings of the image</param>
+/// <param name="numJPEGs">Outputs the number of planted jpegs</param>
+/// <returns>true on success, false on failed</returns>
+bool generateSyntheticImage(const string& pathName, const vector<vector<unsigned char>>& magicPatterns, const SyntheticImageOptions& options,
+	long long& numJPEGs);
+
+/// <summary>
+/// Generates the synthetic files and runs every benchmark that matches the filter. Prints one line per benchmark:
+/// throughput in MB/s (2^20 bytes) of the median run and the p50/p90/p99/max latencies of a run.
+/// A search or extraction that does not find exactly the planted jpegs is reported and fails the run.
+/// </summary>
+/// <param name="options">The settings of the run</param>
+/// <returns>true on success, false on failed</returns>
+bool RunBenchmarks(const BenchmarkOptions& options);
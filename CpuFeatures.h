@@ -0,0 +1,26 @@
+#pragma once
+
+/*
+* ===================
+* SIMD SUPPORT
+* ===================
+* CPU_X86 is defined when SSE2 can be assumed and AVX2 code paths can be compiled.
+* TARGET_AVX2 marks a function that uses AVX2 intrinsics, so it can be compiled without enabling AVX2 for the whole file.
+* Only call a TARGET_AVX2 function after CpuHasAVX2() returned true.
+*/
+#if defined(_M_X64) || defined(__x86_64__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define CPU_X86
+#include <immintrin.h>
+#endif
+
+#if defined(CPU_X86) && (defined(__GNUC__) || defined(__clang__))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+/// <summary>
+/// Checks if the CPU and the OS support AVX2. The result is computed once and cached.
+/// </summary>
+/// <returns>true if AVX2 code paths can be used</returns>  
+bool CpuHasAVX2();
@@ -1,10 +1,147 @@
 #include <iostream>
+#include <vector>
 #include "Crypt.h"
+#include "CpuFeatures.h"
+#include "ThreadPool.h"
 using namespace std;
 
 //CONSTANTS
 const unsigned int FEEDBACK_VAL = 0x87654321;      //The feedback value for this LSFR that is XOR'd with the current LSFR value. 
+const int STATE_BITS = 32;                         //The number of bits in the LSFR state.
+const int JUMP_TABLE_SIZE = 63;                    //One transition matrix per bit of a (positive) byte offset.
+const int PARALLEL_CHUNK_SIZE = 1 << 18;           //The smallest slice of the data stream given to a single thread.
+const int KEY_BATCH_SIZE = 256;                    //Number of keys generated on the stack before they are XOR'd into the data.
 
+/// <summary>
+/// A 32x32 matrix over GF(2) describing a linear map of the LSFR state.
+/// column[j] is the state produced when only bit j of the input state is set.
+/// </summary>
+struct LSFRMatrix
+{
+    unsigned int column[STATE_BITS];
+};
+
+/// <summary>Applies a transition matrix to an LSFR state.</summary>
+static unsigned int applyMatrix(const LSFRMatrix& matrix, unsigned int state)
+{
+    unsigned int result = 0;
+    for (int bit = 0; state != 0; bit++, state >>= 1) {
+        if (state & 1) result ^= matrix.column[bit];
+    }
+    return result;
+}
+
+/// <summary>Returns the transition matrix that applies right and then left.</summary>
+static LSFRMatrix multiplyMatrix(const LSFRMatrix& left, const LSFRMatrix& right)
+{
+    LSFRMatrix result;
+    for (int bit = 0; bit < STATE_BITS; bit++) {
+        result.column[bit] = applyMatrix(left, right.column[bit]);
+    }
+    return result;
+}
+
+/// <summary>
+/// Returns the jump table where entry k jumps the LSFR ahead by 2^k keys (8 * 2^k steps).
+/// The table is built once on first use.
+/// </summary>
+static const LSFRMatrix* getJumpTable()
+{
+    static const vector<LSFRMatrix> jumpTable = []() {
+        vector<LSFRMatrix> table(JUMP_TABLE_SIZE);
+        LSFRMatrix step;
+
+        //A single step: bit 0 shifts out and pulls in the feedback, every other bit shifts down by one.
+        step.column[0] = FEEDBACK_VAL;
+        for (int bit = 1; bit < STATE_BITS; bit++) step.column[bit] = 1u << (bit - 1);
+
+        //One key is 8 steps. Every following entry squares the previous one.
+        table[0] = step;
+        for (int square = 0; square < 3; square++) table[0] = multiplyMatrix(table[0], table[0]);
+        for (int k = 1; k < JUMP_TABLE_SIZE; k++) table[k] = multiplyMatrix(table[k - 1], table[k - 1]);
+        return table;
+    }();
+    return jumpTable.data();
+}
+
+/// <summary>
+/// Returns the byte step table. Stepping the LSFR 8 times only pulls in feedback for the lowest 8 bits of the state, so
+/// one key can be generated with S = (S >> 8) ^ table[S & 0xFF]. The table is built once on first use.
+/// </summary>
+static const unsigned int* getByteStepTable()
+{
+    static const vector<unsigned int> byteStepTable = []() {
+        vector<unsigned int> table(256);
+        for (unsigned int lowByte = 0; lowByte < 256; lowByte++) {
+            unsigned int currentValue = lowByte;
+            for (int stepCount = 0; stepCount < 8; stepCount++) {
+                if (currentValue % 2 == 0) currentValue = currentValue >> 1;
+                else currentValue = (currentValue >> 1) ^ FEEDBACK_VAL;
+            }
+            table[lowByte] = currentValue;
+        }
+        return table;
+    }();
+    return byteStepTable.data();
+}
+
+#ifdef CPU_X86
+/// <summary>XORs dataLength bytes of data with keys into output 32 bytes at a time. output may equal data.</summary>
+TARGET_AVX2 static void xorKeysAVX2(const unsigned char* data, const unsigned char* keys, unsigned char* output, int dataLength)
+{
+    int pos = 0;
+    for (; pos + 32 <= dataLength; pos += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(data + pos));
+        __m256i key = _mm256_loadu_si256((const __m256i*)(keys + pos));
+        _mm256_storeu_si256((__m256i*)(output + pos), _mm256_xor_si256(block, key));
+    }
+    for (; pos < dataLength; pos++) output[pos] = data[pos] ^ keys[pos];
+}
+
+/// <summary>XORs dataLength bytes of data with keys into output 16 bytes at a time. output may equal data.</summary>
+static void xorKeysSSE2(const unsigned char* data, const unsigned char* keys, unsigned char* output, int dataLength)
+{
+    int pos = 0;
+    for (; pos + 16 <= dataLength; pos += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(data + pos));
+        __m128i key = _mm_loadu_si128((const __m128i*)(keys + pos));
+        _mm_storeu_si128((__m128i*)(output + pos), _mm_xor_si128(block, key));
+    }
+    for (; pos < dataLength; pos++) output[pos] = data[pos] ^ keys[pos];
+}
+#endif
+
+/// <summary>XORs dataLength bytes of data with keys into output using the widest SIMD width available. output may equal data.</summary>
+static void xorKeys(const unsigned char* data, const unsigned char* keys, unsigned char* output, int dataLength)
+{
+#ifdef CPU_X86
+    if (CpuHasAVX2()) xorKeysAVX2(data, keys, output, dataLength);
+    else xorKeysSSE2(data, keys, output, dataLength);
+#else
+    for (int pos = 0; pos < dataLength; pos++) output[pos] = data[pos] ^ keys[pos];
+#endif
+}
+
+/// <summary>
+/// XORs the data stream with the key stream generated from the LSFR state currentValue. output may equal data.
+/// Keys are generated a batch at a time into a stack buffer, so nothing is allocated.
+/// </summary>
+/// <returns>The LSFR state after the last key</returns>  
+static unsigned int cryptRange(const unsigned char* data, unsigned char* output, int dataLength, unsigned int currentValue)
+{
+    const unsigned int* byteStepTable = getByteStepTable();
+    unsigned char keys[KEY_BATCH_SIZE];
+
+    for (int pos = 0; pos < dataLength; pos += KEY_BATCH_SIZE) {
+        int batchSize = (dataLength - pos < KEY_BATCH_SIZE) ? dataLength - pos : KEY_BATCH_SIZE;
+        for (int keyCount = 0; keyCount < batchSize; keyCount++) {
+            currentValue = (currentValue >> 8) ^ byteStepTable[currentValue & 0xFF];
+            keys[keyCount] = (unsigned char)(currentValue & 0xFF);
+        }
+        xorKeys(data + pos, keys, output + pos, batchSize);
+    }
+    return currentValue;
+}
 
 /// <summary>Encrypts and decrypts data using a LSFR feedback and a initialValue (Password). </summary>
 /// <param name="data"> The data stream to be encrypted/decrypted</param>   
@@ -16,8 +153,140 @@ unsigned char* Crypt(unsigned char* data, int dataLength, unsigned int initialVa
     //Sanity Checks
     if (data == nullptr || dataLength <= 0) return data;
 
-    unsigned char* keyStream = LSFR(dataLength,initialValue);
-    return CryptWithXOR(data, keyStream, dataLength);
+    unsigned char* outputStr = new unsigned char[dataLength];
+    cryptRange(data, outputStr, dataLength, initialValue);
+    return outputStr;
+}
+
+/// <summary>Encrypts and decrypts data in place using a LSFR feedback and a initialValue (Password). Nothing is allocated.</summary>
+/// <param name="data"> The data stream to be encrypted/decrypted. It is overwritten with the output.</param>   
+/// <param name="dataLength">The number of characters to encrypt/decrypt."</param>
+/// <param name="initialValue">The password to encrypt/decrypt the data"</param>
+void CryptInPlace(unsigned char* data, int dataLength, unsigned int initialValue)
+{
+    //Sanity Checks
+    if (data == nullptr || dataLength <= 0) return;
+
+    cryptRange(data, data, dataLength, initialValue);
+}
+
+/// <summary>
+/// Encrypts and decrypts data in place on several threads. The data stream is split into slices of at least PARALLEL_CHUNK_SIZE
+/// characters and every slice jumps the LSFR straight to its start, so the output is the same as CryptInPlace.
+/// Starts worker threads on every call, so only use it on large streams from code that is not already parallel.
+/// </summary>
+/// <param name="data"> The data stream to be encrypted/decrypted. It is overwritten with the output.</param>   
+/// <param name="dataLength">The number of characters to encrypt/decrypt."</param>
+/// <param name="initialValue">The password to encrypt/decrypt the data"</param>
+/// <param name="numThreads">The number of threads. 0 or less means one per hardware thread"</param>
+void CryptInPlaceParallel(unsigned char* data, int dataLength, unsigned int initialValue, int numThreads)
+{
+    //Sanity Checks
+    if (data == nullptr || dataLength <= 0) return;
+
+    int numSlices = resolveThreadCount(numThreads);
+    if (numSlices > dataLength / PARALLEL_CHUNK_SIZE) numSlices = dataLength / PARALLEL_CHUNK_SIZE;
+    if (numSlices <= 1) {
+        cryptRange(data, data, dataLength, initialValue);
+        return;
+    }
+
+    int sliceSize = dataLength / numSlices;
+    ParallelFor(numSlices, numSlices, [&](int sliceIndex) {
+        int begin = sliceIndex * sliceSize;
+        int length = (sliceIndex == numSlices - 1) ? dataLength - begin : sliceSize;
+        cryptRange(data + begin, data + begin, length, LSFRJump(initialValue, begin));
+    });
+}
+
+/// <summary>
+/// Encrypts and decrypts a slice of a larger data stream in place without generating the key stream before it.
+/// The slice starts at byteOffset in the full stream that was encrypted with initialValue. Nothing is allocated.
+/// </summary>
+/// <param name="data"> The slice of the data stream to be encrypted/decrypted. It is overwritten with the output.</param>   
+/// <param name="dataLength">The number of characters to encrypt/decrypt."</param>
+/// <param name="initialValue">The password to encrypt/decrypt the data"</param>
+/// <param name="byteOffset">The position of the slice in the full data stream"</param>
+void CryptAt(unsigned char* data, int dataLength, unsigned int initialValue, long long byteOffset)
+{
+    //Sanity Checks
+    if (data == nullptr || dataLength <= 0 || byteOffset < 0) return;
+
+    cryptRange(data, data, dataLength, LSFRJump(initialValue, byteOffset));
+}
+
+/// <summary>
+/// Jumps the LSFR ahead by byteOffset keys (8 steps each) in O(log byteOffset) using precomputed GF(2) transition matrices.
+/// LSFRJump(S, n) is the state used to generate key n of the stream started from S.
+/// </summary>
+/// <param name="initialValue">The initial state of the LSFR"</param>
+/// <param name="byteOffset">The number of keys to skip"</param>
+/// <returns>The LSFR state after byteOffset keys</returns>  
+unsigned int LSFRJump(unsigned int initialValue, long long byteOffset)
+{
+    const LSFRMatrix* jumpTable = getJumpTable();
+    unsigned int currentValue = initialValue;
+
+    //Apply the 2^k jump for every bit k set in the offset.
+    for (int k = 0; byteOffset > 0 && k < JUMP_TABLE_SIZE; k++, byteOffset >>= 1) {
+        if (byteOffset & 1) currentValue = applyMatrix(jumpTable[k], currentValue);
+    }
+    return currentValue;
+}
+
+/*
+ * ===================
+ * CRYPT CONTEXT
+ * ===================
+ */
+CryptContext::CryptContext(unsigned int initialValue)
+{
+    init(initialValue);
+}
+
+/// <summary>Restarts the stream with a new password.</summary>
+/// <param name="initialValue">The password to encrypt/decrypt the data"</param>
+void CryptContext::init(unsigned int initialValue)
+{
+    this->initialValue = initialValue;
+    currentValue = initialValue;
+    bytePosition = 0;
+}
+
+/// <summary>Moves to byteOffset in the stream without processing the data before it.</summary>
+/// <param name="byteOffset">The position in the data stream"</param>
+void CryptContext::seek(long long byteOffset)
+{
+    if (byteOffset < 0) byteOffset = 0;
+    currentValue = LSFRJump(initialValue, byteOffset);
+    bytePosition = byteOffset;
+}
+
+/// <summary>Encrypts/decrypts the next dataLength characters of the stream in place.</summary>
+/// <param name="data"> The next piece of the data stream. It is overwritten with the output.</param>   
+/// <param name="dataLength">The number of characters to encrypt/decrypt."</param>
+void CryptContext::update(unsigned char* data, int dataLength)
+{
+    update(data, data, dataLength);
+}
+
+/// <summary>Encrypts/decrypts the next dataLength characters of the stream into output.</summary>
+/// <param name="data"> The next piece of the data stream</param>   
+/// <param name="output"> The encrypted/decrypted piece, dataLength characters big</param>   
+/// <param name="dataLength">The number of characters to encrypt/decrypt."</param>
+void CryptContext::update(const unsigned char* data, unsigned char* output, int dataLength)
+{
+    //Sanity Checks
+    if (data == nullptr || output == nullptr || dataLength <= 0) return;
+
+    currentValue = cryptRange(data, output, dataLength, currentValue);
+    bytePosition += dataLength;
+}
+
+/// <summary>Returns the number of characters processed since init (or the last seek position).</summary>
+long long CryptContext::position() const
+{
+    return bytePosition;
 }
 
 /// <summary>
@@ -31,16 +300,13 @@ unsigned char* Crypt(unsigned char* data, int dataLength, unsigned int initialVa
 unsigned char* LSFR(int dataLength, unsigned int initialValue)
 {
     unsigned char* keyStream = new unsigned char[dataLength];
+    const unsigned int* byteStepTable = getByteStepTable();
     unsigned int currentValue = initialValue;
 
     //Get a keyStream that is dataLength big where each key is the last byte of the value after the 8th step. 
+    //The 8 steps are done at once with the byte step table.
     for (int keyCount = 0; keyCount < dataLength; keyCount++) {
-        for (int stepCount = 0; stepCount < 8; stepCount++) {
-            // Even Case: S = S >> 1
-            if (currentValue % 2 == 0) currentValue = currentValue >> 1;
-            // Odd Case: S = (S >> 1) ^ F
-            else currentValue = (currentValue >> 1) ^ FEEDBACK_VAL;
-        }
+        currentValue = (currentValue >> 8) ^ byteStepTable[currentValue & 0xFF];
         keyStream[keyCount] = (char)(currentValue & 0xFF);  //Mask the current value to get the last byte. 
     }
 
@@ -59,8 +325,19 @@ unsigned char* CryptWithXOR(unsigned char* data, unsigned char* keyStream, int d
     unsigned char* outputStr = new unsigned char[dataLength];
 
     //XOR the strings together
-    for (int pos = 0; pos < dataLength; pos++) {
-        outputStr[pos] = data[pos] ^ keyStream[pos];
-    }
+    xorKeys(data, keyStream, outputStr, dataLength);
     return outputStr;
 }
+
+/// <summary>
+/// XORs the data stream with the key stream into output without allocating. output may equal data.
+/// </summary>
+/// <param name="data"> The data stream to be encrypted/decrypted</param>   
+/// <param name="keyStream"> The key stream</param>   
+/// <param name="output"> The encrypted/decrypted data stream, dataLength characters big</param>   
+/// <param name="dataLength">The size of the data stream"</param>
+void XORKeyStream(const unsigned char* data, const unsigned char* keyStream, unsigned char* output, int dataLength)
+{
+    if (data == nullptr || keyStream == nullptr || output == nullptr || dataLength <= 0) return;
+    xorKeys(data, keyStream, output, dataLength);
+}
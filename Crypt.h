@@ -7,6 +7,41 @@
 /// <returns>The encrypted or decrypted data</returns>  
 unsigned char* Crypt(unsigned char* data, int dataLength, unsigned int initialValue);
 
+/// <summary>Encrypts and decrypts data in place using a LSFR feedback and a initialValue (Password). Nothing is allocated.</summary>
+/// <param name="data"> The data stream to be encrypted/decrypted. It is overwritten with the output.</param>   
+/// <param name="dataLength">The number of characters to encrypt/decrypt."</param>
+/// <param name="initialValue">The password to encrypt/decrypt the data"</param>
+void CryptInPlace(unsigned char* data, int dataLength, unsigned int initialValue);
+
+/// <summary>
+/// Encrypts and decrypts data in place on several threads, each jumping the LSFR to the start of its slice. Gives the same output as CryptInPlace.
+/// Starts worker threads on every call, so only use it on large streams from code that is not already parallel.
+/// </summary>
+/// <param name="data"> The data stream to be encrypted/decrypted. It is overwritten with the output.</param>   
+/// <param name="dataLength">The number of characters to encrypt/decrypt."</param>
+/// <param name="initialValue">The password to encrypt/decrypt the data"</param>
+/// <param name="numThreads">The number of threads. 0 or less means one per hardware thread"</param>
+void CryptInPlaceParallel(unsigned char* data, int dataLength, unsigned int initialValue, int numThreads = 0);
+
+/// <summary>
+/// Encrypts and decrypts a slice of a larger data stream in place without generating the key stream before it.
+/// The slice starts at byteOffset in the full stream that was encrypted with initialValue. Nothing is allocated.
+/// </summary>
+/// <param name="data"> The slice of the data stream to be encrypted/decrypted. It is overwritten with the output.</param>   
+/// <param name="dataLength">The number of characters to encrypt/decrypt."</param>
+/// <param name="initialValue">The password to encrypt/decrypt the data"</param>
+/// <param name="byteOffset">The position of the slice in the full data stream"</param>
+void CryptAt(unsigned char* data, int dataLength, unsigned int initialValue, long long byteOffset);
+
+/// <summary>
+/// Jumps the LSFR ahead by byteOffset keys (8 steps each) in O(log byteOffset) using precomputed GF(2) transition matrices.
+/// LSFRJump(S, n) is the state used to generate key n of the stream started from S.
+/// </summary>
+/// <param name="initialValue">The initial state of the LSFR"</param>
+/// <param name="byteOffset">The number of keys to skip"</param>
+/// <returns>The LSFR state after byteOffset keys</returns>  
+unsigned int LSFRJump(unsigned int initialValue, long long byteOffset);
+
 /// <summary>
 /// Creates a key cypher stream using the following definition with current state S and feedback value F:
 /// If Lowest bit of S is 0, S = S >> 1.
@@ -25,3 +60,49 @@ unsigned char* LSFR(int dataLength, unsigned int initialValue);
 /// <param name="dataLength">The size of the data stream"</param>
 /// <returns>The encrypted/decrypted data stream</returns>  
 unsigned char* CryptWithXOR(unsigned char* data, unsigned char* keyStream, int dataLength);
+
+/// <summary>
+/// XORs the data stream with the key stream into output without allocating. output may equal data.
+/// </summary>
+/// <param name="data"> The data stream to be encrypted/decrypted</param>   
+/// <param name="keyStream"> The key stream</param>   
+/// <param name="output"> The encrypted/decrypted data stream, dataLength characters big</param>   
+/// <param name="dataLength">The size of the data stream"</param>
+void XORKeyStream(const unsigned char* data, const unsigned char* keyStream, unsigned char* output, int dataLength);
+
+/// <summary>
+/// Encrypts and decrypts a data stream incrementally. The LSFR state is carried across update calls,
+/// so a stream can be processed in pieces (e.g. block by block) and give the same output as a single Crypt call.
+/// </summary>
+class CryptContext
+{
+public:
+	CryptContext(unsigned int initialValue = 0);
+
+	/// <summary>Restarts the stream with a new password.</summary>
+	/// <param name="initialValue">The password to encrypt/decrypt the data"</param>
+	void init(unsigned int initialValue);
+
+	/// <summary>Moves to byteOffset in the stream without processing the data before it.</summary>
+	/// <param name="byteOffset">The position in the data stream"</param>
+	void seek(long long byteOffset);
+
+	/// <summary>Encrypts/decrypts the next dataLength characters of the stream in place.</summary>
+	/// <param name="data"> The next piece of the data stream. It is overwritten with the output.</param>   
+	/// <param name="dataLength">The number of characters to encrypt/decrypt."</param>
+	void update(unsigned char* data, int dataLength);
+
+	/// <summary>Encrypts/decrypts the next dataLength characters of the stream into output.</summary>
+	/// <param name="data"> The next piece of the data stream</param>   
+	/// <param name="output"> The encrypted/decrypted piece, dataLength characters big</param>   
+	/// <param name="dataLength">The number of characters to encrypt/decrypt."</param>
+	void update(const unsigned char* data, unsigned char* output, int dataLength);
+
+	/// <summary>Returns the number of characters processed since init (or the last seek position).</summary>
+	long long position() const;
+
+private:
+	unsigned int initialValue;	//The password of the stream
+	unsigned int currentValue;	//The LSFR state at the current position
+	long long bytePosition;		//The current position in the stream
+};
@@ -1,8 +1,17 @@
+#include <atomic>
+#include <cstdlib>
+#include <ctime>
+#include <filesystem>
 #include <string>
 #include <fstream>
 #include <iostream>
+#include <sys/stat.h>
 #include "DecryptKDB.h"
 #include "Crypt.h"
+#include "KeyStreamCache.h"
+#include "FileIO.h"
+#include "ImageHash.h"
+#include "ThreadPool.h"
 using namespace std;
 	
 /*
@@ -10,23 +19,70 @@ using namespace std;
  * CONSTANTS
  * ==================
 */
-const int MAX_ENTRIES = 127;					//Max number of entries in an entrylist
-const int MAX_BLOCKS = 255;						//Max number of blocks in a blocklist
-const int LSFR_INIT_VALUE = 0x4F574154;			//= 0x4F574154 , LSFR Initial Value to encrypt/decrypt KDB Files
-const char* ENDSTRING = "\xFF\xFF\xFF\xFF";		//String found at the end of a block list or entry list in the KDB File.	
+const size_t MIN_ARENA_CHUNK = 4096;			//Smallest chunk a KDB arena allocates
+const long long MAX_READ_GAP = 4096;			//Blocks at most this many bytes apart are read with a single read
+const long long MAX_READ_SPAN = 1 << 20;		//Largest single read of merged blocks
+const char SIDECAR_FILE_MAGIC[8] = { 'K','D','B','S','I','D','E','2' };	//Magic string at the start of a sidecar cache
+const char* SIDECAR_EXTENSION = ".kdbcache";		//Appended to the KDB file path to get its sidecar cache path
+
+/// <summary>
+/// What identifies a version of a file without reading it. The modification time alone proves nothing: cp -p, rsync -t and tar restore it.
+/// The status change time can't be restored, since the system sets it on every write, rename or copy; together with the file id it
+/// pins the exact file. On Windows, which has neither, the creation time is used and the file id is 0.
+/// </summary>
+struct FileKey
+{
+	unsigned long long fileSize;		//Size of the file
+	long long modifiedTime;				//Modification time of the file
+	long long changeTime;				//Status change time of the file in seconds. 0 if it was too recent to trust (see getFileKey)
+	unsigned long long fileId;			//Inode and device of the file
+};
+
+/// <summary>
+/// Head of a sidecar cache. The cache is trusted without reading the KDB file only when the whole key matches. Otherwise the KDB file
+/// is hashed and the cache is used if the content hash matches. It is followed by numEntries SidecarEntry records, the SidecarBlock records 
+/// and then the decrypted data.
+/// </summary>
+struct SidecarHead
+{
+	char magic[8];						//"KDBSIDE2"
+	FileKey key;						//The key of the KDB file
+	unsigned long long contentHash;		//XXH64 hash of the KDB file
+	unsigned long long numEntries;		//Number of entries in the entry list
+	long long entryListPtrPos;			//Pointer to the entry list in the KDB File
+};
+
+/// <summary>An entry record in a sidecar cache</summary>
+struct SidecarEntry
+{
+	char name[16];						//Entry name as stored in the KDB File
+	__int32 blockListPtr;				//Pointer to the Entry's Block List in the KDB File
+	__int32 state;						//1 = decrypted, -1 = invalid
+	__int32 numBlocks;					//Number of blocks in the block list
+	__int32 dataSize;					//The size in bytes of the decrypted data
+	unsigned long long blocksPtr;		//Pointer to the entry's SidecarBlock records in the sidecar
+	unsigned long long dataPtr;			//Pointer to the entry's decrypted data in the sidecar
+};
+
+/// <summary>A block record in a sidecar cache</summary>
+struct SidecarBlock
+{
+	__int32 size;						//Length of the Block's Data
+	__int32 dataPtr;					//Pointer to the Block's Data in the KDB File
+};
 
 /// <summary>
 /// RUNS CHALLENGE 2 - Decrypts a KDB File and outputs the decrypted info
 /// </summary>
 int DecryptKDBMain() {
 	string path = "";
-	fstream kdbFile;
+	MappedFile kdbFile;
 	bool error = false;
 
 	//SAMPLE PATH:
 	//path="C:/Users/colin/Downloads/SW_2018/SW_2018/store.kdb";
-	if (!openInputFile(kdbFile, "Enter KDB FilePath:", path)) return 1;
-	DecryptKDB(kdbFile,error,true);
+	if (!openMappedFile(kdbFile, "Enter KDB FilePath:", path)) return 1;
+	DecryptKDB(kdbFile,error,true,0);
 	kdbFile.close();
 	return 1;
 }
@@ -37,9 +93,125 @@ int DecryptKDBMain() {
  * CONSTRUCTORS
  * ==================
  */
-KDBData::KDBData(__int16 size)
+KDBData::KDBData(const char* data)
 {
-	encData = new char[size];
+	encData = data;
+}
+
+KDB::KDB()
+{
+	memset(magic, 0, sizeof(magic));
+	entryListPtrPos = 0;
+	entries = nullptr;
+	numEntries = 0;
+}
+
+KDB::KDB(KDB&& other) noexcept
+{
+	*this = move(other);
+}
+
+KDB& KDB::operator=(KDB&& other) noexcept
+{
+	if (this != &other)
+	{
+		memcpy(magic, other.magic, sizeof(magic));
+		entryListPtrPos = other.entryListPtrPos;
+		entries = other.entries;
+		numEntries = other.numEntries;
+		arena = move(other.arena);
+		other.entries = nullptr;
+		other.numEntries = 0;
+	}
+	return *this;
+}
+
+/*
+ * ===================
+ * ARENA
+ * ==================
+ */
+KDBArena::KDBArena()
+{
+	current = nullptr;
+	remaining = 0;
+	nextChunkSize = MIN_ARENA_CHUNK;
+}
+
+KDBArena::KDBArena(KDBArena&& other) noexcept
+{
+	current = nullptr;
+	remaining = 0;
+	nextChunkSize = MIN_ARENA_CHUNK;
+	*this = move(other);
+}
+
+KDBArena& KDBArena::operator=(KDBArena&& other) noexcept
+{
+	if (this != &other)
+	{
+		chunks = move(other.chunks);
+		current = other.current;
+		remaining = other.remaining;
+		nextChunkSize = other.nextChunkSize;
+		other.chunks.clear();
+		other.current = nullptr;
+		other.remaining = 0;
+		other.nextChunkSize = MIN_ARENA_CHUNK;
+	}
+	return *this;
+}
+
+/// <summary>
+/// Makes sure the next bytes can be allocated without a new chunk. Used to size the arena from the KDB file up front.
+/// </summary>
+/// <param name="bytes">The number of bytes about to be allocated</param>
+void KDBArena::reserve(size_t bytes)
+{
+	lock_guard<mutex> lock(arenaMutex);
+	if (bytes <= remaining) return;
+
+	chunks.emplace_back(new char[bytes]);
+	current = chunks.back().get();
+	remaining = bytes;
+}
+
+/// <summary>
+/// Allocates bytes aligned to alignment from the last chunk, or from a new chunk if it does not fit.
+/// </summary>
+/// <param name="bytes">The number of bytes</param>
+/// <param name="alignment">The alignment, a power of 2</param>
+/// <returns>The allocated memory. It is valid until the arena is released</returns>  
+void* KDBArena::allocate(size_t bytes, size_t alignment)
+{
+	lock_guard<mutex> lock(arenaMutex);
+	size_t padding = (alignment - ((size_t)current & (alignment - 1))) & (alignment - 1);
+	if (current == nullptr || padding + bytes > remaining)
+	{
+		size_t chunkSize = (bytes + alignment > nextChunkSize) ? bytes + alignment : nextChunkSize;
+		nextChunkSize *= 2;
+		chunks.emplace_back(new char[chunkSize]);
+		current = chunks.back().get();
+		remaining = chunkSize;
+		padding = (alignment - ((size_t)current & (alignment - 1))) & (alignment - 1);
+	}
+
+	void* memory = current + padding;
+	current += padding + bytes;
+	remaining -= padding + bytes;
+	return memory;
+}
+
+/// <summary>
+/// Frees every chunk. Everything allocated from the arena becomes invalid.
+/// </summary>
+void KDBArena::release()
+{
+	lock_guard<mutex> lock(arenaMutex);
+	chunks.clear();
+	current = nullptr;
+	remaining = 0;
+	nextChunkSize = MIN_ARENA_CHUNK;
 }
 
 /*
@@ -79,7 +251,7 @@ bool getKDBEntryList(KDB &kdb, fstream &kdbFile)
 	char tempBuffer16[16]; 		//16 byte buffer
 	int numEntries = 0;			//Count of entries
 
-	KDBEntry* entryList = new KDBEntry[MAX_ENTRIES];
+	KDBEntry entryList[MAX_ENTRIES];	//Entries are parsed here and then copied into the arena at their exact count
 
 	kdbFile.clear();					//Clear is used in case we went beyond EOF earlier (shouldn't occur). 
 	kdbFile.seekg(kdb.entryListPtrPos);	//Go to entry list position in file.
@@ -98,13 +270,21 @@ bool getKDBEntryList(KDB &kdb, fstream &kdbFile)
 		kdbFile.read(tempBuffer4, 4);
 		numEntries++;
 	}
-	kdb.entries = entryList;
+	kdb.entries = kdb.arena.allocateArray<KDBEntry>(numEntries);
+	for (int entryIndex = 0; entryIndex < numEntries; entryIndex++)
+	{
+		memcpy(kdb.entries[entryIndex].name, entryList[entryIndex].name, sizeof(entryList[entryIndex].name));
+		kdb.entries[entryIndex].blockListPtr = entryList[entryIndex].blockListPtr;
+	}
 	kdb.numEntries = numEntries;
 	return 1;
 }
 
 /// <summary>
-/// Reads the block list and data from the kdb file and saves the corresponding data into the KDB object
+/// Reads the block list and data from the kdb file and saves the corresponding data into the KDB object.
+/// The block lists are read first. The data of all blocks is then read with a read plan sorted by file offset,
+/// so neighbouring blocks are read together instead of with one seek and read per block.
+/// Every block is read straight into its place in the entry's data and decrypted there, so no encrypted copy is kept.
 /// </summary>
 /// <param name="kdb">The kdb object to save entry list info into</param>
 /// <param name="kdbFile">The KDB file to be processed</param>
@@ -116,20 +296,23 @@ bool getKDBCore(KDB &kdb, fstream &kdbFile)
 	int numBlocks;			//Total number of blocks in block list
 	char tempBuffer8[8];	//8 byte buffer
 
+	KDBBlock tempBlocks[MAX_BLOCKS];	//Blocks are parsed here and then copied into the arena at their exact count
 	KDBBlock* blockList;
-	string tempEncString;	//Encrypted data string
-	int totalDataSize;		//Encrypted data string size
+	KDBData* dataList;		//Data nodes of all blocks
+	unsigned char* decData;	//Data of all blocks concatenated. Read encrypted and decrypted in place
+	int totalDataSize;		//Encrypted data size
+	int dataOffset;			//Position of the current block in the entry's data
+	vector<ReadRequest> readPlan;			//Data ranges of every block in the file
+	shared_ptr<const KeyStream> keyStream;	//Shared keys of the KDB password
 
 	//Iterate over every entry to process a corresponding block list. 
-	//After processing the block list, process the data for each block in the block list.
+	//After processing the block list, plan the read of the data for each block in the block list.
 	for (entryIndex = 0; entryIndex < kdb.numEntries; entryIndex++)
 	{
 		//Initialize Block List elements
 		numBlocks = 0;
-		blockList = new KDBBlock[MAX_BLOCKS];
 		//Initialize Encrypted Data elements
 		totalDataSize = 0;
-		tempEncString = "";
 
 		//Go to Block List position in file.
 		kdbFile.clear();
@@ -140,41 +323,253 @@ bool getKDBCore(KDB &kdb, fstream &kdbFile)
 		while (numBlocks < MAX_BLOCKS && strncmp(tempBuffer8, ENDSTRING, 4) != 0)
 		{
 			//Save the 6 bytes into the block
-			memcpy(&blockList[numBlocks].size, tempBuffer8, 2);
-			memcpy(&blockList[numBlocks].dataPtr, tempBuffer8 + 2, 4);
-
-			//Create a data node in the block of the corresponding size
-			blockList[numBlocks].data = new KDBData(blockList[numBlocks].size);
+			memcpy(&tempBlocks[numBlocks].size, tempBuffer8, 2);
+			memcpy(&tempBlocks[numBlocks].dataPtr, tempBuffer8 + 2, 4);
+			if (tempBlocks[numBlocks].size < 0)
+			{
+				cout << "Corrupt KDB File - Block with a negative size";
+				return 0;
+			}
+			totalDataSize += tempBlocks[numBlocks].size;
 
 			//Read off the next 6 bytes for verification
 			kdbFile.read(tempBuffer8, 6);
 			numBlocks++;
 		}
 
-		//Populate the data node in each block by reading the data node in the KDB file and keeping track of the output.
+		//Create the block list, a data node per block and the data buffers in the arena.
+		blockList = kdb.arena.allocateArray<KDBBlock>(numBlocks);
+		dataList = kdb.arena.allocateArray<KDBData>(numBlocks);
+		decData = kdb.arena.allocateArray<unsigned char>(totalDataSize);
+
+		//Each block's data is read straight into its place in decData and decrypted there, so no encrypted copy is kept.
+		dataOffset = 0;
 		for (blockIndex = 0; blockIndex < numBlocks; blockIndex++)
 		{
-			//Go to the data position in the file and read it into encData
-			kdbFile.clear();
-			kdbFile.seekg(blockList[blockIndex].dataPtr);
-			kdbFile.read(blockList[blockIndex].data->encData, blockList[blockIndex].size);
-
-			//Concatenate the encrypted data string to the full data string to be decrypted. This could probably be updated to be more efficient.
-			tempEncString.append(blockList[blockIndex].data->encData, blockList[blockIndex].size);
-
-			totalDataSize += blockList[blockIndex].size;
+			blockList[blockIndex] = tempBlocks[blockIndex];
+			blockList[blockIndex].data = &dataList[blockIndex];
+			readPlan.push_back({ blockList[blockIndex].dataPtr, blockList[blockIndex].size, (char*)decData + dataOffset });
+			dataOffset += blockList[blockIndex].size;
 		}
 
-		//Finalize the entries data. Note that Crypt outputs a unsigned char* with size totalDataSize. 
-		//This means that the decData may not be null-terminated. 
+		//Finalize the entries data. Note that decData has size totalDataSize and may not be null-terminated. 
 		kdb.entries[entryIndex].numBlocks = numBlocks;
 		kdb.entries[entryIndex].blocks = blockList;
-		kdb.entries[entryIndex].decData = Crypt((unsigned char*)(tempEncString.c_str()), totalDataSize, LSFR_INIT_VALUE);
+		kdb.entries[entryIndex].decData = decData;
 		kdb.entries[entryIndex].dataSize = totalDataSize;
 	}
+
+	//Read the data of every block in file order, merging neighbouring blocks into large reads.
+	if (!readCoalesced(kdbFile, readPlan, MAX_READ_GAP, MAX_READ_SPAN))
+	{
+		cout << "Corrupt KDB File - Block data is cut off";
+		return 0;
+	}
+
+	//Decrypt every block in place, at its offset in the entry's key stream.
+	for (entryIndex = 0; entryIndex < kdb.numEntries; entryIndex++)
+	{
+		KDBEntry &entry = kdb.entries[entryIndex];
+		if (entry.numBlocks == 0) continue;
+
+		keyStream = KeyStreamCache::instance().acquire(LSFR_INIT_VALUE, entry.dataSize);
+		dataOffset = 0;
+		for (blockIndex = 0; blockIndex < entry.numBlocks; blockIndex++)
+		{
+			cryptWithKeyStream(*keyStream, dataOffset, entry.decData + dataOffset, entry.decData + dataOffset, entry.blocks[blockIndex].size);
+			dataOffset += entry.blocks[blockIndex].size;
+		}
+	}
 	return 1;
 }
 
+/// <summary>
+/// Checks that length bytes starting at ptr are inside the mapped KDB file
+/// </summary>
+/// <param name="kdbFile">The mapped KDB file</param>
+/// <param name="ptr">Pointer to the record in the KDB File</param>
+/// <param name="length">The record length in bytes</param>
+/// <returns>true if the record can be read</returns>  
+static bool inKDBFile(const MappedFile &kdbFile, long long ptr, long long length)
+{
+	return ptr >= 0 && length >= 0 && (unsigned long long)(ptr + length) <= kdbFile.size();
+}
+
+/// <summary>
+/// Parses the head data straight from the mapped kdb file and saves the corresponding data into the KDB object
+/// </summary>
+/// <param name="kdb">The kdb object to save head info into</param>
+/// <param name="kdbFile">The mapped KDB file to be processed</param>
+/// <returns>true on success, false on failed</returns>  
+bool getKDBHead(KDB &kdb, const MappedFile &kdbFile)
+{
+	if (!inKDBFile(kdbFile, 0, sizeof(kdb.magic) + sizeof(kdb.entryListPtrPos)) || strncmp((const char*)kdbFile.data(), "CT2018", 6) != 0)
+	{
+		cout << "Not a valid KDB File";
+		return 0;
+	}
+	memcpy(&kdb.magic, kdbFile.data(), sizeof(kdb.magic));
+	memcpy(&kdb.entryListPtrPos, kdbFile.data() + sizeof(kdb.magic), sizeof(kdb.entryListPtrPos));
+	return 1;
+}
+
+/// <summary>
+/// Parses the entry list straight from the mapped kdb file and saves the corresponding data into the KDB object
+/// </summary>
+/// <param name="kdb">The kdb object to save entry list info into</param>
+/// <param name="kdbFile">The mapped KDB file to be processed</param>
+/// <returns>true on success, false on failed</returns>  
+bool getKDBEntryList(KDB &kdb, const MappedFile &kdbFile)
+{
+	long long entryPtr = kdb.entryListPtrPos;	//Pointer to the current entry in the KDB File
+	int numEntries = 0;							//Count of entries
+
+	//Each entry is 20 bytes (16 byte name + 4 byte block list pointer). The list ends with ENDSTRING.
+	//The list is validated and counted first so the entries can be allocated at their exact count.
+	while (numEntries < MAX_ENTRIES)
+	{
+		if (!inKDBFile(kdbFile, entryPtr, 4))
+		{
+			cout << "Corrupt KDB File - Entry list is cut off";
+			return 0;
+		}
+		if (memcmp(kdbFile.data() + entryPtr, ENDSTRING, 4) == 0) break;
+		if (!inKDBFile(kdbFile, entryPtr, 20))
+		{
+			cout << "Corrupt KDB File - Entry list is cut off";
+			return 0;
+		}
+		entryPtr += 20;
+		numEntries++;
+	}
+
+	kdb.entries = kdb.arena.allocateArray<KDBEntry>(numEntries);
+	entryPtr = kdb.entryListPtrPos;
+	for (int entryIndex = 0; entryIndex < numEntries; entryIndex++, entryPtr += 20)
+	{
+		memcpy(kdb.entries[entryIndex].name, kdbFile.data() + entryPtr, 16);
+		memcpy(&kdb.entries[entryIndex].blockListPtr, kdbFile.data() + entryPtr + 16, 4);
+	}
+	kdb.numEntries = numEntries;
+	return 1;
+}
+
+/// <summary>
+/// Parses the block list of one entry straight from the mapped kdb file and decrypts its data. 
+/// The blocks reference their data in the mapping instead of copying it, so the mapping must outlive the KDB object.
+/// </summary>
+/// <param name="kdb">The kdb object to save the entry's block list and data into</param>
+/// <param name="entryIndex">Index of the entry in the entry list</param>
+/// <param name="kdbFile">The mapped KDB file to be processed</param>
+/// <returns>true on success, false on failed</returns>  
+bool getKDBEntryData(KDB &kdb, int entryIndex, const MappedFile &kdbFile)
+{
+	KDBEntry &entry = kdb.entries[entryIndex];
+	long long blockPtr = entry.blockListPtr;	//Pointer to the current block in the KDB File
+	int numBlocks = 0;							//Total number of blocks in block list
+	int totalDataSize = 0;						//Encrypted data size
+	int dataOffset = 0;							//Position of the current block in the decrypted data
+	__int16 size;								//Size of the current block
+	__int32 dataPtr;							//Data pointer of the current block
+
+	KDBBlock* blockList;
+	KDBData* dataList;
+	unsigned char* decData;
+	shared_ptr<const KeyStream> keyStream;
+
+	//Each block is 6 bytes (2 byte size + 4 byte data pointer). The list ends with ENDSTRING.
+	//The list is validated and counted first so the blocks can be allocated at their exact count.
+	while (numBlocks < MAX_BLOCKS)
+	{
+		if (!inKDBFile(kdbFile, blockPtr, 4)) break;
+		if (memcmp(kdbFile.data() + blockPtr, ENDSTRING, 4) == 0) break;
+		if (!inKDBFile(kdbFile, blockPtr, 6)) break;
+
+		memcpy(&size, kdbFile.data() + blockPtr, 2);
+		memcpy(&dataPtr, kdbFile.data() + blockPtr + 2, 4);
+		if (!inKDBFile(kdbFile, dataPtr, size)) break;
+
+		totalDataSize += size;
+		blockPtr += 6;
+		numBlocks++;
+	}
+	if (numBlocks < MAX_BLOCKS && !(inKDBFile(kdbFile, blockPtr, 4) && memcmp(kdbFile.data() + blockPtr, ENDSTRING, 4) == 0))
+	{
+		cout << "Corrupt KDB File - Block list of " << string(entry.name, strnlen(entry.name, sizeof(entry.name))) << " is invalid";
+		return 0;
+	}
+
+	blockList = kdb.arena.allocateArray<KDBBlock>(numBlocks);
+	dataList = kdb.arena.allocateArray<KDBData>(numBlocks);
+	decData = kdb.arena.allocateArray<unsigned char>(totalDataSize);
+
+	//Decrypt every block straight from the mapping into the entry's data. The data nodes are views into the mapping.
+	blockPtr = entry.blockListPtr;
+	keyStream = KeyStreamCache::instance().acquire(LSFR_INIT_VALUE, totalDataSize);
+	for (int blockIndex = 0; blockIndex < numBlocks; blockIndex++, blockPtr += 6)
+	{
+		memcpy(&blockList[blockIndex].size, kdbFile.data() + blockPtr, 2);
+		memcpy(&blockList[blockIndex].dataPtr, kdbFile.data() + blockPtr + 2, 4);
+		dataList[blockIndex].encData = (const char*)kdbFile.data() + blockList[blockIndex].dataPtr;
+		blockList[blockIndex].data = &dataList[blockIndex];
+
+		cryptWithKeyStream(*keyStream, dataOffset, (const unsigned char*)dataList[blockIndex].encData, decData + dataOffset, blockList[blockIndex].size);
+		dataOffset += blockList[blockIndex].size;
+	}
+
+	entry.numBlocks = numBlocks;
+	entry.blocks = blockList;
+	entry.decData = decData;
+	entry.dataSize = totalDataSize;
+	return 1;
+}
+
+/// <summary>
+/// Parses the block list and data of every entry straight from the mapped kdb file and saves the corresponding data into the KDB object.
+/// Entries are independent, so with more than one thread they are decrypted concurrently. Every thread reads its records 
+/// at their position straight from the shared read-only mapping, so no file position is shared between threads.
+/// The result is the same as with a single thread.
+/// </summary>
+/// <param name="kdb">The kdb object to save entry list info into</param>
+/// <param name="kdbFile">The mapped KDB file to be processed</param>
+/// <param name="numThreads">The number of worker threads. 0 or less means one per hardware thread</param>
+/// <returns>true on success, false on failed</returns>  
+bool getKDBCore(KDB &kdb, const MappedFile &kdbFile, int numThreads)
+{
+	if (resolveThreadCount(numThreads) == 1)
+	{
+		for (int entryIndex = 0; entryIndex < kdb.numEntries; entryIndex++)
+		{
+			if (!getKDBEntryData(kdb, entryIndex, kdbFile)) return 0;
+		}
+		return 1;
+	}
+
+	atomic<bool> success(true);
+	ParallelFor(kdb.numEntries, numThreads, [&](int entryIndex) {
+		if (success && !getKDBEntryData(kdb, entryIndex, kdbFile)) success = false;
+	});
+	return success;
+}
+
+/// <summary>
+/// Prints every decrypted entry to standard output
+/// </summary>
+/// <param name="kdb">The processed KDB object</param>
+static void printKDBEntries(const KDB &kdb)
+{
+	//The entries are formatted into one buffer and written at once, instead of one stream insertion per byte.
+	string output;
+	for (int entryIndex = 0; entryIndex < kdb.numEntries; entryIndex++)
+	{
+		output += kdb.entries[entryIndex].name;
+		output += " - ";
+		output.append((const char*)kdb.entries[entryIndex].decData, kdb.entries[entryIndex].dataSize);
+		output += "\n";
+	}
+	cout.write(output.data(), output.size());
+}
+
 /// <summary>
 /// Prompts the user if needed and opens an input file in binary mode. 
 /// </summary>
@@ -198,6 +593,415 @@ bool openInputFile(fstream& inputFile, string prompt, string &pathName)
 	return 1;
 }
 
+/// <summary>
+/// Prompts the user if needed and maps an input file read-only. 
+/// </summary>
+/// <param name="inputFile">The file to be mapped</param>
+/// <param name="prompt">The file prompt</param>
+/// <param name="pathName">The file pathName, "" by default</param>
+/// <returns>true on success, false on failed</returns>  
+bool openMappedFile(MappedFile& inputFile, string prompt, string &pathName)
+{
+	if (pathName == "") {
+		cout << prompt;
+		cin >> pathName;
+	}
+
+	if (!inputFile.open(pathName))
+	{
+		cout << "File Does Not Exist\n";
+		return 0;
+	}
+	return 1;
+}
+
+/// <summary>
+/// Returns true if the KDB_SIDECAR_CACHE environment variable is set (and not "0"). Only the command line drivers read it
+/// to pick their default; library callers choose between KDBReader::open and KDBReader::openCached themselves.
+/// </summary>
+bool isSidecarCacheRequested()
+{
+	const char* useSidecar = getenv(SIDECAR_ENV_VARIABLE);
+	return useSidecar != nullptr && *useSidecar != '\0' && strcmp(useSidecar, "0") != 0;
+}
+
+/*
+* ===================
+* KDB READER
+* ===================
+*/
+KDBReader::KDBReader()
+{
+}
+
+KDBReader::~KDBReader()
+{
+	close();
+}
+
+/// <summary>
+/// Maps and indexes the KDB file at pathName. Entries are not decrypted until they are requested.
+/// Callers that want the sidecar cache use openCached instead.
+/// </summary>
+/// <param name="pathName">The KDB file path</param>
+/// <returns>true on success, false on failed</returns>  
+bool KDBReader::open(const string& pathName)
+{
+	MappedFile mappedFile;
+	if (!mappedFile.open(pathName)) return 0;
+	return open(move(mappedFile));
+}
+
+/// <summary>
+/// Indexes an already mapped KDB file. Only the head and the entry list are parsed.
+/// </summary>
+/// <param name="mappedFile">The mapped KDB file. The reader takes over the mapping</param>
+/// <returns>true on success, false on failed</returns>  
+bool KDBReader::open(MappedFile&& mappedFile)
+{
+	close();
+	kdbFile = move(mappedFile);
+	kdb.arena.reserve((size_t)kdbFile.size() + MIN_ARENA_CHUNK);
+
+	if (!getKDBHead(kdb, kdbFile) || !getKDBEntryList(kdb, kdbFile))
+	{
+		close();
+		return 0;
+	}
+
+	entryState.assign(kdb.numEntries, 0);
+	indexEntries();
+	return 1;
+}
+
+/// <summary>
+/// Opens the KDB file at pathName through its sidecar cache (pathName + ".kdbcache"). If the sidecar is valid it is mapped and
+/// every entry is served from it, without mapping, parsing or decrypting the KDB file. Otherwise the KDB file is opened,
+/// every entry is decrypted and the sidecar is written for the next open. Failing to write the sidecar is not an error.
+/// </summary>
+/// <param name="pathName">The KDB file path</param>
+/// <returns>true on success, false on failed</returns>  
+bool KDBReader::openCached(const string& pathName)
+{
+	string sidecarPath = pathName + SIDECAR_EXTENSION;
+	if (loadSidecar(pathName, sidecarPath)) return 1;
+
+	MappedFile mappedFile;
+	if (!mappedFile.open(pathName) || !open(move(mappedFile))) return 0;
+
+	for (int entryIndex = 0; entryIndex < kdb.numEntries; entryIndex++) getEntry(entryIndex);
+	saveSidecar(pathName, sidecarPath);
+	return 1;
+}
+
+/// <summary>
+/// Releases the decrypted entries and the mappings
+/// </summary>
+void KDBReader::close()
+{
+	lock_guard<mutex> lock(entryMutex);
+	kdb = KDB();
+	entryState.clear();
+	nameIndex.clear();
+	kdbFile.close();
+	sidecarFile.close();
+}
+
+/// <summary>
+/// Builds the name index of the entry list
+/// </summary>
+void KDBReader::indexEntries()
+{
+	for (int entryIndex = 0; entryIndex < kdb.numEntries; entryIndex++)
+	{
+		nameIndex[getEntryName(entryIndex)].push_back(entryIndex);
+	}
+}
+
+int KDBReader::getNumEntries() const
+{
+	return kdb.numEntries;
+}
+
+/// <summary>
+/// Returns the entry's name without decrypting the entry. Names are cut at 16 characters if they are not null-terminated.
+/// </summary>
+string KDBReader::getEntryName(int entryIndex) const
+{
+	if (entryIndex < 0 || entryIndex >= kdb.numEntries) return "";
+
+	const char* name = kdb.entries[entryIndex].name;
+	return string(name, strnlen(name, sizeof(kdb.entries[entryIndex].name)));
+}
+
+/// <summary>
+/// Returns the decrypted entry. The entry's block list and data are parsed and decrypted on the first request.
+/// </summary>
+/// <param name="entryIndex">Index of the entry in the entry list</param>
+/// <returns>The decrypted entry, nullptr if the index or the entry is invalid</returns>  
+const KDBEntry* KDBReader::getEntry(int entryIndex)
+{
+	if (entryIndex < 0 || entryIndex >= kdb.numEntries) return nullptr;
+
+	lock_guard<mutex> lock(entryMutex);
+	if (entryState[entryIndex] == 0)
+	{
+		entryState[entryIndex] = getKDBEntryData(kdb, entryIndex, kdbFile) ? 1 : -1;
+	}
+	return (entryState[entryIndex] == 1) ? &kdb.entries[entryIndex] : nullptr;
+}
+
+/// <summary>
+/// Returns the first decrypted entry called name. Only that entry is decrypted.
+/// </summary>
+/// <param name="name">The entry name</param>
+/// <returns>The decrypted entry, nullptr if there is none</returns>  
+const KDBEntry* KDBReader::findEntry(const string& name)
+{
+	auto found = nameIndex.find(name);
+	if (found == nameIndex.end()) return nullptr;
+	return getEntry(found->second.front());
+}
+
+/// <summary>
+/// Returns every decrypted entry called name, in entry list order. Invalid entries are skipped.
+/// </summary>
+/// <param name="name">The entry name</param>
+/// <returns>The decrypted entries</returns>  
+vector<const KDBEntry*> KDBReader::findEntries(const string& name)
+{
+	vector<const KDBEntry*> entries;
+	auto found = nameIndex.find(name);
+	if (found == nameIndex.end()) return entries;
+
+	for (int entryIndex : found->second)
+	{
+		const KDBEntry* entry = getEntry(entryIndex);
+		if (entry != nullptr) entries.push_back(entry);
+	}
+	return entries;
+}
+
+/// <summary>
+/// Decrypts and visits every entry in entry list order, without printing anything. Invalid entries are skipped.
+/// </summary>
+/// <param name="onEntry">Called for every entry. Returns false to stop the visit</param>
+/// <returns>true if every entry was visited, false if the visit was stopped</returns>  
+bool KDBReader::forEachEntry(const KDBEntryCallback& onEntry)
+{
+	for (int entryIndex = 0; entryIndex < getNumEntries(); entryIndex++)
+	{
+		const KDBEntry* entry = getEntry(entryIndex);
+		if (entry != nullptr && !onEntry(entryIndex, *entry)) return 0;
+	}
+	return 1;
+}
+
+/*
+* ===================
+* SIDECAR CACHE
+* ===================
+*/
+
+/// <summary>
+/// Returns the XXH64 hash of the whole mapped file
+/// </summary>
+static unsigned long long hashKDBFile(const MappedFile &kdbFile)
+{
+	return XXH64(kdbFile.data(), (size_t)kdbFile.size());
+}
+
+/// <summary>
+/// Gets the key of the file at pathName. The status change time only has a resolution of seconds, so a file changed within the same second
+/// could keep it. A change time that is not at least two seconds old is therefore recorded as 0, which is never trusted.
+/// </summary>
+/// <returns>true on success, false on failed</returns>  
+static bool getFileKey(const string& pathName, FileKey& key)
+{
+	error_code error;
+	key.fileSize = filesystem::file_size(pathName, error);
+	if (error) return 0;
+	key.modifiedTime = (long long)filesystem::last_write_time(pathName, error).time_since_epoch().count();
+	if (error) return 0;
+
+#ifdef _WIN32
+	struct _stat64 status;
+	if (_stat64(pathName.c_str(), &status) != 0) return 0;
+	key.fileId = 0;
+#else
+	struct stat status;
+	if (stat(pathName.c_str(), &status) != 0) return 0;
+	key.fileId = ((unsigned long long)status.st_dev << 32) ^ (unsigned long long)status.st_ino;
+#endif
+	key.changeTime = (long long)status.st_ctime;
+	if (key.changeTime >= (long long)time(nullptr) - 1) key.changeTime = 0;
+	return 1;
+}
+
+/// <summary>
+/// Returns true if a recorded key proves the file is the one the sidecar was written for, without reading it
+/// </summary>
+static bool fileKeyMatches(const FileKey& recorded, const FileKey& current)
+{
+	return recorded.changeTime != 0 && recorded.fileSize == current.fileSize && recorded.modifiedTime == current.modifiedTime &&
+		recorded.changeTime == current.changeTime && recorded.fileId == current.fileId;
+}
+
+/// <summary>
+/// Opens a sidecar cache if it is valid for the KDB file at pathName. The sizes must match. The sidecar is trusted without reading the
+/// KDB file only if the whole key matches (see FileKey); otherwise (the file was copied, touched, replaced or restored with its old
+/// modification time) the KDB file is hashed instead, and on a match the sidecar's key is updated so the next open is quick again.
+/// </summary>
+/// <param name="pathName">The KDB file path</param>
+/// <param name="sidecarPath">The sidecar cache path</param>
+/// <returns>true if the sidecar was valid and opened</returns>  
+bool KDBReader::loadSidecar(const string& pathName, const string& sidecarPath)
+{
+	SidecarHead head;
+	FileKey key;
+
+	close();
+	if (!getFileKey(pathName, key)) return 0;
+
+	//Check the key before mapping the sidecar so it can still be updated. The sidecar is opened read-only, so a sidecar in a
+	//read-only location still loads; it is only reopened for writing when its key needs refreshing.
+	ifstream headFile(sidecarPath, ios::in | ios::binary);
+	if (!headFile.read((char*)&head, sizeof(head))) return 0;
+	headFile.close();
+	if (memcmp(head.magic, SIDECAR_FILE_MAGIC, sizeof(head.magic)) != 0 || head.key.fileSize != key.fileSize) return 0;
+	if (!fileKeyMatches(head.key, key))
+	{
+		MappedFile mappedFile;
+		if (!mappedFile.open(pathName) || hashKDBFile(mappedFile) != head.contentHash) return 0;
+
+		//Refreshing is only an optimisation, so a sidecar that can't be written is still used.
+		head.key = key;
+		fstream refreshFile(sidecarPath, ios::in | ios::out | ios::binary);
+		if (refreshFile.is_open()) refreshFile.write((const char*)&head, sizeof(head));
+	}
+
+	if (!sidecarFile.open(sidecarPath) || sidecarFile.size() < sizeof(head) || head.numEntries > MAX_ENTRIES ||
+		head.numEntries * sizeof(SidecarEntry) > sidecarFile.size() - sizeof(head))
+	{
+		close();
+		return 0;
+	}
+
+	memcpy(kdb.magic, "CT2018", sizeof(kdb.magic));
+	kdb.entryListPtrPos = (__int32)head.entryListPtrPos;
+	kdb.numEntries = (int)head.numEntries;
+	kdb.entries = kdb.arena.allocateArray<KDBEntry>(kdb.numEntries);
+	entryState.assign(kdb.numEntries, -1);
+
+	//The decrypted data is used straight from the mapping. The block lists are rebuilt in the arena.
+	for (int entryIndex = 0; entryIndex < kdb.numEntries; entryIndex++)
+	{
+		SidecarEntry record;
+		KDBEntry &entry = kdb.entries[entryIndex];
+		memcpy(&record, sidecarFile.data() + sizeof(head) + entryIndex * sizeof(record), sizeof(record));
+		memcpy(entry.name, record.name, sizeof(entry.name));
+		entry.blockListPtr = record.blockListPtr;
+		if (record.state != 1) continue;
+
+		if (record.numBlocks < 0 || record.numBlocks > MAX_BLOCKS || record.dataSize < 0 ||
+			record.blocksPtr > sidecarFile.size() || record.numBlocks * sizeof(SidecarBlock) > sidecarFile.size() - record.blocksPtr ||
+			record.dataPtr > sidecarFile.size() || (unsigned long long)record.dataSize > sidecarFile.size() - record.dataPtr)
+		{
+			close();
+			return 0;
+		}
+
+		entry.blocks = kdb.arena.allocateArray<KDBBlock>(record.numBlocks);
+		KDBData* dataList = kdb.arena.allocateArray<KDBData>(record.numBlocks);
+		for (int blockIndex = 0; blockIndex < record.numBlocks; blockIndex++)
+		{
+			SidecarBlock block;
+			memcpy(&block, sidecarFile.data() + record.blocksPtr + blockIndex * sizeof(block), sizeof(block));
+			entry.blocks[blockIndex].size = (__int16)block.size;
+			entry.blocks[blockIndex].dataPtr = block.dataPtr;
+			entry.blocks[blockIndex].data = &dataList[blockIndex];
+		}
+		entry.numBlocks = record.numBlocks;
+		entry.decData = (unsigned char*)sidecarFile.data() + record.dataPtr;
+		entry.dataSize = record.dataSize;
+		entryState[entryIndex] = 1;
+	}
+
+	indexEntries();
+	return 1;
+}
+
+/// <summary>
+/// Writes the sidecar cache of the opened KDB file. Every entry must have been requested already.
+/// The sidecar is written to a temporary file first and then replaces the old one, so a process that has the old one mapped never sees a partial file.
+/// </summary>
+/// <param name="pathName">The KDB file path</param>
+/// <param name="sidecarPath">The sidecar cache path</param>
+/// <returns>true on success, false on failed</returns>  
+bool KDBReader::saveSidecar(const string& pathName, const string& sidecarPath)
+{
+	SidecarHead head;
+	unsigned long long blocksPtr, dataPtr;
+
+	memcpy(head.magic, SIDECAR_FILE_MAGIC, sizeof(head.magic));
+	if (!getFileKey(pathName, head.key) || head.key.fileSize != kdbFile.size()) return 0;
+	head.contentHash = hashKDBFile(kdbFile);
+	head.numEntries = kdb.numEntries;
+	head.entryListPtrPos = kdb.entryListPtrPos;
+
+	//Every writer uses its own temporary file, so processes opening the same KDB file never write into each other's sidecar.
+	string tempPath = makeTempPath(sidecarPath);
+	ofstream sidecar(tempPath, ios::out | ios::binary | ios::trunc);
+	if (!sidecar.is_open()) return 0;
+	sidecar.write((const char*)&head, sizeof(head));
+
+	//Entry records, then every block list, then every entry's decrypted data.
+	blocksPtr = sizeof(head) + kdb.numEntries * sizeof(SidecarEntry);
+	dataPtr = blocksPtr;
+	for (int entryIndex = 0; entryIndex < kdb.numEntries; entryIndex++)
+	{
+		if (entryState[entryIndex] == 1) dataPtr += kdb.entries[entryIndex].numBlocks * sizeof(SidecarBlock);
+	}
+	for (int entryIndex = 0; entryIndex < kdb.numEntries; entryIndex++)
+	{
+		const KDBEntry &entry = kdb.entries[entryIndex];
+		SidecarEntry record = {};
+		memcpy(record.name, entry.name, sizeof(record.name));
+		record.blockListPtr = entry.blockListPtr;
+		record.state = entryState[entryIndex];
+		if (record.state == 1)
+		{
+			record.numBlocks = entry.numBlocks;
+			record.dataSize = entry.dataSize;
+			record.blocksPtr = blocksPtr;
+			record.dataPtr = dataPtr;
+			blocksPtr += entry.numBlocks * sizeof(SidecarBlock);
+			dataPtr += entry.dataSize;
+		}
+		sidecar.write((const char*)&record, sizeof(record));
+	}
+	for (int entryIndex = 0; entryIndex < kdb.numEntries; entryIndex++)
+	{
+		if (entryState[entryIndex] != 1) continue;
+		for (int blockIndex = 0; blockIndex < kdb.entries[entryIndex].numBlocks; blockIndex++)
+		{
+			SidecarBlock block = { kdb.entries[entryIndex].blocks[blockIndex].size, kdb.entries[entryIndex].blocks[blockIndex].dataPtr };
+			sidecar.write((const char*)&block, sizeof(block));
+		}
+	}
+	for (int entryIndex = 0; entryIndex < kdb.numEntries; entryIndex++)
+	{
+		if (entryState[entryIndex] == 1) sidecar.write((const char*)kdb.entries[entryIndex].decData, kdb.entries[entryIndex].dataSize);
+	}
+	sidecar.close();
+	if (sidecar.fail())
+	{
+		remove(tempPath.c_str());
+		return 0;
+	}
+	return replaceFile(tempPath, sidecarPath);
+}
+
 /*
 * ===================
 * MAIN FUNCTIONS
@@ -211,11 +1015,18 @@ bool openInputFile(fstream& inputFile, string prompt, string &pathName)
 /// <param name="error">Outputs 1 if an error is found</param>
 /// <param name=printEntries>If true then print out the decrypted info</param>
 /// <returns>The processed KDB object</returns>
-KDB& DecryptKDB(fstream &kdbFile, bool& error,bool printEntries)
+KDB DecryptKDB(fstream &kdbFile, bool& error,bool printEntries)
 {
 	KDB newKDB;
+	streampos startPos = kdbFile.tellg();
 	error = false;
 
+	//Size the arena from the file: blocks are decrypted in place, so the data is at most the file size.
+	kdbFile.seekg(0, ios::end);
+	if (kdbFile.tellg() > startPos) newKDB.arena.reserve((size_t)(kdbFile.tellg() - startPos) + MIN_ARENA_CHUNK);
+	kdbFile.clear();
+	kdbFile.seekg(startPos);
+
 	//KDB HEAD
 	if (!getKDBHead(newKDB, kdbFile))
 	{
@@ -238,19 +1049,38 @@ KDB& DecryptKDB(fstream &kdbFile, bool& error,bool printEntries)
 	}
 
 	//Output to standard output
-	if (printEntries)
+	if (printEntries) printKDBEntries(newKDB);
+
+	return newKDB;
+}
+
+/// <summary>
+/// Decrypts a mapped .kdb file and outputs the decrypted entries. Records are parsed straight from the mapping
+/// and the blocks reference their data in the mapping, so kdbFile must stay open while the KDB object is used.
+/// </summary>
+/// <param name="kdbFile">The mapped KDB file to be processed</param>
+/// <param name="error">Outputs 1 if an error is found</param>
+/// <param name=printEntries>If true then print out the decrypted info</param>
+/// <param name=numThreads>The number of threads decrypting entries. 0 or less means one per hardware thread</param>
+/// <returns>The processed KDB object</returns>
+KDB DecryptKDB(const MappedFile &kdbFile, bool& error, bool printEntries, int numThreads)
+{
+	KDB newKDB;
+	error = false;
+
+	//Size the arena from the file: the decrypted data is at most the file size. The encrypted data stays in the mapping.
+	newKDB.arena.reserve((size_t)kdbFile.size() + MIN_ARENA_CHUNK);
+
+	//KDB HEAD, ENTRY LIST, BLOCK LIST and DATA
+	if (!getKDBHead(newKDB, kdbFile) || !getKDBEntryList(newKDB, kdbFile) || !getKDBCore(newKDB, kdbFile, numThreads))
 	{
-		for (int entryIndex = 0; entryIndex < (newKDB).numEntries; entryIndex++)
-		{
-			cout << (newKDB).entries[entryIndex].name << " - ";
-			for (int index = 0; index < (newKDB).entries[entryIndex].dataSize; index++)
-			{
-				cout << (newKDB).entries[entryIndex].decData[index];
-			}
-			cout << "\n";
-		}
+		error = true;
+		return newKDB;
 	}
 
+	//Output to standard output
+	if (printEntries) printKDBEntries(newKDB);
+
 	return newKDB;
 }
 
@@ -1,7 +1,28 @@
+#pragma once
 #include <string>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#include "FileIO.h"
 using namespace std;
 
 
+/*
+ * ===================
+ * KDB FILE FORMAT
+ * ==================
+*/
+const int MAX_ENTRIES = 127;						//Max number of entries in an entrylist
+const int MAX_BLOCKS = 255;							//Max number of blocks in a blocklist
+const int LSFR_INIT_VALUE = 0x4F574154;				//= 0x4F574154 , LSFR Initial Value to encrypt/decrypt KDB Files
+const char* const ENDSTRING = "\xFF\xFF\xFF\xFF";	//String found at the end of a block list or entry list in the KDB File.	
+const char* const SIDECAR_ENV_VARIABLE = "KDB_SIDECAR_CACHE";	//Environment variable that makes the command line drivers use the sidecar cache
+
 /// <summary>
 /// RUNS CHALLENGE 2 - Decrypts a KDB File and outputs the decrypted info
 /// </summary>
@@ -12,12 +33,47 @@ int DecryptKDBMain();
 * CLASS DECLARATIONS
 * ===================
 */
+/// <summary>
+/// Monotonic memory arena that owns every node of a KDB object. Memory is handed out in order from large chunks
+/// and is only released all at once, when the arena is released or destroyed. Only trivially destructible types can be allocated.
+/// Allocations are thread-safe so entries can be decrypted in parallel.
+/// </summary>
+class KDBArena
+{
+public:
+	KDBArena();
+	KDBArena(KDBArena&& other) noexcept;
+	KDBArena& operator=(KDBArena&& other) noexcept;
+	KDBArena(const KDBArena&) = delete;
+	KDBArena& operator=(const KDBArena&) = delete;
+
+	void reserve(size_t bytes);							//Makes sure the next bytes can be allocated without a new chunk
+	void* allocate(size_t bytes, size_t alignment);		//Allocates bytes aligned to alignment
+	void release();										//Frees every chunk
+
+	/// <summary>Allocates count value-initialized objects of type T</summary>
+	template <class T> T* allocateArray(size_t count)
+	{
+		static_assert(is_trivially_destructible<T>::value, "KDBArena never runs destructors");
+		T* items = (T*)allocate(sizeof(T) * count, alignof(T));
+		for (size_t index = 0; index < count; index++) new (&items[index]) T();
+		return items;
+	}
+
+private:
+	mutex arenaMutex;					//Guards every member below
+	vector<unique_ptr<char[]>> chunks;	//Every chunk allocated
+	char* current;						//Next free byte in the last chunk
+	size_t remaining;					//Free bytes in the last chunk
+	size_t nextChunkSize;				//Size of the next chunk. Doubles with each chunk
+};
+
 /// <summary>Class for the Data node in the KDB file</summary>
 class KDBData
 {
 public:
-	char* encData;			//The encrypted data in the KDB File
-	KDBData(__int16);		//Method to initialize encData size
+	const char* encData;			//The encrypted data in the KDB File: a view into a mapped KDB File. nullptr if the entry was read from a stream (it is decrypted in place) or loaded from a sidecar cache
+	KDBData(const char* = nullptr);	//Method to point encData at the encrypted data
 };
 
 /// <summary>Class for a KDB Block in the KDB file</summary>
@@ -44,7 +100,10 @@ public:
 	int dataSize;			//The size in bytes of the decrypted data
 };
 
-/// <summary>Class for a KDB object. Use decryptKDB to populate object info</summary>
+/// <summary>
+/// Class for a KDB object. Use decryptKDB to populate object info.
+/// Every node is owned by the object's arena, so the object can be moved and is released in one step.
+/// </summary>
 class KDB
 {
 public:
@@ -53,8 +112,65 @@ public:
 
 	KDBEntry* entries;			//Pointer to the entry list 
 	int numEntries;				//Number of entries in the entry list
+
+	KDBArena arena;				//Owns the entry list, block lists, data nodes and decrypted data
+
+	KDB();
+	KDB(KDB&& other) noexcept;
+	KDB& operator=(KDB&& other) noexcept;
+};
+
+/// <summary>
+/// Called for every valid entry of a KDB file with its index in the entry list. Returning false stops the visit.
+/// </summary>
+typedef function<bool(int entryIndex, const KDBEntry& entry)> KDBEntryCallback;
+
+/// <summary>
+/// Opens a KDB file once and decrypts entries on demand. Only the head and the entry list are parsed by open, 
+/// together with a name index. The block list and data of an entry are parsed and decrypted the first time the
+/// entry is requested and cached after that. Requests are thread-safe.
+/// openCached keeps a sidecar cache next to the KDB file (<path>.kdbcache) holding the entry list and the decrypted data.
+/// A valid sidecar is mapped and used directly, so no parsing or decryption is done at all.
+/// </summary>
+class KDBReader
+{
+public:
+	KDBReader();
+	~KDBReader();
+	KDBReader(const KDBReader&) = delete;
+	KDBReader& operator=(const KDBReader&) = delete;
+
+	bool open(const string& pathName);		//Maps and indexes the KDB file at pathName. Returns true on success
+	bool openCached(const string& pathName);	//Opens the KDB file at pathName through its sidecar cache. Returns true on success
+	bool open(MappedFile&& mappedFile);		//Indexes an already mapped KDB file. Returns true on success
+	void close();							//Releases the decrypted entries and the mapping
+
+	int getNumEntries() const;								//Number of entries in the entry list
+	string getEntryName(int entryIndex) const;				//The entry's name. Does not decrypt the entry
+	const KDBEntry* getEntry(int entryIndex);				//The decrypted entry, nullptr if it is invalid
+	const KDBEntry* findEntry(const string& name);			//The first decrypted entry called name, nullptr if there is none
+	vector<const KDBEntry*> findEntries(const string& name);	//Every decrypted entry called name, in entry list order
+	bool forEachEntry(const KDBEntryCallback& onEntry);		//Visits every decrypted entry in entry list order. Returns false if the visit was stopped
+
+private:
+	void indexEntries();							//Builds the name index of the entry list
+	bool loadSidecar(const string& pathName, const string& sidecarPath);	//Opens a valid sidecar cache of the KDB file at pathName
+	bool saveSidecar(const string& pathName, const string& sidecarPath);	//Writes the sidecar cache of the opened KDB file
+
+	MappedFile kdbFile;							//The mapped KDB file. Blocks reference their data in it
+	MappedFile sidecarFile;						//The mapped sidecar cache. Entries loaded from it reference their decrypted data in it
+	KDB kdb;									//Head and entry list. Only requested entries have block lists and data
+	vector<char> entryState;					//Per entry: 0 = not decrypted, 1 = decrypted, -1 = invalid
+	unordered_map<string, vector<int>> nameIndex;	//Entry name -> indexes in the entry list
+	mutex entryMutex;							//Guards entryState and the decryption of entries
 };
 
 bool openInputFile(fstream& inputFile, string prompt, string &pathName);
 
-KDB& DecryptKDB(fstream& kdbFile,bool &error, bool printEntries = true);
\ No newline at end of file
+bool openMappedFile(MappedFile& inputFile, string prompt, string &pathName);
+
+bool isSidecarCacheRequested();		//True if KDB_SIDECAR_CACHE is set (and not "0"). Only the command line drivers read it
+
+KDB DecryptKDB(fstream& kdbFile,bool &error, bool printEntries = true);
+
+KDB DecryptKDB(const MappedFile& kdbFile, bool &error, bool printEntries = true, int numThreads = 1);
\ No newline at end of file
@@ -0,0 +1,406 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include "FileIO.h"
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+/*
+* ===================
+* MAPPED FILE
+* ===================
+*/
+MappedFile::MappedFile()
+{
+	mappedData = nullptr;
+	mappedSize = 0;
+	opened = false;
+#ifdef _WIN32
+	fileHandle = INVALID_HANDLE_VALUE;
+	mappingHandle = nullptr;
+#else
+	fileDescriptor = -1;
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept : MappedFile()
+{
+	moveFrom(other);
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept
+{
+	if (this != &other)
+	{
+		close();
+		moveFrom(other);
+	}
+	return *this;
+}
+
+/// <summary>Takes over the mapping of other and leaves other closed.</summary>
+void MappedFile::moveFrom(MappedFile& other)
+{
+	mappedData = other.mappedData;
+	mappedSize = other.mappedSize;
+	opened = other.opened;
+	other.mappedData = nullptr;
+	other.mappedSize = 0;
+	other.opened = false;
+#ifdef _WIN32
+	fileHandle = other.fileHandle;
+	mappingHandle = other.mappingHandle;
+	other.fileHandle = INVALID_HANDLE_VALUE;
+	other.mappingHandle = nullptr;
+#else
+	fileDescriptor = other.fileDescriptor;
+	other.fileDescriptor = -1;
+#endif
+}
+
+/// <summary>Maps the file at pathName. Any previous mapping is closed first.</summary>
+/// <param name="pathName">The file path</param>
+/// <returns>true on success, false on failed</returns>  
+bool MappedFile::open(const string& pathName)
+{
+	close();
+#ifdef _WIN32
+	LARGE_INTEGER fileSize;
+	fileHandle = CreateFileA(pathName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (fileHandle == INVALID_HANDLE_VALUE) return 0;
+	if (!GetFileSizeEx(fileHandle, &fileSize))
+	{
+		close();
+		return 0;
+	}
+
+	mappedSize = (unsigned long long)fileSize.QuadPart;
+	if (mappedSize > 0)
+	{
+		mappingHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mappingHandle == nullptr)
+		{
+			close();
+			return 0;
+		}
+		mappedData = (const unsigned char*)MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+		if (mappedData == nullptr)
+		{
+			close();
+			return 0;
+		}
+	}
+#else
+	struct stat fileStat;
+	fileDescriptor = ::open(pathName.c_str(), O_RDONLY);
+	if (fileDescriptor < 0) return 0;
+	if (fstat(fileDescriptor, &fileStat) != 0 || !S_ISREG(fileStat.st_mode))
+	{
+		close();
+		return 0;
+	}
+
+	mappedSize = (unsigned long long)fileStat.st_size;
+	if (mappedSize > 0)
+	{
+		void* mapping = mmap(nullptr, (size_t)mappedSize, PROT_READ, MAP_SHARED, fileDescriptor, 0);
+		if (mapping == MAP_FAILED)
+		{
+			close();
+			return 0;
+		}
+		mappedData = (const unsigned char*)mapping;
+	}
+#endif
+	opened = true;
+	return 1;
+}
+
+/// <summary>Releases the mapping.</summary>
+void MappedFile::close()
+{
+#ifdef _WIN32
+	if (mappedData != nullptr) UnmapViewOfFile(mappedData);
+	if (mappingHandle != nullptr) CloseHandle(mappingHandle);
+	if (fileHandle != INVALID_HANDLE_VALUE) CloseHandle(fileHandle);
+	mappingHandle = nullptr;
+	fileHandle = INVALID_HANDLE_VALUE;
+#else
+	if (mappedData != nullptr) munmap((void*)mappedData, (size_t)mappedSize);
+	if (fileDescriptor >= 0) ::close(fileDescriptor);
+	fileDescriptor = -1;
+#endif
+	mappedData = nullptr;
+	mappedSize = 0;
+	opened = false;
+}
+
+bool MappedFile::isOpen() const
+{
+	return opened;
+}
+
+const unsigned char* MappedFile::data() const
+{
+	return mappedData;
+}
+
+unsigned long long MappedFile::size() const
+{
+	return mappedSize;
+}
+
+/*
+* ===================
+* PAGING HINTS
+* ===================
+*/
+/// <summary>Tells the system the mapping will be read front to back, so it reads ahead further and drops pages behind the reader sooner.</summary>
+void MappedFile::adviseSequential() const
+{
+#ifndef _WIN32
+	if (mappedData != nullptr) madvise((void*)mappedData, (size_t)mappedSize, MADV_SEQUENTIAL);
+#endif
+}
+
+/// <summary>Starts reading a range of the mapping in the background, ahead of it being touched.</summary>
+/// <param name="offset">Position of the range in this file</param>
+/// <param name="length">Length of the range in bytes</param>
+void MappedFile::prefetchRange(long long offset, long long length) const
+{
+	if (mappedData == nullptr || offset < 0 || (unsigned long long)offset >= mappedSize) return;
+	length = min(length, (long long)mappedSize - offset);
+#ifdef _WIN32
+	WIN32_MEMORY_RANGE_ENTRY range = { (void*)(mappedData + offset), (SIZE_T)length };
+	PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#else
+	long long pageSize = sysconf(_SC_PAGESIZE);
+	long long start = offset / pageSize * pageSize;
+	madvise((void*)(mappedData + start), (size_t)(offset + length - start), MADV_WILLNEED);
+#endif
+}
+
+/// <summary>
+/// Removes the whole pages inside a consumed range from the process, so scanning a mapping larger than memory keeps a flat footprint.
+/// The file is read-only, so the pages are simply dropped and read back from the file if they are touched again.
+/// </summary>
+/// <param name="offset">Position of the range in this file</param>
+/// <param name="length">Length of the range in bytes</param>
+void MappedFile::releaseRange(long long offset, long long length) const
+{
+	if (mappedData == nullptr || offset < 0 || length <= 0) return;
+	length = min(length, (long long)mappedSize - offset);
+#ifdef _WIN32
+	//Unlocking pages that are not locked removes them from the working set.
+	SYSTEM_INFO systemInfo;
+	GetSystemInfo(&systemInfo);
+	long long pageSize = systemInfo.dwPageSize;
+#else
+	long long pageSize = sysconf(_SC_PAGESIZE);
+#endif
+	long long start = (offset + pageSize - 1) / pageSize * pageSize;
+	long long end = (offset + length) / pageSize * pageSize;
+	if (end <= start) return;
+#ifdef _WIN32
+	VirtualUnlock((void*)(mappedData + start), (SIZE_T)(end - start));
+#else
+	madvise((void*)(mappedData + start), (size_t)(end - start), MADV_DONTNEED);
+#endif
+}
+
+/*
+* ===================
+* RANGE COPIES
+* ===================
+*/
+#ifndef _WIN32
+/// <summary>Writes every byte of data to a file descriptor</summary>
+static bool writeAll(int outputDescriptor, const void* data, size_t size)
+{
+	const char* pos = (const char*)data;
+	while (size > 0)
+	{
+		ssize_t written = write(outputDescriptor, pos, size);
+		if (written < 0 && errno == EINTR) continue;
+		if (written <= 0) return 0;
+		pos += written;
+		size -= (size_t)written;
+	}
+	return 1;
+}
+#endif
+
+/// <summary>
+/// Creates the file at outputPath holding header followed by length bytes of this file starting at offset.
+/// The range is copied by the kernel (copy_file_range, then sendfile) so it never passes through a user-space buffer.
+/// Where neither is available the range is written straight from the mapping.
+/// </summary>
+/// <param name="outputPath">The file to create. An existing file is replaced</param>
+/// <param name="header">Bytes written before the range</param>
+/// <param name="headerSize">The number of header bytes</param>
+/// <param name="offset">Position of the range in this file</param>
+/// <param name="length">Length of the range in bytes</param>
+/// <returns>true on success, false on failed</returns>  
+bool MappedFile::copyRangeToFile(const string& outputPath, const void* header, size_t headerSize, long long offset, long long length) const
+{
+	if (!opened || offset < 0 || length < 0 || (unsigned long long)(offset + length) > mappedSize) return 0;
+
+#ifdef _WIN32
+	DWORD written;
+	HANDLE outputHandle = CreateFileA(outputPath.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (outputHandle == INVALID_HANDLE_VALUE) return 0;
+
+	bool success = WriteFile(outputHandle, header, (DWORD)headerSize, &written, NULL) && written == headerSize;
+	for (long long pos = 0; success && pos < length; pos += written)
+	{
+		DWORD chunk = (DWORD)min(length - pos, (long long)1 << 30);
+		success = WriteFile(outputHandle, mappedData + offset + pos, chunk, &written, NULL) && written == chunk;
+	}
+	CloseHandle(outputHandle);
+	return success;
+#else
+	int outputDescriptor = ::open(outputPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (outputDescriptor < 0) return 0;
+	if (!writeAll(outputDescriptor, header, headerSize))
+	{
+		::close(outputDescriptor);
+		return 0;
+	}
+
+	off_t inputPos = (off_t)offset;
+	long long remaining = length;
+#ifdef __linux__
+	//copy_file_range can fail for some file system pairs, sendfile copies any regular file. Either can stop part way.
+	bool useCopyFileRange = true;
+	while (remaining > 0)
+	{
+		ssize_t copied;
+		if (useCopyFileRange) copied = copy_file_range(fileDescriptor, &inputPos, outputDescriptor, nullptr, (size_t)remaining, 0);
+		else copied = sendfile(outputDescriptor, fileDescriptor, &inputPos, (size_t)remaining);
+
+		if (copied < 0 && errno == EINTR) continue;
+		if (copied < 0 && useCopyFileRange)
+		{
+			useCopyFileRange = false;
+			continue;
+		}
+		if (copied <= 0) break;
+		remaining -= copied;
+	}
+#endif
+	bool success = writeAll(outputDescriptor, mappedData + inputPos, (size_t)remaining);
+	return ::close(outputDescriptor) == 0 && success;
+#endif
+}
+
+/*
+* ===================
+* COALESCED READS
+* ===================
+*/
+/// <summary>
+/// Reads every requested range from a seekable stream with as few reads as possible. The requests are sorted by offset 
+/// and ranges that overlap or are at most maxGap bytes apart are merged into one read of up to maxSpan bytes,
+/// which is then scattered into the destinations. A range larger than maxSpan is read on its own.
+/// </summary>
+/// <param name="file">The stream to read from</param>
+/// <param name="requests">The ranges to read. They are reordered by offset</param>
+/// <param name="maxGap">The largest gap of unrequested bytes that is read through instead of seeking over</param>
+/// <param name="maxSpan">The largest merged read in bytes</param>
+/// <returns>true on success, false if a range could not be read completely</returns>  
+bool readCoalesced(istream& file, vector<ReadRequest>& requests, long long maxGap, long long maxSpan)
+{
+	vector<char> span;		//Staging buffer of a merged read
+	size_t first = 0;		//First request of the current run
+
+	sort(requests.begin(), requests.end(), [](const ReadRequest& a, const ReadRequest& b) { return a.offset < b.offset; });
+
+	while (first < requests.size())
+	{
+		//Grow the run while the next range starts close enough and the merged read stays under maxSpan.
+		long long spanStart = requests[first].offset;
+		long long spanEnd = spanStart + requests[first].length;
+		size_t last = first + 1;
+		while (last < requests.size() && requests[last].offset <= spanEnd + maxGap)
+		{
+			long long newEnd = max(spanEnd, requests[last].offset + requests[last].length);
+			if (newEnd - spanStart > maxSpan) break;
+			spanEnd = newEnd;
+			last++;
+		}
+
+		if (spanStart < 0) return 0;
+		file.clear();
+		file.seekg(spanStart);
+
+		//A run of one range is read straight into its destination.
+		if (last == first + 1)
+		{
+			if (!file.read(requests[first].dest, requests[first].length)) return 0;
+		}
+		else
+		{
+			span.resize((size_t)(spanEnd - spanStart));
+			if (!file.read(span.data(), spanEnd - spanStart)) return 0;
+			for (size_t index = first; index < last; index++)
+			{
+				memcpy(requests[index].dest, span.data() + (requests[index].offset - spanStart), (size_t)requests[index].length);
+			}
+		}
+		first = last;
+	}
+	return 1;
+}
+
+/// <summary>
+/// Moves the file at sourcePath over targetPath, replacing it. Used to publish a file that was written under a temporary name.
+/// Some platforms can't rename over an existing file, so that case removes the old file first.
+/// </summary>
+/// <param name="sourcePath">The file to move</param>
+/// <param name="targetPath">The file to replace</param>
+/// <returns>true on success, false on failed (sourcePath is removed)</returns>  
+bool replaceFile(const string& sourcePath, const string& targetPath)
+{
+	if (rename(sourcePath.c_str(), targetPath.c_str()) == 0) return 1;
+
+	remove(targetPath.c_str());
+	if (rename(sourcePath.c_str(), targetPath.c_str()) == 0) return 1;
+
+	remove(sourcePath.c_str());
+	return 0;
+}
+
+/// <summary>
+/// Returns a temporary path next to pathName to write a file under before it is published with replaceFile. The name is unique per call:
+/// a random process id, so processes sharing a file never collide, followed by a counter, so threads of one process never do.
+/// </summary>
+/// <param name="pathName">The file that will be replaced</param>
+/// <returns>pathName with a unique suffix ending in .tmp</returns>  
+string makeTempPath(const string& pathName)
+{
+	static const unsigned long long processId = []() {
+		random_device randomDevice;
+		return ((unsigned long long)randomDevice() << 32) ^ randomDevice() ^ (unsigned long long)chrono::steady_clock::now().time_since_epoch().count();
+	}();
+	static atomic<unsigned long long> counter(0);
+	return pathName + "." + to_string(processId) + "." + to_string(counter++) + ".tmp";
+}
@@ -0,0 +1,102 @@
+#pragma once
+#include <istream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/// <summary>
+/// A read-only memory mapping of a whole file. The mapping is released when the object is destroyed or closed.
+/// An empty file opens successfully with data() == nullptr and size() == 0.
+/// </summary>
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+	MappedFile(MappedFile&& other) noexcept;
+	MappedFile& operator=(MappedFile&& other) noexcept;
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	/// <summary>Maps the file at pathName. Any previous mapping is closed first.</summary>
+	/// <param name="pathName">The file path</param>
+	/// <returns>true on success, false on failed</returns>  
+	bool open(const string& pathName);
+
+	/// <summary>Releases the mapping.</summary>
+	void close();
+
+	bool isOpen() const;					//true if a file is mapped
+	const unsigned char* data() const;		//The first byte of the file
+	unsigned long long size() const;		//The file size in bytes
+
+	/// <summary>
+	/// Creates the file at outputPath holding header followed by length bytes of this file starting at offset.
+	/// The range is copied by the kernel (copy_file_range, then sendfile) so it never passes through a user-space buffer.
+	/// Where neither is available the range is written straight from the mapping.
+	/// </summary>
+	/// <param name="outputPath">The file to create. An existing file is replaced</param>
+	/// <param name="header">Bytes written before the range</param>
+	/// <param name="headerSize">The number of header bytes</param>
+	/// <param name="offset">Position of the range in this file</param>
+	/// <param name="length">Length of the range in bytes</param>
+	/// <returns>true on success, false on failed</returns>  
+	bool copyRangeToFile(const string& outputPath, const void* header, size_t headerSize, long long offset, long long length) const;
+
+	/*
+	* Paging hints for mappings larger than memory. They only change what stays resident, never the mapped bytes:
+	* a released page is read back from the file when it is touched again.
+	*/
+	void adviseSequential() const;									//The mapping will be read front to back
+	void prefetchRange(long long offset, long long length) const;	//The range will be read soon
+	void releaseRange(long long offset, long long length) const;	//The range was consumed. Only whole pages inside it are released
+
+private:
+	const unsigned char* mappedData;		//The start of the mapping
+	unsigned long long mappedSize;			//The size of the mapping in bytes
+	bool opened;							//true if open succeeded
+#ifdef _WIN32
+	void* fileHandle;						//Handle of the mapped file
+	void* mappingHandle;					//Handle of the file mapping object
+#else
+	int fileDescriptor;						//Descriptor of the mapped file
+#endif
+	void moveFrom(MappedFile& other);
+};
+
+/// <summary>A range of a file to be read into dest</summary>
+struct ReadRequest
+{
+	long long offset;	//Position of the range in the file
+	long long length;	//Length of the range in bytes
+	char* dest;			//Where the range is copied to
+};
+
+/// <summary>
+/// Reads every requested range from a seekable stream with as few reads as possible. The requests are sorted by offset 
+/// and ranges that overlap or are at most maxGap bytes apart are merged into one read of up to maxSpan bytes,
+/// which is then scattered into the destinations. A range larger than maxSpan is read on its own.
+/// </summary>
+/// <param name="file">The stream to read from</param>
+/// <param name="requests">The ranges to read. They are reordered by offset</param>
+/// <param name="maxGap">The largest gap of unrequested bytes that is read through instead of seeking over</param>
+/// <param name="maxSpan">The largest merged read in bytes</param>
+/// <returns>true on success, false if a range could not be read completely</returns>  
+bool readCoalesced(istream& file, vector<ReadRequest>& requests, long long maxGap, long long maxSpan);
+
+/// <summary>
+/// Moves the file at sourcePath over targetPath, replacing it. Used to publish a file that was written under a temporary name.
+/// </summary>
+/// <param name="sourcePath">The file to move</param>
+/// <param name="targetPath">The file to replace</param>
+/// <returns>true on success, false on failed (sourcePath is removed)</returns>  
+bool replaceFile(const string& sourcePath, const string& targetPath);
+
+/// <summary>
+/// Returns a temporary path next to pathName to write a file under before it is published with replaceFile. The name is unique per call,
+/// so processes and threads writing the same file never write into the same temporary file.
+/// </summary>
+/// <param name="pathName">The file that will be replaced</param>
+/// <returns>pathName with a unique suffix ending in .tmp</returns>  
+string makeTempPath(const string& pathName);
@@ -0,0 +1,434 @@
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <thread>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+#include "DecryptKDB.h"
+#include "ImageExtractor.h"
+#include "ScanCheckpoint.h"
+#include "ThreadPool.h"
+
+const int STOP_CHECK_INTERVAL = 50;		//Milliseconds between two checks for a stop while a followed scan waits for its next poll
+
+/*
+* ===================
+* HELPER FUNCTIONS
+* ===================
+*/
+/// <summary>
+/// Switches stdin to binary mode, so a piped image is read unchanged. Only Windows translates line endings.
+/// </summary>
+static void setBinaryInput()
+{
+#ifdef _WIN32
+	_setmode(_fileno(stdin), _O_BINARY);
+#endif
+}
+
+/// <summary>Appends text as a quoted JSON string</summary>
+static void appendJSONString(string& output, const string& text)
+{
+	char escaped[8];
+	output += '"';
+	for (unsigned char c : text)
+	{
+		if (c == '"' || c == '\\')
+		{
+			output += '\\';
+			output += (char)c;
+		}
+		else if (c < 0x20)
+		{
+			snprintf(escaped, sizeof(escaped), "\\u%04X", c);
+			output += escaped;
+		}
+		else output += (char)c;
+	}
+	output += '"';
+}
+
+/// <summary>Appends text as a CSV field, quoted only if it has to be</summary>
+static void appendCSVField(string& output, const string& text)
+{
+	if (text.find_first_of(",\"\r\n") == string::npos)
+	{
+		output += text;
+		return;
+	}
+	output += '"';
+	for (char c : text)
+	{
+		if (c == '"') output += '"';
+		output += c;
+	}
+	output += '"';
+}
+
+/// <summary>The field name of a hash in a record</summary>
+static string getHashField(HashAlgorithm algorithm)
+{
+	string name = getHashName(algorithm);
+	for (char& c : name) c = (char)tolower((unsigned char)c);
+	return name;
+}
+
+/*
+* ===================
+* IMAGE EXTRACTOR
+* ===================
+*/
+ImageExtractor::ImageExtractor(const ImageHandlerOptions& options) : options(options), stopRequested(false)
+{
+}
+
+/// <summary>
+/// Loads the magic variants of the KDB file and opens the store, if the options have one. The KDB file is read through 
+/// KDBReader, through its sidecar cache if options.kdbSidecar is set.
+/// </summary>
+/// <param name=kdbPath>The filepath of the KDB file</param>
+/// <returns>true on success, false on failed (see getError)</returns>
+bool ImageExtractor::open(const string& kdbPath)
+{
+	KDBReader kdbReader;
+	bool decryptError = false;
+
+	error.clear();
+	if (options.kdbSidecar ? kdbReader.openCached(kdbPath) : kdbReader.open(kdbPath)) magic.build(getMagicPatternsFromKDB(kdbReader, decryptError));
+	else decryptError = true;
+	kdbReader.close();
+
+	if (decryptError) return fail("Decrypting KDB File Failed");
+	if (magic.getNumPatterns() == 0) return fail("No Magic JPEG found");
+	if (!options.storeDir.empty() && !store.open(options.storeDir)) return fail("Opening Image Store Failed");
+	return 1;
+}
+
+const string& ImageExtractor::getError() const
+{
+	return error;
+}
+
+const PatternMatcher& ImageExtractor::getMagic() const
+{
+	return magic;
+}
+
+/// <summary>
+/// Ends a followed scan: it stops polling once the poll it is in has been processed and its checkpoint saved, and extract returns.
+/// A stop before the scan starts ends it after its first poll. It only sets a flag, so it can be called from another thread or a signal handler.
+/// </summary>
+void ImageExtractor::stop()
+{
+	stopRequested = true;
+}
+
+bool ImageExtractor::fail(const string& reason)
+{
+	error = reason;
+	return 0;
+}
+
+/// <summary>
+/// Extracts/repairs/saves/hashes the magic jpegs of an image and reports each one through onImage, in image order.
+/// A mapped image is searched on every core and its jpegs are saved and hashed on every core too (copied by the kernel and hashed from
+/// the mapping); they are reported once all of them are saved. An image that can't be mapped falls back to the file search.
+/// Streaming, stdin, pipes, checkpointed and followed scans are processed in a single forward pass and reported as they are found.
+/// </summary>
+/// <param name=imagePath>The filepath of the image, "-" for stdin</param>
+/// <param name=onImage>Called for every repaired jpeg</param>
+/// <param name=onMessage>Called with progress and warnings. Optional</param>
+/// <returns>true on success, false on failed (see getError)</returns>
+bool ImageExtractor::extract(const string& imagePath, const ExtractedImageCallback& onImage, const ExtractorMessageCallback& onMessage)
+{
+	bool fromStdin = imagePath == STDIN_PATH;
+	bool incremental = !options.checkpointPath.empty();
+	error_code pathError;
+
+	error.clear();
+	if (magic.getNumPatterns() == 0) return fail("No Magic JPEG found");
+	if (fromStdin && (incremental || options.follow)) return fail("An image read from stdin can't be checkpointed or followed");
+
+	//Streaming mode searches, repairs, saves and hashes in one pass, so the image is only read once.
+	//It never seeks, so it is also used for images that can't: stdin and pipes (or anything else that is not a regular file).
+	//It can stop at the end of the image and continue once the image has grown, so it also runs checkpointed and followed scans.
+	if (options.streaming || fromStdin || incremental || options.follow || !filesystem::is_regular_file(imagePath, pathError))
+	{
+		return extractStreaming(imagePath, onImage, onMessage);
+	}
+
+	//Get the magic'd jpeg files in the image file. Every magic variant is searched for in the same pass.
+	//Large images are mapped and searched on every core. The file search is kept for when the image cannot be mapped.
+	//Offsets are 64 bit throughout, so images larger than 2 GB work both ways.
+	fstream imageFile;
+	MappedFile imageMapping;
+	vector<MagicJPEG> jpegs;
+	if (imageMapping.open(imagePath)) searchForMagicJPEGS(imageMapping, jpegs, magic, options.numThreads);
+	else
+	{
+		imageFile.open(imagePath, ios::in | ios::binary);
+		if (!imageFile.is_open()) return fail("File Does Not Exist");
+		searchForMagicJPEGS(imageFile, jpegs, magic);
+	}
+
+	string outputDir = store.isOpen() ? "" : createRepairedDirectory(imagePath);
+	ExtractedImage image;
+
+	//A mapped image is saved and hashed on every core, each jpeg independently of the others. They are reported afterwards in image order.
+	if (imageMapping.isOpen())
+	{
+		vector<ExtractedImage> images(jpegs.size());
+		vector<char> saved(jpegs.size(), 0);
+		ParallelFor((int)jpegs.size(), options.numThreads, [&](int index) {
+			saved[index] = saveImage(jpegs[index], imageMapping, imageFile, imagePath, outputDir, images[index]);
+		});
+		for (size_t index = 0; index < jpegs.size(); index++)
+		{
+			if (saved[index]) onImage(images[index]);
+		}
+		return 1;
+	}
+
+	//A magic jpeg that could not be saved is skipped.
+	for (const MagicJPEG& jpeg : jpegs)
+	{
+		if (saveImage(jpeg, imageMapping, imageFile, imagePath, outputDir, image)) onImage(image);
+	}
+	return 1;
+}
+
+/// <summary>
+/// Repairs, saves and hashes one magic jpeg into the store or to <outputDir>/<offset>.jpeg. A mapped image is used if it is open,
+/// otherwise the jpeg is read back from the file. The pages of a jpeg of an image larger than the scan window are released once 
+/// it is saved, like the search does.
+/// </summary>
+/// <returns>true on success, false on failed</returns>
+bool ImageExtractor::saveImage(const MagicJPEG& jpeg, const MappedFile& imageMapping, fstream& imageFile, const string& imagePath,
+	const string& outputDir, ExtractedImage& image)
+{
+	int magicSize = magic.getPatternSize(jpeg.variant);
+	bool saved;
+
+	image.offset = jpeg.startOffset;
+	image.size = jpeg.endOffset - jpeg.startOffset;
+	image.path = outputDir + to_string(jpeg.startOffset) + ".jpeg";
+
+	if (imageMapping.isOpen())
+	{
+		saved = store.isOpen() ?
+			storeJPEG(imageMapping, imagePath, jpeg.startOffset, jpeg.endOffset, magicSize, store, options.hashAlgorithms, image.digests, image.path) :
+			extractJPEG(imageMapping, jpeg.startOffset, jpeg.endOffset, magicSize, image.path, options.hashAlgorithms, image.digests);
+		if ((long long)imageMapping.size() > SCAN_WINDOW_SIZE) imageMapping.releaseRange(jpeg.startOffset, image.size);
+		return saved;
+	}
+
+	return store.isOpen() ?
+		storeJPEG(imageFile, imagePath, jpeg.startOffset, jpeg.endOffset, magicSize, store, options.hashAlgorithms, image.digests, image.path) :
+		extractJPEG(imageFile, jpeg.startOffset, jpeg.endOffset, magicSize, image.path, options.hashAlgorithms, image.digests);
+}
+
+/// <summary>
+/// Extracts the magic jpegs of an image in a single forward pass (see StreamingExtractor). With a store the jpegs are streamed into its
+/// temporary directory and moved into the store once their hash is known. Jpegs read from stdin are saved to ./stdin_Repaired/.
+/// </summary>
+/// <returns>true on success, false on failed</returns>
+bool ImageExtractor::extractStreaming(const string& imagePath, const ExtractedImageCallback& onImage, const ExtractorMessageCallback& onMessage)
+{
+	bool fromStdin = imagePath == STDIN_PATH;
+	fstream imageFile;
+
+	if (!fromStdin)
+	{
+		imageFile.open(imagePath, ios::in | ios::binary);
+		if (!imageFile.is_open()) return fail("File Does Not Exist");
+	}
+	else setBinaryInput();
+	istream& imageStream = fromStdin ? cin : imageFile;
+	bool incremental = !options.checkpointPath.empty() || options.follow;
+	vector<pair<long long, long long>> reportedImages;	//With a checkpoint: the jpegs reported since it was last updated
+
+	StreamingExtractor extractor(magic, store.isOpen() ? store.getTempDir() : createRepairedDirectory(fromStdin ? "stdin" : imagePath),
+		[this, &imagePath, &onImage, &reportedImages](long long offset, long long size, const vector<ImageDigest>& digests, const string& path) {
+			ExtractedImage image = { offset, size, digests, path };
+			if (store.isOpen())
+			{
+				if (!store.storeFile(path, digests[0])) return;
+				store.addIndexEntry(imagePath, offset, size, digests[0]);
+				image.path = store.getObjectPath(digests[0]);
+			}
+			onImage(image);
+			if (!options.checkpointPath.empty()) reportedImages.push_back({ offset, size });
+		},
+		options.hashAlgorithms, onMessage, options.rewindLimit);
+
+	if (incremental) processIncremental(extractor, imageFile, imagePath, reportedImages, onMessage);
+	else
+	{
+		extractor.process(imageStream);
+		extractor.finish();
+	}
+	return 1;
+}
+
+/// <summary>
+/// Runs a streaming scan of an image that keeps growing. The scan starts where the checkpoint (if any) left off and processes the image
+/// up to its current end, then saves the new checkpoint. A followed image is polled for appended bytes until stop is called,
+/// so every poll only reads the new bytes. Every poll reopens the image and checks it against the fingerprint of the scanned bytes;
+/// an image that was truncated or replaced is scanned from the start. The bytes at the very end may be the start of a pattern that 
+/// is still being written, so they are left for the next poll or run instead of being finished.
+/// </summary>
+/// <param name=extractor>The extractor of the image</param>
+/// <param name=imageFile>The opened image file</param>
+/// <param name=imagePath>The filepath of the image</param>
+/// <param name=reportedImages>The offset and size of every jpeg the extractor reported. Appended to the checkpoint's image log when it is saved</param>
+/// <param name=onMessage>Called with progress and warnings. Optional</param>
+void ImageExtractor::processIncremental(StreamingExtractor& extractor, fstream& imageFile, const string& imagePath, 
+	vector<pair<long long, long long>>& reportedImages, const ExtractorMessageCallback& onMessage)
+{
+	ScanCheckpoint checkpoint;
+	bool incremental = !options.checkpointPath.empty();
+
+	//A checkpoint of a different (or truncated) image is ignored and the image is scanned from the start.
+	if (incremental && loadScanCheckpoint(options.checkpointPath, checkpoint) && !checkpointMatchesImage(imagePath, checkpoint))
+	{
+		if (onMessage) onMessage("Checkpoint does not match the image, scanning from the start");
+		checkpoint = ScanCheckpoint();
+	}
+	if (checkpoint.getResumeOffset() > 0 && onMessage)
+	{
+		onMessage("Resuming at offset " + to_string(checkpoint.getResumeOffset()) + " (" + to_string(checkpoint.numImages) + " jpegs done)");
+	}
+
+	extractor.resume(checkpoint.getResumeOffset());
+	imageFile.clear();
+	imageFile.seekg(checkpoint.getResumeOffset());
+
+	bool saved = false;
+	while (true)
+	{
+		long long scannedOffset = extractor.getScannedOffset();
+		extractor.process(imageFile);
+
+		//Only update when the scan moved, so an idle followed image is not rewritten every poll. A followed image is fingerprinted
+		//even without a checkpoint file, so the next poll can tell whether it changed.
+		if (extractor.getScannedOffset() != scannedOffset || !saved)
+		{
+			checkpoint.scannedOffset = extractor.getScannedOffset();
+			checkpoint.findEnd = extractor.isWaitingForEnd();
+			checkpoint.pendingOffset = extractor.isWaitingForEnd() ? extractor.getPendingOffset() : 0;
+			saved = fingerprintImage(imagePath, checkpoint) && (!incremental || saveScanCheckpoint(options.checkpointPath, checkpoint, reportedImages));
+			if (saved) reportedImages.clear();
+			else if (onMessage) onMessage("Saving Checkpoint Failed");
+		}
+		if (!options.follow || stopRequested.exchange(false)) break;
+
+		//The poll interval is slept in short slices, so a stop does not wait for the next poll.
+		bool stopped = false;
+		for (int waited = 0; waited < options.pollInterval && !stopped; waited += STOP_CHECK_INTERVAL)
+		{
+			this_thread::sleep_for(chrono::milliseconds(min(STOP_CHECK_INTERVAL, options.pollInterval - waited)));
+			stopped = stopRequested.exchange(false);
+		}
+		if (stopped) break;
+
+		//The image is reopened every poll, so an image that was replaced (e.g. rotated) is read from the new file.
+		imageFile.clear();
+		streamoff readPos = imageFile.tellg();
+		imageFile.close();
+		imageFile.open(imagePath, ios::in | ios::binary);
+		if (!imageFile.is_open())
+		{
+			if (onMessage) onMessage("File Does Not Exist");
+			break;
+		}
+		if (checkpointMatchesImage(imagePath, checkpoint))
+		{
+			imageFile.seekg(readPos);
+			continue;
+		}
+
+		//The image shrank below the scanned bytes or its start changed
+		if (onMessage) onMessage("Image was truncated or replaced, scanning from the start");
+		extractor.resume(0);
+		reportedImages.clear();
+		checkpoint = ScanCheckpoint();
+		saved = false;
+	}
+	extractor.suspend();
+}
+
+/*
+* ===================
+* RECORD SINKS
+* ===================
+*/
+/// <summary>Parses a record format name: jsonl or csv</summary>
+/// <param name="name">The format name</param>
+/// <param name="format">Outputs the format</param>
+/// <returns>true on success, false if the name is unknown</returns>  
+bool parseRecordFormat(const string& name, RecordFormat& format)
+{
+	if (name == "jsonl") format = RECORD_JSONL;
+	else if (name == "csv") format = RECORD_CSV;
+	else return 0;
+	return 1;
+}
+
+ImageRecordWriter::ImageRecordWriter(ostream& output, RecordFormat format, size_t bufferSize)
+	: output(output), format(format), bufferSize(bufferSize)
+{
+	wroteHeader = false;
+	buffer.reserve(bufferSize);
+}
+
+ImageRecordWriter::~ImageRecordWriter()
+{
+	flush();
+}
+
+/// <summary>
+/// Adds the record of a jpeg. The CSV header is taken from the hashes of the first record; every jpeg of a run has the same hashes.
+/// </summary>
+/// <param name="inputPath">The filepath of the image the jpeg was extracted from</param>
+/// <param name="image">The jpeg</param>
+void ImageRecordWriter::write(const string& inputPath, const ExtractedImage& image)
+{
+	if (format == RECORD_JSONL)
+	{
+		buffer += "{\"input\":";
+		appendJSONString(buffer, inputPath);
+		buffer += ",\"offset\":" + to_string(image.offset) + ",\"size\":" + to_string(image.size) + ",\"path\":";
+		appendJSONString(buffer, image.path);
+		for (const ImageDigest& digest : image.digests) buffer += ",\"" + getHashField(digest.algorithm) + "\":\"" + formatDigest(digest) + "\"";
+		buffer += "}\n";
+	}
+	else
+	{
+		if (!wroteHeader)
+		{
+			buffer += "input,offset,size,path";
+			for (const ImageDigest& digest : image.digests) buffer += "," + getHashField(digest.algorithm);
+			buffer += "\n";
+			wroteHeader = true;
+		}
+		appendCSVField(buffer, inputPath);
+		buffer += "," + to_string(image.offset) + "," + to_string(image.size) + ",";
+		appendCSVField(buffer, image.path);
+		for (const ImageDigest& digest : image.digests) buffer += "," + formatDigest(digest);
+		buffer += "\n";
+	}
+
+	if (buffer.size() >= bufferSize) flush();
+}
+
+/// <summary>Writes the buffered records in one block</summary>
+void ImageRecordWriter::flush()
+{
+	if (buffer.empty()) return;
+	output.write(buffer.data(), buffer.size());
+	output.flush();
+	buffer.clear();
+}
@@ -0,0 +1,98 @@
+#pragma once
+#include <atomic>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "ImageHandler.h"
+#include "ImageHash.h"
+#include "ImageStore.h"
+#include "PatternScanner.h"
+
+using namespace std;
+
+const char* const STDIN_PATH = "-";		//The image path that reads the image from stdin
+
+/// <summary>A repaired jpeg saved by an ImageExtractor</summary>
+struct ExtractedImage
+{
+	long long offset;				//The position of the magic string in the image
+	long long size;					//The size of the magic jpeg in the image
+	vector<ImageDigest> digests;	//The hashes of the repaired jpeg
+	string path;					//The filepath the repaired jpeg was saved to
+};
+
+/// <summary>Called for every repaired jpeg, in image order, on the thread that called extract</summary>
+typedef function<void(const ExtractedImage& image)> ExtractedImageCallback;
+
+/// <summary>
+/// The engine of challenge 3 without any console I/O, for embedding. It decrypts the magic variants of a KDB file once and then
+/// extracts/repairs/saves/hashes the magic jpegs of any number of images, reporting each through a callback.
+/// Every mode of ImageHandler is supported through its options: mapped search on every core, the file search fallback,
+/// streaming (stdin and pipes), checkpointed and followed scans, and the content-addressed store.
+/// </summary>
+class ImageExtractor
+{
+public:
+	explicit ImageExtractor(const ImageHandlerOptions& options = ImageHandlerOptions());
+	ImageExtractor(const ImageExtractor&) = delete;
+	ImageExtractor& operator=(const ImageExtractor&) = delete;
+
+	bool open(const string& kdbPath);		//Loads the magic variants of the KDB file and opens the store. Returns true on success
+	bool extract(const string& imagePath, const ExtractedImageCallback& onImage, const ExtractorMessageCallback& onMessage = nullptr);	//Returns true on success
+	void stop();							//Ends a followed scan after its current poll. Safe to call from any thread and from a signal handler
+	const string& getError() const;			//Why the last open or extract failed
+	const PatternMatcher& getMagic() const;	//The magic variants of the KDB file
+
+private:
+	bool fail(const string& reason);		//Sets the error and returns false
+	bool extractStreaming(const string& imagePath, const ExtractedImageCallback& onImage, const ExtractorMessageCallback& onMessage);
+	void processIncremental(StreamingExtractor& extractor, fstream& imageFile, const string& imagePath, vector<pair<long long, long long>>& reportedImages,
+		const ExtractorMessageCallback& onMessage);
+	bool saveImage(const MagicJPEG& jpeg, const MappedFile& imageMapping, fstream& imageFile, const string& imagePath, 
+		const string& outputDir, ExtractedImage& image);
+
+	ImageHandlerOptions options;			//The settings of every extraction
+	PatternMatcher magic;					//Every magic variant of the KDB file
+	ImageStore store;						//The content-addressed store, when options.storeDir is set
+	string error;							//Why the last open or extract failed
+	atomic<bool> stopRequested;				//Set by stop, cleared by the followed scan it ends
+};
+
+/*
+* ===================
+* RECORD SINKS
+* ===================
+*/
+/// <summary>The formats an ImageRecordWriter can write</summary>
+enum RecordFormat
+{
+	RECORD_JSONL,	//One JSON object per line
+	RECORD_CSV		//A header line, then one comma separated line per jpeg
+};
+
+/// <summary>Parses a record format name: jsonl or csv. Returns true on success</summary>
+bool parseRecordFormat(const string& name, RecordFormat& format);
+
+/// <summary>
+/// Writes a machine-readable record of every extracted jpeg: input, offset, size, path and one field per hash (named after its algorithm,
+/// in lower case). Records are collected in a buffer and written in large blocks, when the buffer is full and by flush or the destructor.
+/// </summary>
+class ImageRecordWriter
+{
+public:
+	ImageRecordWriter(ostream& output, RecordFormat format, size_t bufferSize = 64 << 10);
+	~ImageRecordWriter();
+	ImageRecordWriter(const ImageRecordWriter&) = delete;
+	ImageRecordWriter& operator=(const ImageRecordWriter&) = delete;
+
+	void write(const string& inputPath, const ExtractedImage& image);	//Adds the record of a jpeg of the image at inputPath
+	void flush();														//Writes the buffered records
+
+private:
+	ostream& output;			//Where the records are written
+	RecordFormat format;		//The format of the records
+	size_t bufferSize;			//The buffered bytes at which the buffer is written
+	string buffer;				//Records not written yet
+	bool wroteHeader;			//true once the CSV header was written
+};
@@ -1,247 +1,965 @@
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
 #include <string>
 #include <fstream>
 #include <iostream>
-#include <list>
 #include <windows.h>
 #include <openssl/md5.h>
 #include "DecryptKDB.h"
+#include "ImageExtractor.h"
 #include "ImageHandler.h"
+#include "ImageHash.h"
+#include "ImageStore.h"
+#include "JPEGMarkers.h"
+#include "PatternScanner.h"
+#include "ThreadPool.h"
 
 const int PATH_LENGTH = 260;					//File path length
 const int BUFFER_SIZE = 2048;					//Buffer size in bytes
+const int SCAN_BUFFER_SIZE = 1 << 20;			//Read window of the image file search in bytes
+const long long SCAN_CHUNK_SIZE = 4 << 20;		//Size of the chunks of a parallel image search in bytes
 const char* END_STRING = "\xFF\xD9";			//0xFFD9 - The end bytes of a jpeg image
 const char* JPG_STRING = "\xFF\xD8\xFF";		//0xFFD8FF - The starting bytes of a jpeg image
 const int END_STRING_SIZE = 2;					//The length of the end string of a jpeg image
+const int JPG_STRING_SIZE = 3;					//The length of the starting bytes of a jpeg image
 
 /// <summary>
-/// RUNS CHALLENGE 3 - Extracts/Repairs/Saves/Outputs the magic jpegs in a file
+/// RUNS CHALLENGE 3 - Extracts/Repairs/Saves/Outputs the magic jpegs in a file.
+/// Arguments: [stream] [--kdb <path>] [--image <path|->] [--hash <md5,xxh64,blake2b>] [--threads <n>] [--store <dir>]
+///            [--checkpoint <file>] [--follow] [--poll <ms>] [--format <jsonl|csv>] [--records <file>] [--sidecar]
+/// An image path of "-" reads the image from stdin, so it can be piped in (e.g. zstd -dc capture.zst | main --kdb magic.kdb --image -).
 /// </summary>
-int ImageHandlerMain()
+/// <param name="argc">The number of arguments</param>
+/// <param name="argv">The arguments</param>
+int ImageHandlerMain(int argc, char* argv[])
 {
 	string kdbPath = "";
 	string imagePath = "";
+	ImageHandlerOptions options;
+	options.kdbSidecar = isSidecarCacheRequested();
 	
-	//SAMPLE PATHS:
-	//kdbPath = "C:/Users/colin/Downloads/SW_2018/SW_2018/magic.kdb";
-	//imagePath = "C:/Users/colin/Downloads/SW_2018/SW_2018/input.bin";
+	//SAMPLE FILES: main bench --generate --dir sample writes a synthetic sample/magic.kdb and sample/input.bin
+
+	for (int index = 0; index < argc; index++)
+	{
+		if (strcmp(argv[index], "stream") == 0) options.streaming = true;
+		else if (strcmp(argv[index], "--threads") == 0 && index + 1 < argc) options.numThreads = atoi(argv[++index]);
+		else if (strcmp(argv[index], "--store") == 0 && index + 1 < argc) options.storeDir = argv[++index];
+		else if (strcmp(argv[index], "--kdb") == 0 && index + 1 < argc) kdbPath = argv[++index];
+		else if (strcmp(argv[index], "--image") == 0 && index + 1 < argc) imagePath = argv[++index];
+		else if (strcmp(argv[index], "--checkpoint") == 0 && index + 1 < argc) options.checkpointPath = argv[++index];
+		else if (strcmp(argv[index], "--follow") == 0) options.follow = true;
+		else if (strcmp(argv[index], "--poll") == 0 && index + 1 < argc) options.pollInterval = atoi(argv[++index]);
+		else if (strcmp(argv[index], "--format") == 0 && index + 1 < argc) options.recordFormat = argv[++index];
+		else if (strcmp(argv[index], "--records") == 0 && index + 1 < argc) options.recordPath = argv[++index];
+		else if (strcmp(argv[index], "--sidecar") == 0) options.kdbSidecar = true;
+		else if (strcmp(argv[index], "--hash") == 0 && index + 1 < argc)
+		{
+			if (!parseHashAlgorithms(argv[++index], options.hashAlgorithms))
+			{
+				cout << "Unknown Hash Algorithm - " << argv[index] << " (use md5, xxh64, blake2b)\n";
+				return 0;
+			}
+		}
+	}
 	
-	ImageHandler(imagePath, kdbPath);
+	ImageHandler(imagePath, kdbPath, options);
 	return 1;
 }
 
 /// <summary>
-/// Searches the Image file for all Magic jpegs. Outputs the offsets into offsetList and endOffsetList
+/// Returns the matcher of the JPG end string
+/// </summary>
+static const PatternMatcher& getEndMatcher()
+{
+	static const PatternMatcher endMatcher(vector<vector<unsigned char>>{ vector<unsigned char>(END_STRING, END_STRING + END_STRING_SIZE) });
+	return endMatcher;
+}
+
+/// <summary>
+/// Finds the end of a jpeg in the image file like findJPEGEnd. The walk starts in the window that was read and, if the jpeg continues
+/// past it, goes on with the next bytes of the file, read into a buffer of their own so the window stays as it is.
+/// </summary>
+/// <param name="imageFile">The image file the window was read from</param>
+/// <param name="buffer">The window of the image</param>
+/// <param name="bufferLength">The number of valid bytes in the window</param>
+/// <param name="filePos">The position of the window in the image file</param>
+/// <param name="markerPos">Position of the code of the first marker after SOI in the image file</param>
+/// <returns>The position of the FF of the EOI marker in the image file, -1 if the jpeg is not well-formed</returns>  
+static long long walkJPEGEnd(fstream& imageFile, const unsigned char* buffer, long long bufferLength, long long filePos, long long markerPos)
+{
+	JPEGMarkerWalker walker;
+	walker.reset(markerPos);
+	JPEGWalkResult result = walker.walk(buffer, filePos, filePos + bufferLength);
+	if (result == JPEG_WALKING)
+	{
+		vector<unsigned char> walkBuffer(SCAN_BUFFER_SIZE);
+		while (result == JPEG_WALKING)
+		{
+			long long walkPos = walker.getPosition();
+			imageFile.clear();
+			imageFile.seekg(walkPos);
+			imageFile.read((char*)walkBuffer.data(), SCAN_BUFFER_SIZE);
+			long long walkLength = imageFile.gcount();
+			if (walkLength <= 0) break;
+			result = walker.walk(walkBuffer.data(), walkPos, walkPos + walkLength);
+		}
+		imageFile.clear();
+	}
+	return result == JPEG_END ? walker.getEndPos() : -1;
+}
+
+/// <summary>
+/// Searches a window of the image for any magic string OR the JPG end string, starting at each of the first scanLength positions.
+/// After a magic string is found we search for the JPG end string and keep alternating.
+/// Each time a magic string is found a jpeg is added to jpegs with the variant that matched. The end string completes the last jpeg.
+/// The end of a jpeg is found by walking its markers and the end string search is only the fallback for jpegs that are not well-formed.
+/// </summary>
+/// <param name="buffer">The window of the image</param>
+/// <param name="bufferLength">The number of valid bytes in the window. Patterns never extend past it</param>
+/// <param name="scanLength">The number of start positions to check</param>
+/// <param name="filePos">The position of the window in the image file</param>
+/// <param name="findEnd">The search state. true while searching for the end string. Carried from window to window</param>
+/// <param name="jpegs">The outputted magic jpegs. The last one has no end yet while findEnd is true</param>
+/// <param name=magic>The magic strings to search for</param>
+/// <param name=imageFile>The image file the window was read from, so jpegs that continue past the window are walked to their end. nullptr if the window is the whole image</param>
+/// <returns>Where the next window starts, relative to this one. Past scanLength if the last jpeg ended after it</returns>  
+static long long scanWindow(const unsigned char* buffer, long long bufferLength, long long scanLength, long long filePos, bool& findEnd, 
+	vector<MagicJPEG>& jpegs, const PatternMatcher& magic, fstream* imageFile)
+{
+	long long bufferIndex = 0;
+	long long matchIndex;
+	long long jpegEnd = -1;
+	int variant;
+
+	while (bufferIndex < scanLength)
+	{
+		const PatternMatcher& matcher = findEnd ? getEndMatcher() : magic;
+
+		//Only positions before scanLength may start a match, so the searched range ends maxPatternSize - 1 bytes after it.
+		if (findEnd && jpegEnd >= 0) matchIndex = jpegEnd - bufferIndex;
+		else matchIndex = matcher.find(buffer + bufferIndex, min(bufferLength, scanLength + matcher.getMaxPatternSize() - 1) - bufferIndex, variant);
+		if (matchIndex < 0) return scanLength;
+		bufferIndex += matchIndex;
+
+		//The jpeg starts right after the magic string, with the code of its first marker.
+		if (!findEnd)
+		{
+			long long markerIndex = bufferIndex + magic.getPatternSize(variant);
+			if (imageFile == nullptr) jpegEnd = findJPEGEnd(buffer, bufferLength, markerIndex);
+			else
+			{
+				jpegEnd = walkJPEGEnd(*imageFile, buffer, bufferLength, filePos, filePos + markerIndex);
+				if (jpegEnd >= 0) jpegEnd -= filePos;
+			}
+		}
+
+		//The string is found, we swap the search and record the position. Add an offset to account for file position to buffer position.
+		if (findEnd) jpegs.back().endOffset = filePos + bufferIndex + END_STRING_SIZE;
+		else jpegs.push_back({ filePos + bufferIndex, -1, variant });
+		findEnd = !findEnd;
+		bufferIndex++;
+	}
+	return bufferIndex;
+}
+
+/// <summary>
+/// Searches the Image file for all Magic jpegs. Outputs the offsets and variants into jpegs
 /// </summary>
 /// <param name="imageFile">The image file to be searched</param>
-/// <param name="offsetList">An outputted list of the starting position of the magic jpegs in the file</param>
-/// <param name=endOffsetList>A outputted list of the ending position of the magic jpegs in the file</param>
-/// <param name=magic>The magic string to search for</param>
-/// <param name=magicSize>The number of characters in the magic string</param>
-void searchForMagicJPEGS(fstream &imageFile, list<int>& offsetList, list<int>& endOffsetList, unsigned char* magic, int magicSize)
+/// <param name="jpegs">The outputted magic jpegs, in image order</param>
+/// <param name=magic>The magic strings to search for</param>
+void searchForMagicJPEGS(fstream &imageFile, vector<MagicJPEG>& jpegs, const PatternMatcher& magic)
 {
-	unsigned char buffer[BUFFER_SIZE];
+	vector<unsigned char> buffer(SCAN_BUFFER_SIZE);
 
-	bool match;
 	bool findEnd = false;
+	int maxPatternSize = max(magic.getMaxPatternSize(), END_STRING_SIZE);
+	long long filePos = 0;
+	long long bufferLength = SCAN_BUFFER_SIZE;
 
-	int patternIndex;
-	int curPatternSize;
-	int maxPatternSize = max(magicSize, END_STRING_SIZE);
-	int filePos = 0;
+	//Consecutive windows overlap by maxPatternSize so a pattern crossing a window boundary is still found. A jpeg that ends past
+	//the window was walked to its end, so the next window starts after it.
+	while (bufferLength == SCAN_BUFFER_SIZE)
+	{
+		imageFile.clear();
+		imageFile.seekg(filePos);
+		imageFile.read((char*)buffer.data(), SCAN_BUFFER_SIZE);
+		bufferLength = imageFile.gcount();
+
+		filePos += scanWindow(buffer.data(), bufferLength, SCAN_BUFFER_SIZE - maxPatternSize, filePos, findEnd, jpegs, magic, &imageFile);
+	}
 
-	if (findEnd) curPatternSize = END_STRING_SIZE;
-	else curPatternSize = magicSize;
+	//A magic jpeg cut off at the end of the file has no end string.
+	if (findEnd) jpegs.pop_back();
+}
+
+/// <summary>A match found by the chunked search</summary>
+struct ChunkMatch
+{
+	long long position;		//Position of the match in the image
+	int variant;			//The pattern that matched
+	long long jpegEnd;		//Magic strings: the end of the jpeg found by walking its markers, -1 if it is not well-formed
+};
 
-	imageFile.seekg(filePos);
-	while (!imageFile.eof())
+/// <summary>
+/// Finds every match that starts in [chunkStart, chunkEnd) of the image
+/// </summary>
+static void findAllInChunk(const unsigned char* imageData, long long imageSize, long long chunkStart, long long chunkEnd,
+	const PatternMatcher& matcher, vector<ChunkMatch>& matches)
+{
+	long long searchEnd = min(imageSize, chunkEnd + matcher.getMaxPatternSize() - 1);	//A match starting in the chunk may end in the next one
+	long long matchIndex;
+	int variant;
+
+	for (long long pos = chunkStart; pos < chunkEnd; pos += matchIndex + 1)
 	{
-		imageFile.seekg(filePos);
-		imageFile.read((char*)buffer, BUFFER_SIZE);
+		matchIndex = matcher.find(imageData + pos, searchEnd - pos, variant);
+		if (matchIndex < 0) return;
+		matches.push_back({ pos + matchIndex, variant, -1 });
+	}
+}
+
+/// <summary>
+/// Pairs up the matches of one window of chunks exactly like the serial search: the first magic string, then the end of its jpeg 
+/// (or the first end string after it if the jpeg is not well-formed), then the first magic string after that, and so on.
+/// Like the serial search, the next search starts one byte after the last match. The state is carried from window to window.
+/// </summary>
+/// <param name="magicMatches">The magic strings of each chunk of the window</param>
+/// <param name="endMatches">The end strings of each chunk of the window</param>
+/// <param name="findEnd">true while searching for the end of the last jpeg</param>
+/// <param name="nextPos">The first position the next match may start at</param>
+/// <param name="jpegEnd">The end of the last jpeg found by walking its markers, -1 if it is not well-formed</param>
+/// <param name="jpegs">The outputted magic jpegs. The last one has no end yet while findEnd is true</param>
+static void pairWindowMatches(const vector<vector<ChunkMatch>>& magicMatches, const vector<vector<ChunkMatch>>& endMatches, bool& findEnd,
+	long long& nextPos, long long& jpegEnd, vector<MagicJPEG>& jpegs)
+{
+	int numChunks = (int)magicMatches.size();
+	int magicChunk = 0, endChunk = 0;
+	size_t magicIndex = 0, endIndex = 0;
 
-		//A search across the buffer for the magic string OR the JPG end string. 
-		//After the magic string is found we search for the JPG end string and keep alternating.
-		//Each time one of the strings is found we insert the position into the offsetList or the endOffsetList.
-		for (int bufferIndex = 0; bufferIndex < BUFFER_SIZE - maxPatternSize; bufferIndex++)
+	while (true)
+	{
+		if (findEnd && jpegEnd >= 0)
 		{
-			match = true;
-			patternIndex = 0;
-			//Check if the next bytes matches magic. Quit early if the string does not match the magic or the end_string.
-			while ((patternIndex < curPatternSize) && match == true)
-			{
-				if (findEnd && buffer[bufferIndex + patternIndex] != (unsigned char)END_STRING[patternIndex]) match = false;
-				else if (!findEnd && buffer[bufferIndex + patternIndex] != magic[patternIndex]) match = false;
-				patternIndex++;
-			}
+			jpegs.back().endOffset = jpegEnd + END_STRING_SIZE;
+			nextPos = jpegEnd + 1;
+			findEnd = false;
+			continue;
+		}
+
+		const vector<vector<ChunkMatch>>& matches = findEnd ? endMatches : magicMatches;
+		int& chunk = findEnd ? endChunk : magicChunk;
+		size_t& index = findEnd ? endIndex : magicIndex;
 
-			//If the bytes are found, we swap the search and push the position onto the end of the list. 
-			if (match == true)
+		while (chunk < numChunks && (index >= matches[chunk].size() || matches[chunk][index].position < nextPos))
+		{
+			if (index >= matches[chunk].size()) { chunk++; index = 0; }
+			else index++;
+		}
+		if (chunk == numChunks) return;
+
+		const ChunkMatch& match = matches[chunk][index];
+		if (findEnd) jpegs.back().endOffset = match.position + END_STRING_SIZE;
+		else
+		{
+			jpegs.push_back({ match.position, -1, match.variant });
+			jpegEnd = match.jpegEnd;
+		}
+		nextPos = match.position + 1;
+		findEnd = !findEnd;
+	}
+}
+
+/// <summary>
+/// Searches an image in chunks, one window at a time. Every chunk is searched for all magic strings and all JPG end strings, including 
+/// ones that cross into the next chunk, and the end of the jpeg after every magic string is found by walking its markers. The chunks of 
+/// a window are searched concurrently, then its matches are paired up (see pairWindowMatches) and dropped, so only one window of matches
+/// is held at a time. With a mapping, the next window is prefetched first and the pages of each window are released after it.
+/// </summary>
+static void searchChunks(const unsigned char* imageData, long long imageSize, vector<MagicJPEG>& jpegs, const PatternMatcher& magic,
+	int numThreads, const MappedFile* imageMapping)
+{
+	int numChunks = (int)((imageSize + SCAN_CHUNK_SIZE - 1) / SCAN_CHUNK_SIZE);
+	int windowChunks = (int)(SCAN_WINDOW_SIZE / SCAN_CHUNK_SIZE);
+	bool findEnd = false;
+	long long nextPos = 0;
+	long long jpegEnd = -1;
+
+	for (int firstChunk = 0; firstChunk < numChunks; firstChunk += windowChunks)
+	{
+		int numWindowChunks = min(windowChunks, numChunks - firstChunk);
+		long long windowStart = firstChunk * SCAN_CHUNK_SIZE;
+		long long windowEnd = min(imageSize, windowStart + numWindowChunks * SCAN_CHUNK_SIZE);
+		if (imageMapping != nullptr) imageMapping->prefetchRange(windowEnd, SCAN_WINDOW_SIZE);
+
+		//Find every candidate per chunk. The matches of each chunk are in order, so the chunks together are in order.
+		vector<vector<ChunkMatch>> magicMatches(numWindowChunks), endMatches(numWindowChunks);
+		ParallelFor(numWindowChunks, numThreads, [&](int windowChunk) {
+			long long chunkStart = (firstChunk + windowChunk) * SCAN_CHUNK_SIZE;
+			long long chunkEnd = min(imageSize, chunkStart + SCAN_CHUNK_SIZE);
+			findAllInChunk(imageData, imageSize, chunkStart, chunkEnd, magic, magicMatches[windowChunk]);
+			findAllInChunk(imageData, imageSize, chunkStart, chunkEnd, getEndMatcher(), endMatches[windowChunk]);
+			for (ChunkMatch& match : magicMatches[windowChunk])
 			{
-				if (findEnd)
-				{
-					findEnd = false;
-					curPatternSize = magicSize;
-					endOffsetList.push_back(filePos + bufferIndex + END_STRING_SIZE); //Add an offset to account for file position to buffer position.
-				}
-				else
-				{
-					findEnd = true;
-					curPatternSize = END_STRING_SIZE;
-					offsetList.push_back(filePos + bufferIndex);					//Add an offset to account for file position to buffer position.
-				}
+				match.jpegEnd = findJPEGEnd(imageData, imageSize, match.position + magic.getPatternSize(match.variant));
 			}
-		}
+		});
 
-		filePos += BUFFER_SIZE - maxPatternSize;
+		pairWindowMatches(magicMatches, endMatches, findEnd, nextPos, jpegEnd, jpegs);
+		if (imageMapping != nullptr) imageMapping->releaseRange(windowStart, windowEnd - windowStart);
 	}
+
+	if (findEnd) jpegs.pop_back();
 }
 
 /// <summary>
-/// Gets the Magic bytes and size in the KDB File. 
+/// Searches an image that is already in memory (e.g. mapped) for all Magic jpegs. Gives the same jpegs as the file search.
+/// With more than one thread the image is split into chunks that are searched concurrently (see searchChunks).
 /// </summary>
-/// <param name=kdbFile>The KDB file to be processed</param>
-/// <param name=magicSize>The number of characters in the magic string</param>
+/// <param name="imageData">The image data to be searched</param>
+/// <param name="imageSize">The size of the image data in bytes</param>
+/// <param name="jpegs">The outputted magic jpegs, in image order</param>
+/// <param name=magic>The magic strings to search for</param>
+/// <param name=numThreads>The number of worker threads. 0 or less means one per hardware thread</param>
+void searchForMagicJPEGS(const unsigned char* imageData, long long imageSize, vector<MagicJPEG>& jpegs, const PatternMatcher& magic, int numThreads)
+{
+	bool findEnd = false;
+
+	if (imageSize > SCAN_CHUNK_SIZE && resolveThreadCount(numThreads) > 1)
+	{
+		searchChunks(imageData, imageSize, jpegs, magic, numThreads, nullptr);
+		return;
+	}
+
+	scanWindow(imageData, imageSize, imageSize, 0, findEnd, jpegs, magic, nullptr);
+	if (findEnd) jpegs.pop_back();
+}
+
+/// <summary>
+/// Searches a mapped image for all Magic jpegs. An image larger than one scan window is always searched in chunks, one window at a time, 
+/// so its pages can be prefetched ahead of the search and released behind it.
+/// </summary>
+/// <param name="imageFile">The mapped image file</param>
+/// <param name="jpegs">The outputted magic jpegs, in image order</param>
+/// <param name=magic>The magic strings to search for</param>
+/// <param name=numThreads>The number of worker threads. 0 or less means one per hardware thread</param>
+void searchForMagicJPEGS(const MappedFile& imageFile, vector<MagicJPEG>& jpegs, const PatternMatcher& magic, int numThreads)
+{
+	long long imageSize = (long long)imageFile.size();
+
+	if (imageSize <= SCAN_WINDOW_SIZE)
+	{
+		searchForMagicJPEGS(imageFile.data(), imageSize, jpegs, magic, numThreads);
+		return;
+	}
+
+	imageFile.adviseSequential();
+	searchChunks(imageFile.data(), imageSize, jpegs, magic, numThreads, &imageFile);
+}
+
+/// <summary>
+/// Gets the Magic bytes of every MAGIC entry in the KDB File. Each producer has its own MAGIC entry; entries with the same bytes are only returned once.
+/// </summary>
+/// <param name=kdbReader>The opened KDB file</param>
 /// <param name=error>outputted as true if an error was encountered</param>
-/// <return>The magic bytes in the KDB file</param>
-unsigned char *getMagicBytesFromKDB(fstream& kdbFile, int &magicSize, bool &error) 
+/// <return>The magic variants in entry list order, empty if there are none</param>
+vector<vector<unsigned char>> getMagicPatternsFromKDB(KDBReader& kdbReader, bool &error)
 {
-	unsigned char* magicBytes = nullptr;
-	int entryCount = 0;
-	KDB kdb = DecryptKDB(kdbFile, error, false);
+	vector<vector<unsigned char>> magicPatterns;
+	vector<unsigned char> magicBytes;
+	const KDBEntry* entry;
+	error = false;
 
-	//Here we assume that all MAGIC entries have the same data. 
-	while (entryCount < kdb.numEntries && magicBytes==nullptr)
+	for (int entryCount = 0; entryCount < kdbReader.getNumEntries(); entryCount++)
 	{
-		if (strncmp(kdb.entries[entryCount].name, "MAGIC", 5) == 0)
+		if (strncmp(kdbReader.getEntryName(entryCount).c_str(), "MAGIC", 5) != 0) continue;
+
+		entry = kdbReader.getEntry(entryCount);
+		if (entry == nullptr)
 		{
-			magicSize = kdb.entries[entryCount].dataSize;
-			magicBytes = new unsigned char[magicSize];
-			memcpy(magicBytes, (kdb.entries[entryCount].decData), magicSize);
+			error = true;
+			return vector<vector<unsigned char>>();
 		}
-		entryCount++;
+		magicBytes.assign(entry->decData, entry->decData + entry->dataSize);
+		if (!magicBytes.empty() && find(magicPatterns.begin(), magicPatterns.end(), magicBytes) == magicPatterns.end()) magicPatterns.push_back(magicBytes);
 	}
-	return magicBytes;
+	return magicPatterns;
 }
 
 /// <summary>
-/// Prints out the repaired image details
+/// Formats the repaired image details
 /// </summary>
 /// <param name=offset>The offset of the image position in the input file</param>
 /// <param name=size>The image size in bytes</param>
 /// <param name=md5Hash>The md5 hash of the image</param>
 /// <param name=path>The filepath of the image</param>
-void printImageOutput(int offset, int size, unsigned char * md5Hash, string path) 
+/// <returns>The details as they are printed by printImageOutput</returns>
+string formatImageOutput(long long offset, long long size, const unsigned char * md5Hash, const string& path)
 {
-	cout << "Offset - " << offset << "\n";
-	cout << "Size - " << size << "\n";
-	cout << "Hash - ";
-	for (int i = 0; i < MD5_DIGEST_LENGTH; i++)
+	ImageDigest digest;
+	digest.algorithm = HASH_MD5;
+	digest.bytes.assign(md5Hash, md5Hash + MD5_DIGEST_LENGTH);
+	return formatImageOutput(offset, size, vector<ImageDigest>{ digest }, path);
+}
+
+/// <summary>
+/// Formats the repaired image details with every hash of the image. A single MD5 hash keeps the original "Hash - " line,
+/// which prints each byte without padding. Otherwise every hash gets its own line named after its algorithm and is printed in full.
+/// </summary>
+/// <param name=offset>The offset of the image position in the input file</param>
+/// <param name=size>The image size in bytes</param>
+/// <param name=digests>The hashes of the image</param>
+/// <param name=path>The filepath of the image</param>
+/// <returns>The details as they are printed by printImageOutput</returns>
+string formatImageOutput(long long offset, long long size, const vector<ImageDigest>& digests, const string& path)
+{
+	char hexByte[4];
+	bool original = digests.size() == 1 && digests[0].algorithm == HASH_MD5;
+	string output = "Offset - " + to_string(offset) + "\n";
+	output += "Size - " + to_string(size) + "\n";
+	for (const ImageDigest& digest : digests)
 	{
-		printf("%X", md5Hash[i]);
+		if (!original)
+		{
+			output += "Hash (" + string(getHashName(digest.algorithm)) + ") - " + formatDigest(digest) + "\n";
+			continue;
+		}
+		output += "Hash - ";
+		for (unsigned char hashByte : digest.bytes)
+		{
+			snprintf(hexByte, sizeof(hexByte), "%X", hashByte);
+			output += hexByte;
+		}
+		output += "\n";
 	}
-	cout << "\n";
-	cout << "Path - " << path << "\n";
-	cout << "\n\n";
+	output += "Path - " + path + "\n";
+	output += "\n\n";
+	return output;
 }
 
 /// <summary>
-/// The core logic for challenge 3. This processes an input file to extract/repair/save the magic jpeg files.
+/// Prints out the repaired image details
+/// </summary>
+/// <param name=offset>The offset of the image position in the input file</param>
+/// <param name=size>The image size in bytes</param>
+/// <param name=md5Hash>The md5 hash of the image</param>
+/// <param name=path>The filepath of the image</param>
+void printImageOutput(long long offset, long long size, unsigned char * md5Hash, string path) 
+{
+	cout << formatImageOutput(offset, size, md5Hash, path);
+}
+
+/// <summary>
+/// Creates the output directory of an image file - <parentDir>/<filename>_Repaired/
 /// </summary>
 /// <param name=imagePath>The filepath of the image</param>
-/// <param name=kdbPath>The filepath of the KDB file</param>
-void ImageHandler(string imagePath, string kdbPath)
+/// <returns>The directory path, ending in a separator</returns>
+string createRepairedDirectory(const string& imagePath)
 {
-	fstream imageFile, kdbFile, outImageFile;
-	
-	char drive[PATH_LENGTH], dir[PATH_LENGTH], filename[PATH_LENGTH],ext[PATH_LENGTH];
-	unsigned char md5Hash[MD5_DIGEST_LENGTH], buffer[BUFFER_SIZE];
-	unsigned char* magicBytes = nullptr;
+	char drive[PATH_LENGTH], dir[PATH_LENGTH], filename[PATH_LENGTH], ext[PATH_LENGTH];
+	string newParentDir;
+
+	_splitpath_s(imagePath.c_str(), drive, dir, filename, ext);		//These are stripped out since we'll be creating a new dir + new files. 
+	newParentDir = (string)drive + (string)dir + (string)filename + "_Repaired/";
+	CreateDirectory(newParentDir.c_str(), NULL); //Automatically returns if path exists
+	return newParentDir;
+}
+
+/// <summary>
+/// Writes a piece of the repaired jpeg to the output file and adds it to the hash
+/// </summary>
+static void writeAndHash(fstream& outImageFile, ImageHasher& hasher, const void* data, size_t size)
+{
+	outImageFile.write((const char*)data, size);
+	hasher.update(data, size);
+}
 
-	int magicSize, remainingBytes, jpegSize;
-	bool error = false;
+/// <summary>
+/// Repairs, saves and hashes one magic jpeg. The magic bytes are replaced by the JPG start bytes.
+/// </summary>
+/// <param name=imageFile>The image file</param>
+/// <param name=startOffset>The position of the magic string in the image file</param>
+/// <param name=endOffset>The position after the JPG end string in the image file</param>
+/// <param name=magicSize>The number of characters in the magic string</param>
+/// <param name=outputPath>The filepath of the repaired jpeg</param>
+/// <param name=hashAlgorithms>The hashes to compute</param>
+/// <param name=digests>Outputs the hashes of the repaired jpeg</param>
+/// <returns>true on success, false on failed</returns>
+bool extractJPEG(fstream& imageFile, long long startOffset, long long endOffset, int magicSize, const string& outputPath,
+	const vector<HashAlgorithm>& hashAlgorithms, vector<ImageDigest>& digests)
+{
+	unsigned char buffer[BUFFER_SIZE];
+	long long jpegSize = endOffset - startOffset;
+	int remainingBytes;
+	fstream outImageFile;
+	ImageHasher hasher(hashAlgorithms);
 
-	list<int> offsetList, endOffsetList;			//These contain the start/end positions of the jpeg images in the image file.
-	list<int>::iterator startOffset, endOffset;			
+	outImageFile.open(outputPath, ios::out | ios::binary | ios::trunc);
+	if (!outImageFile.is_open()) return 0;
 
-	string outputPath, newParentDir;
-	MD5_CTX mdContext;
+	imageFile.clear();
+	imageFile.seekg(startOffset + magicSize);
 
-	//File being opened, make sure to close the files as well.
-	if (!openInputFile(kdbFile, "Enter KDB File Path:", kdbPath)) return;
-	if (!openInputFile(imageFile, "Enter Image File Path:", imagePath)) { kdbFile.close(); return; }
+	//Write to the file the magic byte. Hash the magic bytes
+	writeAndHash(outImageFile, hasher, JPG_STRING, 3);
 
-	cout << "\n\n";
-	_splitpath_s(imagePath.c_str(), drive, dir, filename, ext);		//These are stripped out since we'll be creating a new dir + new files. 
+	//Fill the buffer as many times as possible from the magic byte position. Then write and hash the data.
+	for (long long index = 0; index < (jpegSize - magicSize) / BUFFER_SIZE; index++)
+	{
+		imageFile.read((char*) buffer, BUFFER_SIZE);
+		writeAndHash(outImageFile, hasher, buffer, BUFFER_SIZE);
+	}
 
-	//Load Magic Bytes from KDB File
-	magicBytes = getMagicBytesFromKDB(kdbFile, magicSize, error);
-	kdbFile.close();
-	if (error) {
-		cout << "Decrypting KDB File Failed\n";
-		imageFile.close(); 
+	//The buffer wasn't able to be fully filled in the last loop, so now we read/write/hash the remaining data. 
+	remainingBytes = (int)((jpegSize - magicSize) % BUFFER_SIZE);
+	if (remainingBytes > 0) 
+	{
+		imageFile.read((char*)buffer, remainingBytes);
+		writeAndHash(outImageFile, hasher, buffer, remainingBytes);
+	}
+
+	outImageFile.close();
+	digests = hasher.finish();
+	return 1;
+}
+
+/// <summary>
+/// Repairs, saves and hashes one magic jpeg of an image that is already in memory (e.g. mapped).
+/// </summary>
+/// <param name=imageData>The image data</param>
+/// <param name=startOffset>The position of the magic string in the image data</param>
+/// <param name=endOffset>The position after the JPG end string in the image data</param>
+/// <param name=magicSize>The number of characters in the magic string</param>
+/// <param name=outputPath>The filepath of the repaired jpeg</param>
+/// <param name=hashAlgorithms>The hashes to compute</param>
+/// <param name=digests>Outputs the hashes of the repaired jpeg</param>
+/// <returns>true on success, false on failed</returns>
+bool extractJPEG(const unsigned char* imageData, long long startOffset, long long endOffset, int magicSize, const string& outputPath,
+	const vector<HashAlgorithm>& hashAlgorithms, vector<ImageDigest>& digests)
+{
+	fstream outImageFile;
+	ImageHasher hasher(hashAlgorithms);
+
+	outImageFile.open(outputPath, ios::out | ios::binary | ios::trunc);
+	if (!outImageFile.is_open()) return 0;
+
+	writeAndHash(outImageFile, hasher, JPG_STRING, 3);
+	if (endOffset - startOffset > magicSize)
+	{
+		writeAndHash(outImageFile, hasher, imageData + startOffset + magicSize, endOffset - startOffset - magicSize);
+	}
+
+	outImageFile.close();
+	digests = hasher.finish();
+	return 1;
+}
+
+/// <summary>
+/// Repairs, saves and hashes one magic jpeg of a mapped image. The JPG start bytes are written and the rest of the jpeg is copied
+/// from the image file to the output file by the kernel. The hash is computed separately from the mapping, so no bytes are copied through a buffer.
+/// </summary>
+/// <param name=imageFile>The mapped image file</param>
+/// <param name=startOffset>The position of the magic string in the image file</param>
+/// <param name=endOffset>The position after the JPG end string in the image file</param>
+/// <param name=magicSize>The number of characters in the magic string</param>
+/// <param name=outputPath>The filepath of the repaired jpeg</param>
+/// <param name=hashAlgorithms>The hashes to compute</param>
+/// <param name=digests>Outputs the hashes of the repaired jpeg</param>
+/// <returns>true on success, false on failed</returns>
+bool extractJPEG(const MappedFile& imageFile, long long startOffset, long long endOffset, int magicSize, const string& outputPath,
+	const vector<HashAlgorithm>& hashAlgorithms, vector<ImageDigest>& digests)
+{
+	ImageHasher hasher(hashAlgorithms);
+	long long payloadSize = max(endOffset - startOffset - magicSize, 0LL);
+
+	if (!imageFile.copyRangeToFile(outputPath, JPG_STRING, 3, startOffset + magicSize, payloadSize)) return 0;
+
+	hasher.update(JPG_STRING, 3);
+	if (payloadSize > 0) hasher.update(imageFile.data() + startOffset + magicSize, (size_t)payloadSize);
+	digests = hasher.finish();
+	return 1;
+}
+
+/// <summary>
+/// Repairs, hashes and stores one magic jpeg of a mapped image in a content-addressed store, and adds it to the store's index.
+/// The jpeg is hashed from the mapping first, so a jpeg that is already stored is not written at all. 
+/// A new jpeg is copied by the kernel to a temporary file, which is then moved to its object path.
+/// </summary>
+/// <param name=imageFile>The mapped image file</param>
+/// <param name=imagePath>The filepath of the image, for the index</param>
+/// <param name=startOffset>The position of the magic string in the image file</param>
+/// <param name=endOffset>The position after the JPG end string in the image file</param>
+/// <param name=magicSize>The number of characters in the magic string</param>
+/// <param name=store>The store. The jpeg is stored under its first hash</param>
+/// <param name=hashAlgorithms>The hashes to compute</param>
+/// <param name=digests>Outputs the hashes of the repaired jpeg</param>
+/// <param name=outputPath>Outputs the filepath of the stored jpeg</param>
+/// <returns>true on success, false on failed</returns>
+bool storeJPEG(const MappedFile& imageFile, const string& imagePath, long long startOffset, long long endOffset, int magicSize, ImageStore& store,
+	const vector<HashAlgorithm>& hashAlgorithms, vector<ImageDigest>& digests, string& outputPath)
+{
+	ImageHasher hasher(hashAlgorithms);
+	long long payloadSize = max(endOffset - startOffset - magicSize, 0LL);
+
+	hasher.update(JPG_STRING, 3);
+	if (payloadSize > 0) hasher.update(imageFile.data() + startOffset + magicSize, (size_t)payloadSize);
+	digests = hasher.finish();
+
+	if (store.claim(digests[0]))
+	{
+		string tempPath = store.getTempPath();
+		if (!imageFile.copyRangeToFile(tempPath, JPG_STRING, 3, startOffset + magicSize, payloadSize))
+		{
+			remove(tempPath.c_str());
+			store.release(digests[0]);
+			return 0;
+		}
+		if (!store.commit(tempPath, digests[0])) return 0;
+	}
+
+	outputPath = store.getObjectPath(digests[0]);
+	store.addIndexEntry(imagePath, startOffset, endOffset - startOffset, digests[0]);
+	return 1;
+}
+
+/// <summary>
+/// Repairs, hashes and stores one magic jpeg in a content-addressed store, and adds it to the store's index.
+/// The hash is only known once the jpeg has been read, so it is written to a temporary file that is moved into the store or removed.
+/// </summary>
+/// <param name=imageFile>The image file</param>
+/// <param name=imagePath>The filepath of the image, for the index</param>
+/// <param name=startOffset>The position of the magic string in the image file</param>
+/// <param name=endOffset>The position after the JPG end string in the image file</param>
+/// <param name=magicSize>The number of characters in the magic string</param>
+/// <param name=store>The store. The jpeg is stored under its first hash</param>
+/// <param name=hashAlgorithms>The hashes to compute</param>
+/// <param name=digests>Outputs the hashes of the repaired jpeg</param>
+/// <param name=outputPath>Outputs the filepath of the stored jpeg</param>
+/// <returns>true on success, false on failed</returns>
+bool storeJPEG(fstream& imageFile, const string& imagePath, long long startOffset, long long endOffset, int magicSize, ImageStore& store,
+	const vector<HashAlgorithm>& hashAlgorithms, vector<ImageDigest>& digests, string& outputPath)
+{
+	string tempPath = store.getTempPath();
+
+	if (!extractJPEG(imageFile, startOffset, endOffset, magicSize, tempPath, hashAlgorithms, digests)) return 0;
+	if (!store.storeFile(tempPath, digests[0])) return 0;
+
+	outputPath = store.getObjectPath(digests[0]);
+	store.addIndexEntry(imagePath, startOffset, endOffset - startOffset, digests[0]);
+	return 1;
+}
+
+static ImageExtractor* followedExtractor = nullptr;		//The extractor of the followed image Ctrl+C stops, nullptr if none
+
+/// <summary>
+/// SIGINT handler of a followed image. ImageExtractor::stop only sets a flag, so it is safe here.
+/// </summary>
+static void stopFollowing(int)
+{
+	if (followedExtractor != nullptr) followedExtractor->stop();
+}
+
+/// <summary>
+/// The core logic for challenge 3. This processes an input file to extract/repair/save the magic jpeg files.
+/// The work is done by an ImageExtractor; this prompts for the paths that are not given and prints the repaired jpegs as they are reported.
+/// With a record format the jpegs are written as JSON lines or CSV instead, to options.recordPath or to stdout (the messages then go to stderr).
+/// </summary>
+/// <param name=imagePath>The filepath of the image, "-" for stdin</param>
+/// <param name=kdbPath>The filepath of the KDB file</param>
+/// <param name=options>The settings of the run</param>
+void ImageHandler(string imagePath, string kdbPath, const ImageHandlerOptions& options)
+{
+	bool fromStdin = imagePath == STDIN_PATH;		//The image is piped in, so it can only be read forward
+	bool writeRecords = options.recordFormat != "" || options.recordPath != "";	//Records are written instead of the repaired image details
+	fstream imageFile, recordFile;
+	MappedFile kdbFile;
+	RecordFormat recordFormat = RECORD_JSONL;
+
+	if (options.recordFormat != "" && !parseRecordFormat(options.recordFormat, recordFormat)) {
+		cout << "Unknown Record Format - " << options.recordFormat << " (use jsonl, csv)\n";
 		return;
 	}
-	if (magicBytes == nullptr) {
-		cout << "No Magic JPEG found";
-		imageFile.close();
+	//The paths are read from stdin when they are not given, which a piped image would consume.
+	if (fromStdin && kdbPath == "") {
+		cout << "The KDB File Path must be given with --kdb when the image is read from stdin\n";
 		return;
 	}
 
-	//Get an offset list of the magic'd jpeg files in the image file
-	searchForMagicJPEGS(imageFile, offsetList, endOffsetList, magicBytes, magicSize);
+	//File being opened, make sure to close the files as well.
+	//They are only opened to prompt for and check the paths; the extractor opens them again itself.
+	if (!openMappedFile(kdbFile, "Enter KDB File Path:", kdbPath)) return;
+	if (!fromStdin && !openInputFile(imageFile, "Enter Image File Path:", imagePath)) { kdbFile.close(); return; }
+	kdbFile.close();
+	imageFile.close();
 
-	startOffset = offsetList.begin();
-	endOffset = endOffsetList.begin();
-	
-	newParentDir = (string)drive+(string)dir + (string)filename + "_Repaired/";
-	CreateDirectory(newParentDir.c_str(), NULL); //Automatically returns if path exists
+	//Records written to stdout must not be mixed with the banners, so those are left out and the messages go to stderr.
+	bool recordsToStdout = writeRecords && options.recordPath == "";
+	ostream& messages = recordsToStdout ? cerr : cout;
+	if (writeRecords && !recordsToStdout) {
+		recordFile.open(options.recordPath, ios::out | ios::binary | ios::trunc);
+		if (!recordFile.is_open()) {
+			cout << "Opening Record File Failed\n";
+			return;
+		}
+	}
+	if (!recordsToStdout) cout << "\n\n";
 
-	cout << "----------------------- REPAIRED JPEGS -----------------------\n";
-	//Loop through every offset (JPEG) image and process the data.
-	//Processing the data includes
-	//1. Repairing the JPEG to include the correct magic bytes
-	//2. Saving the JPEG into a separate file
-	//3. Printing out the file details (offset, size, MD5 hash, path).
-	for (int offsetIndex = 0; offsetIndex < offsetList.size(); offsetIndex++)
-	{
-		//Create the output file to write to - <parentDir>/<filename>_Repaired/<offset>.jpeg
-		outputPath = newParentDir + to_string(*startOffset) + ".jpeg";
-		outImageFile.open(outputPath, ios::out | ios::binary | ios::trunc);
-		
-		MD5_Init(&mdContext);
-		jpegSize = *endOffset-*startOffset;
-		imageFile.clear();
-		imageFile.seekg(*startOffset + magicSize);
+	ImageExtractor extractor(options);
+	if (!extractor.open(kdbPath)) {
+		messages << extractor.getError() << "\n";
+		return;
+	}
+
+	ImageRecordWriter records(recordsToStdout ? cout : recordFile, recordFormat);
+	if (!recordsToStdout) cout << "----------------------- REPAIRED JPEGS -----------------------\n";
+
+	//Ctrl+C ends a followed image cleanly: the checkpoint is saved, the pending jpeg deleted and the records flushed.
+	if (options.follow)
+	{
+		followedExtractor = &extractor;
+		signal(SIGINT, stopFollowing);
+	}
+	bool extracted = extractor.extract(imagePath,
+		[&](const ExtractedImage& image) {
+			if (writeRecords) records.write(imagePath, image);
+			else cout << formatImageOutput(image.offset, image.size, image.digests, image.path);
+			//A followed image never ends, so its jpegs are shown as they are found.
+			if (options.follow) writeRecords ? records.flush() : (void)cout.flush();
+		},
+		[&messages](const string& message) { messages << message << "\n"; });
+	if (options.follow)
+	{
+		signal(SIGINT, SIG_DFL);
+		followedExtractor = nullptr;
+	}
+	records.flush();
+
+	if (!extracted) messages << extractor.getError() << "\n";
+	recordFile.close();
+}
+
+/*
+* ===================
+* STREAMING EXTRACTOR
+* ===================
+*/
+StreamingExtractor::StreamingExtractor(const PatternMatcher& magic, const string& outputDir, const RepairedImageCallback& onImage,
+	const vector<HashAlgorithm>& hashAlgorithms, const ExtractorMessageCallback& onMessage, long long rewindLimit)
+	: magic(magic), outputDir(outputDir), onImage(onImage), buffer(SCAN_BUFFER_SIZE), hasher(hashAlgorithms), onMessage(onMessage)
+{
+	carrySize = 0;
+	bufferPos = 0;
+	findEnd = false;
+	startOffset = 0;
+	writtenPos = 0;
+	numImages = 0;
+	walkMarkers = false;
+	this->rewindLimit = rewindLimit;
+}
+
+/// <summary>
+/// Only cleans up: a jpeg still being written is deleted. The last bytes are processed by finish, which reports jpegs and must be called explicitly.
+/// </summary>
+StreamingExtractor::~StreamingExtractor()
+{
+	suspend();
+}
+
+/// <summary>
+/// Reads the stream into the buffer until it ends and searches every read. The last maxPatternSize - 1 bytes of each read are only
+/// searched after the next read, so they are moved to the front of the buffer instead of being read again. While the markers of a jpeg
+/// are walked, everything from its magic string on is kept as well, and the buffer grows with the jpeg.
+/// </summary>
+/// <param name=imageStream>The image stream, read from its current position</param>
+void StreamingExtractor::process(istream& imageStream)
+{
+	long long carryLength = max(magic.getMaxPatternSize(), END_STRING_SIZE) - 1;
+	long long bufferLength, scanLength, keepPos;
+
+	while (imageStream.read((char*)buffer.data() + carrySize, buffer.size() - carrySize) || imageStream.gcount() > 0)
+	{
+		bufferLength = carrySize + imageStream.gcount();
+		scanLength = max(bufferLength - carryLength, 0LL);
+		scanBuffer(bufferLength, scanLength, false);
+
+		keepPos = (findEnd && walkMarkers) ? startOffset : bufferPos + scanLength;
+		carrySize = bufferPos + bufferLength - keepPos;
+		if (keepPos > bufferPos) memmove(buffer.data(), buffer.data() + (keepPos - bufferPos), (size_t)carrySize);
+		bufferPos = keepPos;
+
+		//The buffer doubles while the rewind window fills it, and goes back to its size once the window is dropped.
+		if ((long long)buffer.size() - carrySize < SCAN_BUFFER_SIZE / 2) buffer.resize(max(buffer.size() * 2, (size_t)carrySize + SCAN_BUFFER_SIZE));
+		else if (!(findEnd && walkMarkers) && buffer.size() > SCAN_BUFFER_SIZE)
+		{
+			buffer.resize(SCAN_BUFFER_SIZE);
+			buffer.shrink_to_fit();
+		}
+	}
+}
 
-		//Write to the file the magic byte. Hash the magic bytes
-		outImageFile.write(JPG_STRING, 3);
-		MD5_Update(&mdContext, JPG_STRING, 3);
+/// <summary>
+/// Searches the bytes carried over from the last read. A jpeg whose markers are still undecided is not well-formed, since its data ended.
+/// A magic jpeg that is still missing its end string is cut off, so it is deleted.
+/// </summary>
+void StreamingExtractor::finish()
+{
+	scanBuffer(carrySize, carrySize, true);
+	bufferPos += carrySize;
+	carrySize = 0;
+	suspend();
+}
 
-		//Fill the buffer as many times as possible from the magic byte position. Then write and hash the data.
-		for (int index = 0; index < (jpegSize - magicSize) / BUFFER_SIZE; index++)
+/// <summary>
+/// Stops without searching the bytes carried over from the last read, since the stream may still grow past them. 
+/// A magic jpeg that is still missing its end string is deleted; resuming at its magic string processes it again.
+/// Read the scan state before calling this, it is reset.
+/// </summary>
+void StreamingExtractor::suspend()
+{
+	carrySize = 0;
+	if (findEnd)
+	{
+		if (outImageFile.is_open())
 		{
-			imageFile.read((char*) buffer, BUFFER_SIZE);
-			outImageFile.write((char*) buffer, BUFFER_SIZE);
-			MD5_Update(&mdContext, buffer, BUFFER_SIZE);
+			outImageFile.close();
+			remove(outputPath.c_str());
 		}
+		findEnd = false;
+	}
+}
+
+/// <summary>
+/// Continues an image from offset, as if everything before it had been processed and the search was waiting for a magic string.
+/// The stream passed to process must start at offset.
+/// </summary>
+/// <param name=offset>The position in the image of the first byte of the stream</param>
+void StreamingExtractor::resume(long long offset)
+{
+	suspend();
+	bufferPos = offset;
+	writtenPos = offset;
+}
+
+long long StreamingExtractor::getScannedOffset() const
+{
+	return bufferPos;
+}
+
+bool StreamingExtractor::isWaitingForEnd() const
+{
+	return findEnd;
+}
+
+long long StreamingExtractor::getPendingOffset() const
+{
+	return startOffset;
+}
 
-		//The buffer wasn't able to be fully filled in the last loop, so now we read/write/hash the remaining data. 
-		remainingBytes = (jpegSize - magicSize) % BUFFER_SIZE;
-		if (remainingBytes > 0) 
+long long StreamingExtractor::getNumImages() const
+{
+	return numImages;
+}
+
+/// <summary>
+/// Searches the first scanLength positions of the buffer, alternating between the magic string and the end of the jpeg like scanWindow.
+/// The end of a jpeg is found by walking its markers. A jpeg that is not well-formed is searched again from its magic string,
+/// this time for its first end string; its bytes are all still in the rewind window and none were written yet. Once the end search
+/// runs, the jpeg is written up to the end of the searched positions.
+/// </summary>
+/// <param name=bufferLength>The number of valid bytes in the buffer</param>
+/// <param name=scanLength>The number of start positions to check</param>
+/// <param name=lastBytes>true if the image ends with the buffer, so a jpeg whose markers are still undecided is not well-formed</param>
+void StreamingExtractor::scanBuffer(long long bufferLength, long long scanLength, bool lastBytes)
+{
+	long long bufferIndex = 0;
+	long long matchIndex;
+	int variant;
+
+	//At the end of the image an undecided walk is decided even if no positions are left to search.
+	while (bufferIndex < scanLength || (lastBytes && findEnd && walkMarkers))
+	{
+		if (findEnd && walkMarkers)
 		{
-			imageFile.read((char*)buffer, remainingBytes);
-			outImageFile.write((char*)buffer, remainingBytes);
-			MD5_Update(&mdContext, buffer, remainingBytes);
+			JPEGWalkResult walkResult = walker.walk(buffer.data(), bufferPos, bufferPos + scanLength);
+			if (walkResult == JPEG_END)
+			{
+				endImage(walker.getEndPos());
+				findEnd = false;
+				bufferIndex = walker.getEndPos() + 1 - bufferPos;
+				continue;
+			}
+			if (walkResult == JPEG_WALKING && !lastBytes)
+			{
+				if (bufferPos + scanLength - startOffset <= rewindLimit) break;
+				if (onMessage) onMessage("Jpeg at offset " + to_string(startOffset) + " outgrew the rewind window (" + to_string(rewindLimit) + 
+					" bytes) before its end was found, it ends at its first end string");
+			}
+
+			//Like the mapped search, a jpeg that is not well-formed ends at the first end string after its magic string.
+			walkMarkers = false;
+			bufferIndex = startOffset + 1 - bufferPos;
+			continue;
 		}
 
-		outImageFile.close();
-		MD5_Final(md5Hash, &mdContext);
+		const PatternMatcher& matcher = findEnd ? getEndMatcher() : magic;
 
-		printImageOutput(*startOffset, jpegSize, md5Hash, outputPath);
+		matchIndex = matcher.find(buffer.data() + bufferIndex, min(bufferLength, scanLength + matcher.getMaxPatternSize() - 1) - bufferIndex, variant);
+		if (matchIndex < 0) break;
+		bufferIndex += matchIndex;
 
-		startOffset++;
-		endOffset++;
+		if (findEnd) endImage(bufferPos + bufferIndex);
+		else startImage(bufferPos + bufferIndex, variant);
+		findEnd = !findEnd;
+		bufferIndex++;
 	}
 
-	delete [] magicBytes;
-	imageFile.close();
-}
\ No newline at end of file
+	if (findEnd && !walkMarkers) writeImage(bufferPos + scanLength);
+}
+
+/// <summary>
+/// Creates the repaired jpeg - <outputDir>/<offset>.jpeg - and writes the JPG start bytes in place of the magic variant that matched.
+/// Its end is found by walking its markers, unless its file can't be written.
+/// </summary>
+void StreamingExtractor::startImage(long long offset, int variant)
+{
+	startOffset = offset;
+	writtenPos = offset + magic.getPatternSize(variant);
+	outputPath = outputDir + to_string(offset) + ".jpeg";
+	walker.reset(writtenPos);
+	walkMarkers = false;
+
+	outImageFile.open(outputPath, ios::out | ios::binary | ios::trunc);
+	if (!outImageFile.is_open()) return;		//The jpeg is skipped, like when extractJPEG fails
+	walkMarkers = true;
+	hasher.reset();
+	writeAndHash(outImageFile, hasher, JPG_STRING, JPG_STRING_SIZE);
+}
+
+/// <summary>
+/// Writes the rest of the jpeg, including the end string, and reports it
+/// </summary>
+void StreamingExtractor::endImage(long long offset)
+{
+	writeImage(offset + END_STRING_SIZE);
+	if (!outImageFile.is_open()) return;
+
+	outImageFile.close();
+	numImages++;
+	onImage(startOffset, offset + END_STRING_SIZE - startOffset, hasher.finish(), outputPath);
+}
+
+/// <summary>
+/// Writes and hashes the bytes of the jpeg from writtenPos up to endPos. They are always still in the buffer.
+/// </summary>
+void StreamingExtractor::writeImage(long long endPos)
+{
+	if (!outImageFile.is_open() || endPos <= writtenPos) return;
+
+	writeAndHash(outImageFile, hasher, buffer.data() + (writtenPos - bufferPos), (size_t)(endPos - writtenPos));
+	writtenPos = endPos;
+}
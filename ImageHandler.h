@@ -1,15 +1,216 @@
+#pragma once
 #include <string>
+#include <fstream>
+#include <functional>
+#include <vector>
+#include <openssl/md5.h>
+#include "DecryptKDB.h"
+#include "ImageHash.h"
+#include "ImageStore.h"
+#include "JPEGMarkers.h"
+#include "PatternScanner.h"
 
 using namespace std;
 
+const long long SCAN_WINDOW_SIZE = 256 << 20;	//Size of the windows of a large mapped image search in bytes. A multiple of the parallel search chunk size
+const long long STREAM_REWIND_LIMIT = 64 << 20;	//Default size of the rewind window of a streaming scan in bytes (see StreamingExtractor)
+
+/// <summary>Settings of an ImageHandler run</summary>
+struct ImageHandlerOptions
+{
+	bool streaming = false;									//Process the image in a single streaming pass (see StreamingExtractor)
+	vector<HashAlgorithm> hashAlgorithms{ HASH_MD5 };		//The hashes printed for every repaired jpeg
+	int numThreads = 0;										//Threads that search, save and hash. 0 means one per hardware thread
+	string storeDir;										//Save the jpegs into this content-addressed store (see ImageStore). "" saves them to <filename>_Repaired/
+	string checkpointPath;									//Resume from and save the scan state to this file (see ScanCheckpoint). "" always scans from the start
+	bool follow = false;									//Keep polling the image for appended bytes until ImageExtractor::stop is called (Ctrl+C)
+	int pollInterval = 1000;								//Milliseconds between two polls of a followed image
+	long long rewindLimit = STREAM_REWIND_LIMIT;			//Bytes a streaming scan keeps from the magic string of a jpeg until it knows where the jpeg ends
+	bool kdbSidecar = false;								//Open the KDB file through its sidecar cache (see KDBReader::openCached)
+	string recordFormat;									//Write the jpegs as records instead of printing them: jsonl or csv. "" prints them, unless recordPath is set (jsonl)
+	string recordPath;										//The file the records are written to. "" writes them to stdout
+};
+
 /// <summary>
-/// RUNS CHALLENGE 3 - Extracts/Repairs/Saves/Outputs the magic jpegs in a file
+/// RUNS CHALLENGE 3 - Extracts/Repairs/Saves/Outputs the magic jpegs in a file.
+/// Arguments: [stream] [--kdb <path>] [--image <path|->] [--hash <md5,xxh64,blake2b>] [--threads <n>] [--store <dir>]
+///            [--checkpoint <file>] [--follow] [--poll <ms>] [--format <jsonl|csv>] [--records <file>] [--sidecar]
+/// An image path of "-" reads the image from stdin.
 /// </summary>
-int ImageHandlerMain();
+/// <param name="argc">The number of arguments</param>
+/// <param name="argv">The arguments</param>
+int ImageHandlerMain(int argc = 0, char* argv[] = nullptr);
 
 /// <summary>
 /// The core logic for challenge 3. This processes an input file to extract/repair/save the magic jpeg files.
+/// An image that can't be seeked (stdin, a pipe) is processed in a single streaming pass.
+/// To extract without any console I/O, use an ImageExtractor directly.
 /// </summary>
-/// <param name=imagePath>The filepath of the image</param>
+/// <param name=imagePath>The filepath of the image, "-" for stdin</param>
 /// <param name=kdbPath>The filepath of the KDB file</param>
-void ImageHandler(string imagePath = "", string kdbPath = "");
+/// <param name=options>The settings of the run</param>
+void ImageHandler(string imagePath = "", string kdbPath = "", const ImageHandlerOptions& options = ImageHandlerOptions());
+
+/// <summary>A magic jpeg found in an image</summary>
+struct MagicJPEG
+{
+	long long startOffset;	//The position of the magic string in the image
+	long long endOffset;	//The position after the JPG end string in the image
+	int variant;			//The magic variant that matched
+};
+
+/*
+* ===================
+* STAGES
+* ===================
+* The steps of ImageHandler, so they can also be run by the batch driver.
+*/
+/// <summary>
+/// Gets the Magic bytes of every MAGIC entry in the KDB File. Entries with the same bytes are only returned once.
+/// </summary>
+vector<vector<unsigned char>> getMagicPatternsFromKDB(KDBReader& kdbReader, bool &error);
+
+/// <summary>
+/// Searches the Image file for all Magic jpegs of every magic variant in one pass. Outputs the offsets and the variant that matched into jpegs,
+/// in image order. If several variants start at the same position the longest one wins. A magic jpeg without an end string is not output.
+/// The end of each jpeg is found by walking its markers like the in-memory search, reading on past the window if the jpeg continues after it.
+/// </summary>
+void searchForMagicJPEGS(fstream &imageFile, vector<MagicJPEG>& jpegs, const PatternMatcher& magic);
+
+/// <summary>
+/// Searches an image that is already in memory (e.g. mapped) for all Magic jpegs. The end of each jpeg is found by walking its markers,
+/// so an end string inside its metadata (e.g. an EXIF thumbnail) is skipped. Jpegs that are not well-formed end at the first end string. Gives the same jpegs as the file search.
+/// With more than one thread large images are split into chunks that are searched concurrently.
+/// </summary>
+void searchForMagicJPEGS(const unsigned char* imageData, long long imageSize, vector<MagicJPEG>& jpegs, const PatternMatcher& magic, int numThreads = 1);
+
+/// <summary>
+/// Searches a mapped image for all Magic jpegs, like the in-memory search. An image larger than the scan window is searched one window
+/// at a time: the next window is prefetched while the current one is searched, and its pages are released once it is done, so memory use
+/// stays flat however large the image is.
+/// </summary>
+void searchForMagicJPEGS(const MappedFile& imageFile, vector<MagicJPEG>& jpegs, const PatternMatcher& magic, int numThreads = 1);
+
+/// <summary>
+/// Creates the output directory of an image file - <parentDir>/<filename>_Repaired/
+/// </summary>
+string createRepairedDirectory(const string& imagePath);
+
+/// <summary>
+/// Repairs, saves and hashes one magic jpeg. The magic bytes are replaced by the JPG start bytes.
+/// </summary>
+bool extractJPEG(fstream& imageFile, long long startOffset, long long endOffset, int magicSize, const string& outputPath,
+	const vector<HashAlgorithm>& hashAlgorithms, vector<ImageDigest>& digests);
+
+/// <summary>
+/// Repairs, saves and hashes one magic jpeg of an image that is already in memory (e.g. mapped).
+/// </summary>
+bool extractJPEG(const unsigned char* imageData, long long startOffset, long long endOffset, int magicSize, const string& outputPath,
+	const vector<HashAlgorithm>& hashAlgorithms, vector<ImageDigest>& digests);
+
+/// <summary>
+/// Repairs, saves and hashes one magic jpeg of a mapped image. The jpeg is copied by the kernel and hashed from the mapping.
+/// </summary>
+bool extractJPEG(const MappedFile& imageFile, long long startOffset, long long endOffset, int magicSize, const string& outputPath,
+	const vector<HashAlgorithm>& hashAlgorithms, vector<ImageDigest>& digests);
+
+/// <summary>
+/// Repairs, hashes and stores one magic jpeg of a mapped image in a content-addressed store, and adds it to the store's index.
+/// The jpeg is hashed from the mapping first, so a jpeg that is already stored is not written at all. outputPath is set to its object path.
+/// </summary>
+bool storeJPEG(const MappedFile& imageFile, const string& imagePath, long long startOffset, long long endOffset, int magicSize, ImageStore& store,
+	const vector<HashAlgorithm>& hashAlgorithms, vector<ImageDigest>& digests, string& outputPath);
+
+/// <summary>
+/// Repairs, hashes and stores one magic jpeg in a content-addressed store, and adds it to the store's index.
+/// The jpeg is written to a temporary file while it is hashed, which is then moved into the store or removed if it is already stored.
+/// </summary>
+bool storeJPEG(fstream& imageFile, const string& imagePath, long long startOffset, long long endOffset, int magicSize, ImageStore& store,
+	const vector<HashAlgorithm>& hashAlgorithms, vector<ImageDigest>& digests, string& outputPath);
+
+/// <summary>
+/// Formats the repaired image details
+/// </summary>
+string formatImageOutput(long long offset, long long size, const unsigned char * md5Hash, const string& path);
+
+/// <summary>
+/// Formats the repaired image details with every hash of the image. A single MD5 hash is formatted like the MD5 overload.
+/// </summary>
+string formatImageOutput(long long offset, long long size, const vector<ImageDigest>& digests, const string& path);
+
+/// <summary>
+/// Prints out the repaired image details
+/// </summary>
+void printImageOutput(long long offset, long long size, unsigned char * md5Hash, string path);
+
+/*
+* ===================
+* STREAMING
+* ===================
+*/
+/// <summary>
+/// Called for every repaired jpeg with its offset in the image, its size in the image, its hashes and its filepath
+/// </summary>
+typedef function<void(long long offset, long long size, const vector<ImageDigest>& digests, const string& path)> RepairedImageCallback;
+
+/// <summary>Called with progress and warnings of an extraction, e.g. where a checkpointed scan resumes</summary>
+typedef function<void(const string& message)> ExtractorMessageCallback;
+
+/// <summary>
+/// Searches, repairs, saves and hashes the magic jpegs of an image in a single forward pass. Every byte is read once:
+/// the repaired jpeg is written and hashed from the same buffer the search runs on, while the image is still being read.
+/// Gives the same jpegs and offsets as the mapped search followed by extractJPEG. Every magic variant is searched for.
+/// The end of a jpeg is found by walking its markers as they are read (see JPEGMarkerWalker). Until the walk decides, the bytes from the
+/// magic string on stay in the buffer (the rewind window), so a jpeg that turns out not to be well-formed is searched again from its
+/// magic string for its first end string without reading anything twice. A jpeg still undecided when it outgrows the window ends at its
+/// first end string right away, and the message callback is told.
+/// process can be called again when the stream has grown; finish ends the image and has to be called, the destructor only deletes a jpeg still being written. An image that keeps growing is left with suspend instead,
+/// and a later run picks it up again with resume (see ScanCheckpoint).
+/// </summary>
+class StreamingExtractor
+{
+public:
+	StreamingExtractor(const PatternMatcher& magic, const string& outputDir, const RepairedImageCallback& onImage,
+		const vector<HashAlgorithm>& hashAlgorithms = vector<HashAlgorithm>{ HASH_MD5 }, const ExtractorMessageCallback& onMessage = nullptr,
+		long long rewindLimit = STREAM_REWIND_LIMIT);
+	~StreamingExtractor();
+	StreamingExtractor(const StreamingExtractor&) = delete;
+	StreamingExtractor& operator=(const StreamingExtractor&) = delete;
+
+	void process(istream& imageStream);		//Reads and processes the stream until it ends
+	void finish();							//Processes the last bytes. A magic jpeg without an end string is deleted
+	void suspend();							//Stops without processing the last bytes, which may still be incomplete. The pending jpeg is deleted
+	void resume(long long offset);			//The stream starts at offset of the image, searching for a magic string. Call before process
+
+	long long getScannedOffset() const;		//Every position before it has been searched
+	bool isWaitingForEnd() const;			//true while a magic jpeg is waiting for its end string
+	long long getPendingOffset() const;		//The position of the magic string of that jpeg
+	long long getNumImages() const;			//The number of jpegs reported
+
+private:
+	void scanBuffer(long long bufferLength, long long scanLength, bool lastBytes);	//Searches the first scanLength positions of the buffer
+	void startImage(long long offset, int variant);	//A magic string of the variant was found at offset
+	void endImage(long long offset);		//An end string was found at offset
+	void writeImage(long long endPos);		//Writes and hashes the jpeg bytes up to endPos
+
+	PatternMatcher magic;					//The magic strings to search for
+	string outputDir;						//The directory the repaired jpegs are saved in
+	RepairedImageCallback onImage;			//Called for every repaired jpeg
+
+	vector<unsigned char> buffer;			//The read buffer. Starts with the bytes carried over from the last read. Grows to hold the rewind window
+	long long carrySize;					//Bytes at the start of the buffer carried over from the last read: the rewind window, or the bytes not searched yet
+	long long bufferPos;					//The position of the buffer in the image
+	bool findEnd;							//The search state. true while searching for the end string
+
+	fstream outImageFile;					//The repaired jpeg being written
+	ImageHasher hasher;						//The hashes of the repaired jpeg being written
+	string outputPath;						//The filepath of the repaired jpeg being written
+	long long startOffset;					//The position of the magic string of the jpeg being written
+	long long writtenPos;					//The position in the image up to which the jpeg was written
+
+	JPEGMarkerWalker walker;				//Walks the markers of the jpeg being written to find its end
+	bool walkMarkers;						//false if the end of that jpeg is its first end string
+	long long rewindLimit;					//The most bytes kept from the magic string of a jpeg while its markers are walked
+	ExtractorMessageCallback onMessage;		//Called with warnings. Optional
+	long long numImages;					//The number of jpegs reported
+};
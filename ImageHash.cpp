@@ -0,0 +1,257 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <openssl/evp.h>
+#include "ImageHash.h"
+
+/*
+* ===================
+* XXH64
+* ===================
+*/
+const unsigned long long XXH_PRIME64_1 = 0x9E3779B185EBCA87ULL;
+const unsigned long long XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+const unsigned long long XXH_PRIME64_3 = 0x165667B19E3779F9ULL;
+const unsigned long long XXH_PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+const unsigned long long XXH_PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+static unsigned long long rotateLeft(unsigned long long value, int bits)
+{
+	return (value << bits) | (value >> (64 - bits));
+}
+
+/// <summary>Reads a little-endian 64 bit value</summary>
+static unsigned long long read64(const unsigned char* data)
+{
+	unsigned long long value = 0;
+	for (int index = 7; index >= 0; index--) value = (value << 8) | data[index];
+	return value;
+}
+
+/// <summary>Reads a little-endian 32 bit value</summary>
+static unsigned int read32(const unsigned char* data)
+{
+	return (unsigned int)data[0] | ((unsigned int)data[1] << 8) | ((unsigned int)data[2] << 16) | ((unsigned int)data[3] << 24);
+}
+
+static unsigned long long xxh64Round(unsigned long long accumulator, unsigned long long input)
+{
+	accumulator += input * XXH_PRIME64_2;
+	return rotateLeft(accumulator, 31) * XXH_PRIME64_1;
+}
+
+static unsigned long long xxh64MergeRound(unsigned long long hash, unsigned long long accumulator)
+{
+	hash ^= xxh64Round(0, accumulator);
+	return hash * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static void xxh64Reset(XXH64State& state, unsigned long long seed)
+{
+	state.totalLength = 0;
+	state.accumulators[0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+	state.accumulators[1] = seed + XXH_PRIME64_2;
+	state.accumulators[2] = seed;
+	state.accumulators[3] = seed - XXH_PRIME64_1;
+	state.pendingSize = 0;
+}
+
+/// <summary>Consumes one 32 byte stripe</summary>
+static void xxh64Stripe(XXH64State& state, const unsigned char* stripe)
+{
+	for (int lane = 0; lane < 4; lane++) state.accumulators[lane] = xxh64Round(state.accumulators[lane], read64(stripe + lane * 8));
+}
+
+static void xxh64Update(XXH64State& state, const unsigned char* data, size_t size)
+{
+	state.totalLength += size;
+
+	//Complete the pending stripe first.
+	if (state.pendingSize > 0)
+	{
+		size_t fill = min(size, (size_t)(32 - state.pendingSize));
+		memcpy(state.pending + state.pendingSize, data, fill);
+		state.pendingSize += (unsigned int)fill;
+		data += fill;
+		size -= fill;
+		if (state.pendingSize < 32) return;
+		xxh64Stripe(state, state.pending);
+		state.pendingSize = 0;
+	}
+
+	for (; size >= 32; data += 32, size -= 32) xxh64Stripe(state, data);
+
+	memcpy(state.pending, data, size);
+	state.pendingSize = (unsigned int)size;
+}
+
+static unsigned long long xxh64Digest(const XXH64State& state, unsigned long long seed)
+{
+	unsigned long long hash;
+	const unsigned char* data = state.pending;
+	size_t size = state.pendingSize;
+
+	if (state.totalLength >= 32)
+	{
+		hash = rotateLeft(state.accumulators[0], 1) + rotateLeft(state.accumulators[1], 7) + rotateLeft(state.accumulators[2], 12) + rotateLeft(state.accumulators[3], 18);
+		for (int lane = 0; lane < 4; lane++) hash = xxh64MergeRound(hash, state.accumulators[lane]);
+	}
+	else hash = seed + XXH_PRIME64_5;
+	hash += state.totalLength;
+
+	for (; size >= 8; data += 8, size -= 8) hash = rotateLeft(hash ^ xxh64Round(0, read64(data)), 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+	if (size >= 4)
+	{
+		hash = rotateLeft(hash ^ (read32(data) * XXH_PRIME64_1), 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		data += 4;
+		size -= 4;
+	}
+	for (; size > 0; data++, size--) hash = rotateLeft(hash ^ (*data * XXH_PRIME64_5), 11) * XXH_PRIME64_1;
+
+	hash ^= hash >> 33;
+	hash *= XXH_PRIME64_2;
+	hash ^= hash >> 29;
+	hash *= XXH_PRIME64_3;
+	hash ^= hash >> 32;
+	return hash;
+}
+
+/// <summary>
+/// Computes the XXH64 hash of data
+/// </summary>
+unsigned long long XXH64(const void* data, size_t size, unsigned long long seed)
+{
+	XXH64State state;
+	xxh64Reset(state, seed);
+	xxh64Update(state, (const unsigned char*)data, size);
+	return xxh64Digest(state, seed);
+}
+
+/*
+* ===================
+* IMAGE HASHER
+* ===================
+*/
+ImageHasher::ImageHasher(const vector<HashAlgorithm>& algorithms) : algorithms(algorithms)
+{
+	blake2bContext = nullptr;
+	if (find(algorithms.begin(), algorithms.end(), HASH_BLAKE2B) != algorithms.end()) blake2bContext = EVP_MD_CTX_new();
+	reset();
+}
+
+ImageHasher::~ImageHasher()
+{
+	if (blake2bContext != nullptr) EVP_MD_CTX_free((EVP_MD_CTX*)blake2bContext);
+}
+
+/// <summary>Starts a new image</summary>
+void ImageHasher::reset()
+{
+	for (HashAlgorithm algorithm : algorithms)
+	{
+		if (algorithm == HASH_MD5) MD5_Init(&md5Context);
+		else if (algorithm == HASH_XXH64) xxh64Reset(xxh64State, 0);
+		else if (algorithm == HASH_BLAKE2B) EVP_DigestInit_ex((EVP_MD_CTX*)blake2bContext, EVP_blake2b512(), nullptr);
+	}
+}
+
+/// <summary>Adds the next bytes of the image to every algorithm</summary>
+void ImageHasher::update(const void* data, size_t size)
+{
+	for (HashAlgorithm algorithm : algorithms)
+	{
+		if (algorithm == HASH_MD5) MD5_Update(&md5Context, data, size);
+		else if (algorithm == HASH_XXH64) xxh64Update(xxh64State, (const unsigned char*)data, size);
+		else if (algorithm == HASH_BLAKE2B) EVP_DigestUpdate((EVP_MD_CTX*)blake2bContext, data, size);
+	}
+}
+
+/// <summary>Returns the digests of the image, in the order of the algorithms. XXH64 is big-endian, like its canonical form.</summary>
+vector<ImageDigest> ImageHasher::finish()
+{
+	vector<ImageDigest> digests;
+	for (HashAlgorithm algorithm : algorithms)
+	{
+		ImageDigest digest;
+		digest.algorithm = algorithm;
+		if (algorithm == HASH_MD5)
+		{
+			digest.bytes.resize(MD5_DIGEST_LENGTH);
+			MD5_Final(digest.bytes.data(), &md5Context);
+		}
+		else if (algorithm == HASH_XXH64)
+		{
+			unsigned long long hash = xxh64Digest(xxh64State, 0);
+			for (int shift = 56; shift >= 0; shift -= 8) digest.bytes.push_back((unsigned char)(hash >> shift));
+		}
+		else if (algorithm == HASH_BLAKE2B)
+		{
+			unsigned int digestSize = EVP_MAX_MD_SIZE;
+			digest.bytes.resize(EVP_MAX_MD_SIZE);
+			EVP_DigestFinal_ex((EVP_MD_CTX*)blake2bContext, digest.bytes.data(), &digestSize);
+			digest.bytes.resize(digestSize);
+		}
+		digests.push_back(digest);
+	}
+	return digests;
+}
+
+/*
+* ===================
+* NAMES
+* ===================
+*/
+const char* getHashName(HashAlgorithm algorithm)
+{
+	switch (algorithm)
+	{
+	case HASH_MD5: return "MD5";
+	case HASH_XXH64: return "XXH64";
+	case HASH_BLAKE2B: return "BLAKE2B";
+	}
+	return "";
+}
+
+/// <summary>Returns every byte of a digest as two upper-case hex digits</summary>
+string formatDigest(const ImageDigest& digest)
+{
+	char hexByte[4];
+	string output;
+	for (unsigned char hashByte : digest.bytes)
+	{
+		snprintf(hexByte, sizeof(hexByte), "%02X", hashByte);
+		output += hexByte;
+	}
+	return output;
+}
+
+/// <summary>
+/// Parses a comma separated list of algorithm names (case-insensitive), e.g. "md5,xxh64"
+/// </summary>
+/// <param name="names">The algorithm names</param>
+/// <param name="algorithms">Outputs the algorithms</param>
+/// <returns>true on success, false if a name is unknown or the list is empty</returns>  
+bool parseHashAlgorithms(const string& names, vector<HashAlgorithm>& algorithms)
+{
+	const HashAlgorithm knownAlgorithms[] = { HASH_MD5, HASH_XXH64, HASH_BLAKE2B };
+	stringstream nameList(names);
+	string name;
+
+	algorithms.clear();
+	while (getline(nameList, name, ','))
+	{
+		transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return (char)toupper(c); });
+
+		bool known = false;
+		for (HashAlgorithm algorithm : knownAlgorithms)
+		{
+			if (name != getHashName(algorithm)) continue;
+			if (find(algorithms.begin(), algorithms.end(), algorithm) == algorithms.end()) algorithms.push_back(algorithm);
+			known = true;
+		}
+		if (!known) return 0;
+	}
+	return !algorithms.empty();
+}
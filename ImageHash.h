@@ -0,0 +1,71 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <openssl/md5.h>
+
+using namespace std;
+
+/// <summary>The hash algorithms an image can be hashed with</summary>
+enum HashAlgorithm
+{
+	HASH_MD5,		//MD5 - the original output, for compatibility
+	HASH_XXH64,		//XXH64 - fast non-cryptographic hash
+	HASH_BLAKE2B	//BLAKE2b-512 - fast cryptographic hash
+};
+
+/// <summary>A hash of an image</summary>
+struct ImageDigest
+{
+	HashAlgorithm algorithm;		//The algorithm the digest was computed with
+	vector<unsigned char> bytes;	//The digest, in the algorithm's canonical byte order
+};
+
+/// <summary>The state of an XXH64 hash computed in pieces</summary>
+struct XXH64State
+{
+	unsigned long long totalLength;		//Number of bytes hashed
+	unsigned long long accumulators[4];	//The four lanes
+	unsigned char pending[32];			//Bytes not yet consumed by a full stripe
+	unsigned int pendingSize;			//Number of bytes in pending
+};
+
+/// <summary>
+/// Hashes an image with one or more algorithms at once. The image can be hashed in pieces with update.
+/// </summary>
+class ImageHasher
+{
+public:
+	explicit ImageHasher(const vector<HashAlgorithm>& algorithms = vector<HashAlgorithm>{ HASH_MD5 });
+	~ImageHasher();
+	ImageHasher(const ImageHasher&) = delete;
+	ImageHasher& operator=(const ImageHasher&) = delete;
+
+	void reset();									//Starts a new image
+	void update(const void* data, size_t size);		//Adds the next bytes of the image
+	vector<ImageDigest> finish();					//The digests of the image, in the order of the algorithms
+
+private:
+	vector<HashAlgorithm> algorithms;	//The algorithms to compute
+	MD5_CTX md5Context;					//State of HASH_MD5
+	XXH64State xxh64State;				//State of HASH_XXH64
+	void* blake2bContext;				//State of HASH_BLAKE2B (an OpenSSL EVP_MD_CTX)
+};
+
+/// <summary>Returns the name of an algorithm as it is printed and parsed: MD5, XXH64, BLAKE2B</summary>
+const char* getHashName(HashAlgorithm algorithm);
+
+/// <summary>Returns every byte of a digest as two upper-case hex digits</summary>
+string formatDigest(const ImageDigest& digest);
+
+/// <summary>
+/// Parses a comma separated list of algorithm names (case-insensitive), e.g. "md5,xxh64"
+/// </summary>
+/// <param name="names">The algorithm names</param>
+/// <param name="algorithms">Outputs the algorithms</param>
+/// <returns>true on success, false if a name is unknown or the list is empty</returns>  
+bool parseHashAlgorithms(const string& names, vector<HashAlgorithm>& algorithms);
+
+/// <summary>
+/// Computes the XXH64 hash of data
+/// </summary>
+unsigned long long XXH64(const void* data, size_t size, unsigned long long seed = 0);
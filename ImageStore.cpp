@@ -0,0 +1,135 @@
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <random>
+#include "FileIO.h"
+#include "ImageStore.h"
+
+ImageStore::ImageStore() : tempCounter(0)
+{
+	opened = false;
+}
+
+ImageStore::~ImageStore()
+{
+	close();
+}
+
+/// <summary>
+/// Opens the store at storeDir, creating it if it does not exist. Any previous store is closed first.
+/// The temporary files are written inside the store so they can be renamed into it, under a directory unique to this process
+/// so several processes can share one store.
+/// </summary>
+/// <param name="storeDir">The store directory</param>
+/// <returns>true on success, false on failed</returns>  
+bool ImageStore::open(const string& storeDir)
+{
+	error_code error;
+	random_device randomDevice;
+	unsigned long long uniqueId = ((unsigned long long)randomDevice() << 32) ^ randomDevice() ^ (unsigned long long)chrono::steady_clock::now().time_since_epoch().count();
+
+	close();
+	this->storeDir = storeDir;
+	if (!this->storeDir.empty() && this->storeDir.back() != '/' && this->storeDir.back() != '\\') this->storeDir += "/";
+	tempDir = this->storeDir + "tmp/" + to_string(uniqueId) + "/";
+
+	filesystem::create_directories(this->storeDir + "objects", error);
+	if (error) return 0;
+	filesystem::create_directories(tempDir, error);
+	if (error) return 0;
+
+	indexFile.open(this->storeDir + "index.txt", ios::out | ios::app | ios::binary);
+	if (!indexFile.is_open()) return 0;
+
+	opened = true;
+	return 1;
+}
+
+/// <summary>Flushes the index and removes the temporary files of this process.</summary>
+void ImageStore::close()
+{
+	error_code error;
+	if (indexFile.is_open()) indexFile.close();
+	if (!tempDir.empty()) filesystem::remove_all(tempDir, error);
+	tempDir.clear();
+	claimedObjects.clear();
+	opened = false;
+}
+
+bool ImageStore::isOpen() const
+{
+	return opened;
+}
+
+string ImageStore::getObjectPath(const ImageDigest& digest) const
+{
+	return storeDir + "objects/" + formatDigest(digest) + ".jpeg";
+}
+
+string ImageStore::getTempPath()
+{
+	return tempDir + "part-" + to_string(tempCounter++) + ".jpeg";
+}
+
+string ImageStore::getTempDir() const
+{
+	return tempDir;
+}
+
+/// <summary>
+/// Claims the jpeg with this hash. The hashes of this process are remembered, so only the first jpeg of each hash checks the file system.
+/// An object stored by an earlier run or another process is found by its file.
+/// </summary>
+/// <param name="digest">The hash of the jpeg</param>
+/// <returns>true if the caller must store the jpeg, false if it is already stored or being stored</returns>  
+bool ImageStore::claim(const ImageDigest& digest)
+{
+	error_code error;
+	string hash = formatDigest(digest);
+	lock_guard<mutex> lock(storeMutex);
+
+	if (!claimedObjects.insert(hash).second) return 0;
+	return !filesystem::exists(getObjectPath(digest), error);
+}
+
+void ImageStore::release(const ImageDigest& digest)
+{
+	lock_guard<mutex> lock(storeMutex);
+	claimedObjects.erase(formatDigest(digest));
+}
+
+/// <summary>Moves a claimed jpeg from tempPath to its object path. The rename makes the object appear complete or not at all.</summary>
+/// <param name="tempPath">The written jpeg</param>
+/// <param name="digest">The hash of the jpeg</param>
+/// <returns>true on success, false on failed (the claim is released)</returns>  
+bool ImageStore::commit(const string& tempPath, const ImageDigest& digest)
+{
+	if (replaceFile(tempPath, getObjectPath(digest))) return 1;
+	release(digest);
+	return 0;
+}
+
+/// <summary>
+/// Stores a finished jpeg that was written to tempPath. The file is moved into the store if its hash is new and removed otherwise.
+/// </summary>
+/// <param name="tempPath">The written jpeg</param>
+/// <param name="digest">The hash of the jpeg</param>
+/// <returns>true on success, false on failed</returns>  
+bool ImageStore::storeFile(const string& tempPath, const ImageDigest& digest)
+{
+	if (claim(digest)) return commit(tempPath, digest);
+	remove(tempPath.c_str());
+	return 1;
+}
+
+/// <summary>Adds the jpeg at offset of an input file to the index.</summary>
+/// <param name="inputPath">The filepath of the image the jpeg was extracted from</param>
+/// <param name="offset">The position of the jpeg in the image</param>
+/// <param name="size">The size of the jpeg in the image</param>
+/// <param name="digest">The hash the jpeg is stored under</param>
+void ImageStore::addIndexEntry(const string& inputPath, long long offset, long long size, const ImageDigest& digest)
+{
+	string line = inputPath + "\t" + to_string(offset) + "\t" + to_string(size) + "\t" + getHashName(digest.algorithm) + "\t" + formatDigest(digest) + "\n";
+	lock_guard<mutex> lock(storeMutex);
+	indexFile << line;
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include "ImageHash.h"
+
+using namespace std;
+
+/// <summary>
+/// A content-addressed store of repaired jpegs, shared by every image (and every batch job) that is extracted into it.
+/// Each distinct jpeg is saved once as <storeDir>/objects/<hash>.jpeg, named by the full hex of its first hash. The hex lengths of
+/// the algorithms differ, so stores filled with different algorithms never mix up their objects. A jpeg that is already stored is not written again.
+/// <storeDir>/index.txt gets one line per extracted jpeg: <input path> TAB <offset> TAB <size> TAB <algorithm> TAB <hash>.
+/// All methods are safe to call from several threads.
+/// </summary>
+class ImageStore
+{
+public:
+	ImageStore();
+	~ImageStore();
+	ImageStore(const ImageStore&) = delete;
+	ImageStore& operator=(const ImageStore&) = delete;
+
+	/// <summary>Opens the store at storeDir, creating it if it does not exist. Any previous store is closed first.</summary>
+	/// <returns>true on success, false on failed</returns>  
+	bool open(const string& storeDir);
+
+	/// <summary>Flushes the index and removes the temporary files of this process.</summary>
+	void close();
+
+	bool isOpen() const;							//true if a store is open
+	string getObjectPath(const ImageDigest& digest) const;	//The filepath of the jpeg with this hash
+	string getTempPath();							//A new unique filepath to write a jpeg to before it is stored
+	string getTempDir() const;						//The directory of the temporary files of this process, ending in a separator
+
+	/// <summary>
+	/// Claims the jpeg with this hash. Only one caller gets to write each jpeg: true means it is not stored yet and the caller
+	/// must store it (commit) or give it back (release); false means it is already stored or being stored.
+	/// </summary>
+	bool claim(const ImageDigest& digest);
+
+	/// <summary>Gives back a claim whose jpeg could not be written.</summary>
+	void release(const ImageDigest& digest);
+
+	/// <summary>Moves a claimed jpeg from tempPath to its object path.</summary>
+	/// <returns>true on success, false on failed (the claim is released)</returns>  
+	bool commit(const string& tempPath, const ImageDigest& digest);
+
+	/// <summary>
+	/// Stores a finished jpeg that was written to tempPath. The file is moved into the store if its hash is new and removed otherwise.
+	/// </summary>
+	/// <returns>true on success, false on failed</returns>  
+	bool storeFile(const string& tempPath, const ImageDigest& digest);
+
+	/// <summary>Adds the jpeg at offset of an input file to the index.</summary>
+	void addIndexEntry(const string& inputPath, long long offset, long long size, const ImageDigest& digest);
+
+private:
+	string storeDir;						//The store directory, ending in a separator
+	string tempDir;							//The temporary files of this process, ending in a separator
+	unordered_set<string> claimedObjects;	//The hashes stored or being stored by this process
+	ofstream indexFile;						//The index, opened for appending
+	mutex storeMutex;						//Guards claimedObjects and indexFile
+	atomic<unsigned long long> tempCounter;	//Numbers the temporary files
+	bool opened;							//true if open succeeded
+};
@@ -0,0 +1,202 @@
+#include <algorithm>
+#include <cstring>
+#include "JPEGMarkers.h"
+
+using namespace std;
+
+/*
+* ===================
+* MARKER CODES
+* ===================
+*/
+const unsigned char MARKER_PREFIX = 0xFF;		//Every marker starts with FF. More FF bytes before a marker are fill bytes
+const unsigned char MARKER_STUFFED = 0x00;		//FF 00 is a data byte FF in entropy-coded data
+const unsigned char MARKER_TEM = 0x01;			//Standalone marker without a length
+const unsigned char MARKER_RST0 = 0xD0;			//RST0 - RST7 are standalone restart markers in entropy-coded data
+const unsigned char MARKER_RST7 = 0xD7;
+const unsigned char MARKER_SOI = 0xD8;			//Start of image
+const unsigned char MARKER_EOI = 0xD9;			//End of image
+const unsigned char MARKER_SOS = 0xDA;			//Start of scan. Its segment is followed by entropy-coded data
+
+/*
+* ===================
+* HELPER FUNCTIONS
+* ===================
+*/
+
+/// <summary>
+/// Checks if a marker code is followed by a 2 byte segment length: SOFn, DHT, DAC, JPG (C0 - CF), DQT, DNL, DRI, DHP, EXP (DB - DF), APPn (E0 - EF), COM (FE)
+/// </summary>
+static bool hasSegmentLength(unsigned char code)
+{
+	return (code >= 0xC0 && code <= 0xCF) || (code >= 0xDA && code <= 0xDF) || (code >= 0xE0 && code <= 0xEF) || code == 0xFE;
+}
+
+/// <summary>
+/// Checks if a marker code starts a frame (SOF0 - SOF15). C4 (DHT), C8 (JPG) and CC (DAC) share the range but are not frames.
+/// </summary>
+static bool isStartOfFrame(unsigned char code)
+{
+	return code >= 0xC0 && code <= 0xCF && code != 0xC4 && code != 0xC8 && code != 0xCC;
+}
+
+/*
+* ===================
+* MARKER WALKER
+* ===================
+*/
+
+/// <summary>
+/// Starts a jpeg
+/// </summary>
+/// <param name="markerPos">Position of the code of the first marker after SOI. Its FF byte is not checked, since it is part of the repaired start bytes</param>
+void JPEGMarkerWalker::reset(long long markerPos)
+{
+	pos = markerPos;
+	state = WALK_CODE;
+	result = JPEG_WALKING;
+	segmentCode = 0;
+	segmentRemaining = 0;
+	seenFrame = false;
+	seenScan = false;
+	endPos = -1;
+}
+
+/// <summary>
+/// Walks the next bytes of the jpeg. Segments with a length field are skipped by their length and only the entropy-coded data
+/// after SOS is scanned, skipping stuffed bytes (FF 00), fill bytes and RSTn markers. Once the walker decides it stays decided.
+/// </summary>
+/// <param name="data">The image data, starting at dataPos</param>
+/// <param name="dataPos">The position of data in the image. At most the position of the next byte to walk (see getPosition)</param>
+/// <param name="dataEnd">The position the walk stops at. Bytes before it are in data</param>
+/// <returns>JPEG_END once the EOI marker is found, JPEG_BROKEN once the jpeg is not well-formed, JPEG_WALKING if it needs more bytes</returns>  
+JPEGWalkResult JPEGMarkerWalker::walk(const unsigned char* data, long long dataPos, long long dataEnd)
+{
+	while (result == JPEG_WALKING && pos < dataEnd)
+	{
+		if (state == WALK_SEGMENT)
+		{
+			long long skipped = min(segmentRemaining, dataEnd - pos);
+			pos += skipped;
+			segmentRemaining -= skipped;
+			if (segmentRemaining == 0) endSegment();
+			continue;
+		}
+		if (state == WALK_ENTROPY)
+		{
+			//The scan's entropy-coded data runs up to the next real marker.
+			const unsigned char* prefix = (const unsigned char*)memchr(data + (pos - dataPos), MARKER_PREFIX, (size_t)(dataEnd - pos));
+			if (prefix == nullptr) pos = dataEnd;
+			else
+			{
+				pos = dataPos + (prefix - data) + 1;
+				state = WALK_ENTROPY_PREFIX;
+			}
+			continue;
+		}
+
+		unsigned char byte = data[pos - dataPos];
+		pos++;
+		if (state == WALK_CODE) walkCode(byte);
+		else if (state == WALK_LENGTH_HIGH)
+		{
+			segmentRemaining = (long long)byte << 8;
+			state = WALK_LENGTH_LOW;
+		}
+		else if (state == WALK_LENGTH_LOW)
+		{
+			segmentRemaining |= byte;
+			if (segmentRemaining < 2) result = JPEG_BROKEN;
+			else
+			{
+				segmentRemaining -= 2;
+				state = WALK_SEGMENT;
+				if (segmentRemaining == 0) endSegment();
+			}
+		}
+		else if (state == WALK_PREFIX)
+		{
+			if (byte != MARKER_PREFIX) result = JPEG_BROKEN;
+			else state = WALK_FILL;
+		}
+		else if (state == WALK_FILL)
+		{
+			//The next marker: FF, any number of fill bytes and then the code.
+			if (byte != MARKER_PREFIX) walkCode(byte);
+		}
+		else if (state == WALK_ENTROPY_PREFIX)
+		{
+			//Stuffed bytes and RSTn markers are part of the data. Another FF is a fill byte and the prefix of the marker.
+			if (byte == MARKER_STUFFED || (byte >= MARKER_RST0 && byte <= MARKER_RST7)) state = WALK_ENTROPY;
+			else if (byte != MARKER_PREFIX) walkCode(byte);
+		}
+	}
+	return result;
+}
+
+long long JPEGMarkerWalker::getPosition() const
+{
+	return pos;
+}
+
+long long JPEGMarkerWalker::getEndPos() const
+{
+	return endPos;
+}
+
+/// <summary>
+/// Processes a marker code. A jpeg is only accepted if it has a frame and a scan before EOI, so data that only happens to look like
+/// a marker at the start is rejected and the caller can fall back to searching for FF D9.
+/// </summary>
+/// <param name="code">The code, the byte before pos</param>
+void JPEGMarkerWalker::walkCode(unsigned char code)
+{
+	if (code == MARKER_EOI)
+	{
+		result = seenScan ? JPEG_END : JPEG_BROKEN;
+		endPos = pos - 2;
+	}
+	else if (code == MARKER_STUFFED || code == MARKER_SOI || code == MARKER_PREFIX) result = JPEG_BROKEN;
+	else if (code == MARKER_TEM || (code >= MARKER_RST0 && code <= MARKER_RST7)) state = WALK_PREFIX;
+	else if (!hasSegmentLength(code)) result = JPEG_BROKEN;
+	else
+	{
+		segmentCode = code;
+		seenFrame = seenFrame || isStartOfFrame(code);
+		state = WALK_LENGTH_HIGH;
+	}
+}
+
+/// <summary>
+/// Moves on after the last byte of a segment: a scan continues with its entropy-coded data, any other segment with the next marker.
+/// </summary>
+void JPEGMarkerWalker::endSegment()
+{
+	if (segmentCode != MARKER_SOS) state = WALK_PREFIX;
+	else if (!seenFrame) result = JPEG_BROKEN;
+	else
+	{
+		seenScan = true;
+		state = WALK_ENTROPY;
+	}
+}
+
+/*
+* ===================
+* MAIN FUNCTIONS
+* ===================
+*/
+
+/// <summary>
+/// Finds the end of a jpeg by walking its marker segments (see JPEGMarkerWalker) over the whole data.
+/// </summary>
+/// <param name="data">The image data</param>
+/// <param name="length">The number of bytes in data</param>
+/// <param name="markerPos">Position of the code of the first marker after SOI. Its FF byte is not checked, since it is part of the repaired start bytes</param>
+/// <returns>The position of the FF of the EOI marker, -1 if the data is not a well-formed jpeg</returns>  
+long long findJPEGEnd(const unsigned char* data, long long length, long long markerPos)
+{
+	JPEGMarkerWalker walker;
+	walker.reset(markerPos);
+	return walker.walk(data, 0, length) == JPEG_END ? walker.getEndPos() : -1;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+/// <summary>The state of a JPEGMarkerWalker</summary>
+enum JPEGWalkResult
+{
+	JPEG_WALKING,	//Not decided yet, the walker needs the next bytes
+	JPEG_END,		//The EOI marker was found (see getEndPos)
+	JPEG_BROKEN		//The jpeg is not well-formed
+};
+
+/// <summary>
+/// Walks the marker segments of a jpeg like findJPEGEnd, on bytes that arrive in pieces (e.g. from a stream). A walk can stop at any byte,
+/// even inside a segment length or between FF and its code, and continue with the next bytes. A jpeg whose data ends while the walker 
+/// is still JPEG_WALKING is not well-formed.
+/// </summary>
+class JPEGMarkerWalker
+{
+public:
+	void reset(long long markerPos);		//Starts a jpeg whose first marker code (after SOI) is at markerPos
+	JPEGWalkResult walk(const unsigned char* data, long long dataPos, long long dataEnd);	//Walks the bytes up to dataEnd. data starts at position dataPos
+	long long getPosition() const;			//The position of the next byte to walk
+	long long getEndPos() const;			//JPEG_END: the position of the FF of the EOI marker
+
+private:
+	void walkCode(unsigned char code);		//Processes the marker code before pos
+	void endSegment();						//Moves on after the last byte of a segment
+
+	enum WalkState
+	{
+		WALK_CODE,				//The next byte is a marker code
+		WALK_LENGTH_HIGH,		//The next byte is the high byte of a segment length
+		WALK_LENGTH_LOW,		//The next byte is the low byte of a segment length
+		WALK_SEGMENT,			//Inside a segment, segmentRemaining bytes are left
+		WALK_PREFIX,			//The next byte is the FF of a marker
+		WALK_FILL,				//After the FF of a marker: fill bytes, then the code
+		WALK_ENTROPY,			//Inside entropy-coded data
+		WALK_ENTROPY_PREFIX		//Inside entropy-coded data, after an FF
+	};
+
+	long long pos;					//The position of the next byte to walk
+	WalkState state;				//What the next byte is
+	JPEGWalkResult result;			//The decision, JPEG_WALKING until there is one
+	unsigned char segmentCode;		//The marker code of the current segment
+	long long segmentRemaining;		//The bytes of the current segment that are left
+	bool seenFrame;					//true after an SOFn segment
+	bool seenScan;					//true after an SOS segment
+	long long endPos;				//The position of the FF of the EOI marker
+};
+
+/// <summary>
+/// Finds the end of a jpeg by walking its marker segments instead of searching for the first FF D9. Segments with a length field
+/// (APPn, DQT, DHT, SOFn, COM, ...) are skipped by their length, so an FF D9 in metadata (e.g. an EXIF thumbnail) is never mistaken for the end.
+/// Only the entropy-coded data after SOS is scanned, skipping stuffed bytes (FF 00), fill bytes and RSTn markers.
+/// </summary>
+/// <param name="data">The image data</param>
+/// <param name="length">The number of bytes in data</param>
+/// <param name="markerPos">Position of the code of the first marker after SOI. Its FF byte is not checked, since it is part of the repaired start bytes</param>
+/// <returns>The position of the FF of the EOI marker, -1 if the data is not a well-formed jpeg</returns>  
+long long findJPEGEnd(const unsigned char* data, long long length, long long markerPos);
@@ -0,0 +1,299 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include "KDBWriter.h"
+#include "Crypt.h"
+#include "FileIO.h"
+
+/*
+ * ===================
+ * CONSTANTS
+ * ==================
+*/
+const int MAX_BLOCK_SIZE = 0x7FFF;		//Largest block size (__int16)
+const int HEAD_SIZE = 10;				//"CT2018" + entry list pointer
+const int ENTRY_SIZE = 20;				//16 byte name + block list pointer
+const int BLOCK_SIZE = 6;				//Block size + data pointer
+const int ENDSTRING_SIZE = 4;			//Length of ENDSTRING
+
+/// <summary>
+/// RUNS THE COMPACT TOOL - Rewrites a KDB file with contiguous blocks. Arguments: in.kdb out.kdb [merge]
+/// </summary>
+/// <param name="argc">The number of arguments</param>
+/// <param name="argv">The arguments</param>
+/// <returns>0 on success, 1 on failed</returns>
+int CompactKDBMain(int argc, char* argv[])
+{
+	if (argc < 2)
+	{
+		cout << "Usage: compact <in.kdb> <out.kdb> [merge]\n";
+		return 1;
+	}
+
+	bool mergeBlocks = (argc > 2 && strcmp(argv[2], "merge") == 0);
+	if (!CompactKDB(argv[0], argv[1], mergeBlocks))
+	{
+		cout << "Compacting KDB File Failed\n";
+		return 1;
+	}
+	return 0;
+}
+
+/*
+* ===================
+* HELPER FUNCTIONS
+* ===================
+*/
+
+/// <summary>
+/// Appends a little-endian value of size bytes to the output
+/// </summary>
+static void appendValue(vector<char>& output, long long value, int size)
+{
+	for (int byteIndex = 0; byteIndex < size; byteIndex++) output.push_back((char)((value >> (8 * byteIndex)) & 0xFF));
+}
+
+/// <summary>
+/// Writes a little-endian value of size bytes at position in the output
+/// </summary>
+static void patchValue(vector<char>& output, size_t position, long long value, int size)
+{
+	for (int byteIndex = 0; byteIndex < size; byteIndex++) output[position + byteIndex] = (char)((value >> (8 * byteIndex)) & 0xFF);
+}
+
+/// <summary>
+/// Writes the built KDB file to pathName
+/// </summary>
+static bool writeOutput(const string& pathName, const vector<char>& output)
+{
+	ofstream kdbFile(pathName, ios::out | ios::binary | ios::trunc);
+	if (!kdbFile.is_open()) return 0;
+	kdbFile.write(output.data(), output.size());
+	kdbFile.close();
+	return !kdbFile.fail();
+}
+
+/*
+* ===================
+* KDB WRITER
+* ===================
+*/
+
+/// <summary>Adds an entry split into as few blocks as possible (blocks of up to MAX_BLOCK_SIZE bytes).</summary>
+/// <param name="name">The entry name, at most 16 characters</param>
+/// <param name="data">The plain data</param>
+/// <param name="dataSize">The size of data in bytes</param>
+/// <returns>true on success, false if the entry does not fit in a KDB file</returns>  
+bool KDBWriter::addEntry(const string& name, const unsigned char* data, int dataSize)
+{
+	vector<int> blockSizes;
+	for (int remaining = dataSize; remaining > 0; remaining -= MAX_BLOCK_SIZE)
+	{
+		blockSizes.push_back(remaining < MAX_BLOCK_SIZE ? remaining : MAX_BLOCK_SIZE);
+	}
+	return addEntry(name, data, blockSizes);
+}
+
+/// <summary>Adds an entry split into blocks of the given sizes.</summary>
+/// <param name="name">The entry name, at most 16 characters</param>
+/// <param name="data">The plain data</param>
+/// <param name="blockSizes">The size of every block. They add up to the size of data</param>
+/// <returns>true on success, false if the entry does not fit in a KDB file</returns>  
+bool KDBWriter::addEntry(const string& name, const unsigned char* data, const vector<int>& blockSizes)
+{
+	long long dataSize = 0;
+	if (entries.size() >= (size_t)MAX_ENTRIES || name.size() > 16 || blockSizes.size() > (size_t)MAX_BLOCKS) return 0;
+	for (int blockSize : blockSizes)
+	{
+		if (blockSize < 0 || blockSize > MAX_BLOCK_SIZE) return 0;
+		dataSize += blockSize;
+	}
+
+	//A name starting with ENDSTRING would end the entry list early.
+	if (name.size() >= 4 && memcmp(name.data(), ENDSTRING, 4) == 0) return 0;
+
+	PendingEntry entry;
+	memset(entry.name, 0, sizeof(entry.name));
+	memcpy(entry.name, name.data(), name.size());
+	entry.data.assign(data, data + dataSize);
+	entry.blockSizes = blockSizes;
+	entries.push_back(move(entry));
+	return 1;
+}
+
+/// <summary>Writes the KDB file.</summary>
+/// <param name="pathName">The file path</param>
+/// <returns>true on success, false on failed</returns>  
+bool KDBWriter::write(const string& pathName) const
+{
+	vector<char> output;
+	size_t entryListPos = HEAD_SIZE;
+
+	//KDB HEAD followed by the ENTRY LIST. Block list pointers are filled in once the block lists are placed.
+	output.insert(output.end(), "CT2018", "CT2018" + 6);
+	appendValue(output, (long long)entryListPos, 4);
+	for (const PendingEntry& entry : entries)
+	{
+		output.insert(output.end(), entry.name, entry.name + sizeof(entry.name));
+		appendValue(output, 0, 4);
+	}
+	output.insert(output.end(), ENDSTRING, ENDSTRING + ENDSTRING_SIZE);
+
+	//For every entry: its BLOCK LIST and then its encrypted DATA, block after block.
+	for (size_t entryIndex = 0; entryIndex < entries.size(); entryIndex++)
+	{
+		const PendingEntry& entry = entries[entryIndex];
+		size_t blockListPos = output.size();
+		size_t dataPos = blockListPos + entry.blockSizes.size() * BLOCK_SIZE + ENDSTRING_SIZE;
+		if (dataPos + entry.data.size() > 0x7FFFFFFF) return 0;		//Pointers are 32 bit
+
+		patchValue(output, entryListPos + entryIndex * ENTRY_SIZE + 16, (long long)blockListPos, 4);
+		for (int blockSize : entry.blockSizes)
+		{
+			appendValue(output, blockSize, 2);
+			appendValue(output, (long long)dataPos, 4);
+			dataPos += blockSize;
+		}
+		output.insert(output.end(), ENDSTRING, ENDSTRING + ENDSTRING_SIZE);
+
+		size_t dataStart = output.size();
+		output.insert(output.end(), entry.data.begin(), entry.data.end());
+		CryptInPlace((unsigned char*)output.data() + dataStart, (int)entry.data.size(), LSFR_INIT_VALUE);
+	}
+
+	return writeOutput(pathName, output);
+}
+
+/// <summary>
+/// Writes the KDB file with every block list first and the data blocks shuffled after them.
+/// Each entry is still encrypted as one stream, so only the positions of its blocks change.
+/// </summary>
+/// <param name="pathName">The file path</param>
+/// <param name="fragmentation">The probability that a block is moved, from 0 (sequential) to 1</param>
+/// <param name="seed">The seed of the block shuffle</param>
+/// <returns>true on success, false on failed</returns>
+bool KDBWriter::writeFragmented(const string& pathName, double fragmentation, unsigned int seed) const
+{
+	vector<char> output;
+	vector<pair<size_t, size_t>> blocks;					//Entry and block index of every data block, in file order
+	vector<vector<size_t>> blockStarts(entries.size());		//The position of every block in its entry's data
+	vector<vector<size_t>> blockPositions(entries.size());	//The position of every block in the file
+	size_t entryListPos = HEAD_SIZE;
+	size_t dataPos;
+	mt19937 random(seed);
+	uniform_real_distribution<double> chance(0.0, 1.0);
+
+	//KDB HEAD followed by the ENTRY LIST, like write.
+	output.insert(output.end(), "CT2018", "CT2018" + 6);
+	appendValue(output, (long long)entryListPos, 4);
+	for (const PendingEntry& entry : entries)
+	{
+		output.insert(output.end(), entry.name, entry.name + sizeof(entry.name));
+		appendValue(output, 0, 4);
+	}
+	output.insert(output.end(), ENDSTRING, ENDSTRING + ENDSTRING_SIZE);
+
+	//The data starts after every BLOCK LIST.
+	dataPos = output.size();
+	for (size_t entryIndex = 0; entryIndex < entries.size(); entryIndex++)
+	{
+		size_t blockStart = 0;
+		dataPos += entries[entryIndex].blockSizes.size() * BLOCK_SIZE + ENDSTRING_SIZE;
+		for (size_t blockIndex = 0; blockIndex < entries[entryIndex].blockSizes.size(); blockIndex++)
+		{
+			blocks.push_back({ entryIndex, blockIndex });
+			blockStarts[entryIndex].push_back(blockStart);
+			blockStart += entries[entryIndex].blockSizes[blockIndex];
+		}
+		blockPositions[entryIndex].resize(entries[entryIndex].blockSizes.size());
+	}
+
+	for (size_t blockIndex = 0; blockIndex < blocks.size(); blockIndex++)
+	{
+		if (chance(random) < fragmentation) swap(blocks[blockIndex], blocks[uniform_int_distribution<size_t>(0, blocks.size() - 1)(random)]);
+	}
+	for (const pair<size_t, size_t>& block : blocks)
+	{
+		blockPositions[block.first][block.second] = dataPos;
+		dataPos += entries[block.first].blockSizes[block.second];
+	}
+	if (dataPos > 0x7FFFFFFF) return 0;		//Pointers are 32 bit
+
+	//The BLOCK LISTS
+	for (size_t entryIndex = 0; entryIndex < entries.size(); entryIndex++)
+	{
+		patchValue(output, entryListPos + entryIndex * ENTRY_SIZE + 16, (long long)output.size(), 4);
+		for (size_t blockIndex = 0; blockIndex < entries[entryIndex].blockSizes.size(); blockIndex++)
+		{
+			appendValue(output, entries[entryIndex].blockSizes[blockIndex], 2);
+			appendValue(output, (long long)blockPositions[entryIndex][blockIndex], 4);
+		}
+		output.insert(output.end(), ENDSTRING, ENDSTRING + ENDSTRING_SIZE);
+	}
+
+	//The encrypted DATA, block by block in file order
+	vector<vector<unsigned char>> encrypted(entries.size());
+	for (size_t entryIndex = 0; entryIndex < entries.size(); entryIndex++)
+	{
+		encrypted[entryIndex] = entries[entryIndex].data;
+		CryptInPlace(encrypted[entryIndex].data(), (int)encrypted[entryIndex].size(), LSFR_INIT_VALUE);
+	}
+	for (const pair<size_t, size_t>& block : blocks)
+	{
+		const unsigned char* blockData = encrypted[block.first].data() + blockStarts[block.first][block.second];
+		output.insert(output.end(), blockData, blockData + entries[block.first].blockSizes[block.second]);
+	}
+
+	return writeOutput(pathName, output);
+}
+
+/*
+* ===================
+* MAIN FUNCTIONS
+* ===================
+*/
+
+/// <summary>
+/// Rewrites a KDB file so that each entry's blocks are sequential and next to its block list.
+/// The file is written under a temporary name first, so kdbPath can be compacted in place.
+/// </summary>
+/// <param name="kdbPath">The KDB file to compact</param>
+/// <param name="outPath">The compacted KDB file. May be the same as kdbPath</param>
+/// <param name="mergeBlocks">If true, each entry is rewritten with as few blocks as possible</param>
+/// <returns>true on success, false on failed</returns>  
+bool CompactKDB(const string& kdbPath, const string& outPath, bool mergeBlocks)
+{
+	KDBWriter writer;
+	string tempPath = makeTempPath(outPath);
+
+	{
+		KDBReader kdbReader;
+		if (!kdbReader.open(kdbPath)) return 0;
+
+		for (int entryIndex = 0; entryIndex < kdbReader.getNumEntries(); entryIndex++)
+		{
+			const KDBEntry* entry = kdbReader.getEntry(entryIndex);
+			if (entry == nullptr) return 0;
+
+			bool added;
+			if (mergeBlocks) added = writer.addEntry(kdbReader.getEntryName(entryIndex), entry->decData, entry->dataSize);
+			else
+			{
+				vector<int> blockSizes;
+				for (int blockIndex = 0; blockIndex < entry->numBlocks; blockIndex++) blockSizes.push_back(entry->blocks[blockIndex].size);
+				added = writer.addEntry(kdbReader.getEntryName(entryIndex), entry->decData, blockSizes);
+			}
+			if (!added) return 0;
+		}
+	}
+
+	//The reader is closed here, so the original file is no longer mapped when it is replaced.
+	if (!writer.write(tempPath))
+	{
+		remove(tempPath.c_str());
+		return 0;
+	}
+	return replaceFile(tempPath, outPath);
+}
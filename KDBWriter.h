@@ -0,0 +1,72 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "DecryptKDB.h"
+
+using namespace std;
+
+/// <summary>
+/// RUNS THE COMPACT TOOL - Rewrites a KDB file with contiguous blocks. Arguments: in.kdb out.kdb [merge]
+/// </summary>
+/// <param name="argc">The number of arguments</param>
+/// <param name="argv">The arguments</param>
+/// <returns>0 on success, 1 on failed</returns>
+int CompactKDBMain(int argc, char* argv[]);
+
+/// <summary>
+/// Builds a KDB file from plain entries. Every entry is encrypted with Crypt and the file is laid out sequentially:
+/// the head, the entry list, then for each entry its block list directly followed by its blocks' data.
+/// A reader therefore reads a written file front to back.
+/// </summary>
+class KDBWriter
+{
+public:
+	/// <summary>Adds an entry split into as few blocks as possible (blocks of up to MAX_BLOCK_SIZE bytes).</summary>
+	/// <param name="name">The entry name, at most 16 characters</param>
+	/// <param name="data">The plain data</param>
+	/// <param name="dataSize">The size of data in bytes</param>
+	/// <returns>true on success, false if the entry does not fit in a KDB file</returns>  
+	bool addEntry(const string& name, const unsigned char* data, int dataSize);
+
+	/// <summary>Adds an entry split into blocks of the given sizes.</summary>
+	/// <param name="name">The entry name, at most 16 characters</param>
+	/// <param name="data">The plain data</param>
+	/// <param name="blockSizes">The size of every block. They add up to the size of data</param>
+	/// <returns>true on success, false if the entry does not fit in a KDB file</returns>  
+	bool addEntry(const string& name, const unsigned char* data, const vector<int>& blockSizes);
+
+	/// <summary>Writes the KDB file.</summary>
+	/// <param name="pathName">The file path</param>
+	/// <returns>true on success, false on failed</returns>  
+	bool write(const string& pathName) const;
+
+	/// <summary>
+	/// Writes the KDB file with its blocks out of order, like a file that was edited in place: every block list follows the entry list,
+	/// then the data blocks, where each block is swapped with a random other block (of any entry) with probability fragmentation.
+	/// The same seed always gives the same file. Used to benchmark and test the readers on fragmented files.
+	/// </summary>
+	/// <param name="pathName">The file path</param>
+	/// <param name="fragmentation">The probability that a block is moved, from 0 (sequential) to 1</param>
+	/// <param name="seed">The seed of the block shuffle</param>
+	/// <returns>true on success, false on failed</returns>  
+	bool writeFragmented(const string& pathName, double fragmentation, unsigned int seed) const;
+
+private:
+	/// <summary>A plain entry waiting to be written</summary>
+	struct PendingEntry
+	{
+		char name[16];				//Null padded entry name
+		vector<unsigned char> data;	//The plain data
+		vector<int> blockSizes;		//The size of every block
+	};
+	vector<PendingEntry> entries;	//Entries in entry list order
+};
+
+/// <summary>
+/// Rewrites a KDB file so that each entry's blocks are sequential and next to its block list.
+/// </summary>
+/// <param name="kdbPath">The KDB file to compact</param>
+/// <param name="outPath">The compacted KDB file. May be the same as kdbPath</param>
+/// <param name="mergeBlocks">If true, each entry is rewritten with as few blocks as possible</param>
+/// <returns>true on success, false on failed</returns>  
+bool CompactKDB(const string& kdbPath, const string& outPath, bool mergeBlocks);
@@ -0,0 +1,285 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <vector>
+#include "KeyStreamCache.h"
+#include "Crypt.h"
+#include "FileIO.h"
+#include "ImageHash.h"
+
+/*
+ * ===================
+ * CONSTANTS
+ * ==================
+*/
+const long long MIN_STREAM_LENGTH = 1 << 16;			//The smallest key stream generated. Streams at least double when they grow.
+const long long MAX_STREAM_LENGTH = 8 << 20;			//The longest key stream cached. Covers the largest KDB entry (MAX_BLOCKS blocks of 0x7FFF bytes)
+const int NUM_KEY_SAMPLES = 64;							//Keys of a loaded stream that are re-derived with LSFRJump and compared
+const char CACHE_FILE_MAGIC[8] = { 'K','S','C','A','C','H','E','2' };	//Magic string at the start of a cache file
+const char* CACHE_ENV_VARIABLE = "KDB_KEYSTREAM_CACHE";	//Environment variable holding the cache file path
+
+/// <summary>Head of a cache file. It is followed by numStreams CacheFileStream records and then the keys.</summary>
+struct CacheFileHead
+{
+	char magic[8];					//"KSCACHE2"
+	unsigned long long numStreams;	//Number of key streams in the file
+};
+
+/// <summary>A key stream record in a cache file</summary>
+struct CacheFileStream
+{
+	unsigned long long initialValue;	//The password of the key stream
+	unsigned long long length;			//The number of keys
+	unsigned long long keysPtr;			//Pointer to the keys in the cache file
+	unsigned long long checksum;		//XXH64 of the keys
+};
+
+/*
+* ===================
+* KEY STREAM STORAGE
+* ===================
+*/
+/// <summary>A key stream generated in memory</summary>
+class GeneratedKeyStream : public KeyStream
+{
+public:
+	vector<unsigned char> storage;		//Owns the keys
+};
+
+/// <summary>A key stream that points into a mapped cache file. The mapping is shared by all streams of the file.</summary>
+class MappedKeyStream : public KeyStream
+{
+public:
+	shared_ptr<MappedFile> cacheFile;	//Keeps the mapping alive
+};
+
+/*
+* ===================
+* HELPER FUNCTIONS
+* ===================
+*/
+/// <summary>
+/// Checks the keys of a loaded stream: their checksum, and NUM_KEY_SAMPLES keys spread over the stream re-derived from the initial value
+/// with LSFRJump. A truncated, corrupted or foreign cache is therefore never used.
+/// </summary>
+static bool keysAreValid(unsigned int initialValue, const unsigned char* keys, long long length, unsigned long long checksum)
+{
+	for (int sampleIndex = 0; sampleIndex < NUM_KEY_SAMPLES && length > 0; sampleIndex++)
+	{
+		long long keyPos = (length - 1) * sampleIndex / (NUM_KEY_SAMPLES - 1);
+		unsigned char key = 0;
+		CryptAt(&key, 1, initialValue, keyPos);
+		if (key != keys[keyPos]) return 0;
+	}
+	return XXH64(keys, (size_t)length) == checksum;
+}
+
+/*
+* ===================
+* KEY STREAMS
+* ===================
+*/
+/// <summary>
+/// XORs length bytes of data with the keys of a stream starting at key byteOffset into output. output may equal data.
+/// Cached keys are used where the stream has them; keys past its end are generated from LSFRJump, so any position works.
+/// </summary>
+/// <param name="keyStream">The key stream</param>
+/// <param name="byteOffset">The position of data in the stream</param>
+/// <param name="data">The data to encrypt/decrypt</param>
+/// <param name="output">The encrypted/decrypted data, length characters big</param>
+/// <param name="length">The number of characters</param>
+void cryptWithKeyStream(const KeyStream& keyStream, long long byteOffset, const unsigned char* data, unsigned char* output, int length)
+{
+	int cachedLength = 0;
+	if (byteOffset < keyStream.length) cachedLength = (int)min((long long)length, keyStream.length - byteOffset);
+	if (cachedLength > 0) XORKeyStream(data, keyStream.keys + byteOffset, output, cachedLength);
+	if (cachedLength == length) return;
+
+	CryptContext context(keyStream.initialValue);
+	context.seek(byteOffset + cachedLength);
+	context.update(data + cachedLength, output + cachedLength, length - cachedLength);
+}
+
+/*
+* ===================
+* KEY STREAM CACHE
+* ===================
+*/
+/// <summary>An empty cache without persistence. The tools share the one returned by instance().</summary>
+KeyStreamCache::KeyStreamCache()
+{
+	dirty = false;
+}
+
+/// <summary>Returns the cache shared by the whole process.</summary>
+KeyStreamCache& KeyStreamCache::instance()
+{
+	static KeyStreamCache cache;
+	static once_flag persistenceFlag;
+
+	//Persistence is enabled once per process from the environment.
+	call_once(persistenceFlag, []() {
+		const char* pathName = getenv(CACHE_ENV_VARIABLE);
+		if (pathName != nullptr && pathName[0] != '\0') cache.enablePersistence(pathName);
+	});
+	return cache;
+}
+
+/// <summary>
+/// Returns the key stream for initialValue with at least minLength keys, or the cache limit if that is less. The returned stream stays valid while it is held,
+/// even if the cache grows the stream for another caller.
+/// </summary>
+/// <param name="initialValue">The password of the key stream</param>
+/// <param name="minLength">The smallest number of keys needed</param>
+/// <returns>The shared key stream</returns>  
+shared_ptr<const KeyStream> KeyStreamCache::acquire(unsigned int initialValue, long long minLength)
+{
+	shared_ptr<const KeyStream> current;
+	if (minLength > MAX_STREAM_LENGTH) minLength = MAX_STREAM_LENGTH;
+	{
+		lock_guard<mutex> lock(cacheMutex);
+		current = streams[initialValue];
+		if (current != nullptr && current->length >= minLength) return current;
+	}
+
+	//Grow the stream outside the lock, so workers that only need cached keys are never held up: keep the cached prefix and 
+	//continue the LSFR from where it stopped. Two workers may grow the same stream at once; the longer result is kept.
+	long long oldLength = (current != nullptr) ? current->length : 0;
+	long long newLength = (oldLength * 2 > MIN_STREAM_LENGTH) ? oldLength * 2 : MIN_STREAM_LENGTH;
+	if (newLength < minLength) newLength = minLength;
+	if (newLength > MAX_STREAM_LENGTH) newLength = MAX_STREAM_LENGTH;
+
+	shared_ptr<GeneratedKeyStream> grown = make_shared<GeneratedKeyStream>();
+	grown->storage.assign((size_t)newLength, 0);
+	if (oldLength > 0) memcpy(grown->storage.data(), current->keys, (size_t)oldLength);
+
+	//Encrypting zeros gives the keys themselves.
+	CryptContext context(initialValue);
+	context.seek(oldLength);
+	context.update(grown->storage.data() + oldLength, (int)(newLength - oldLength));
+
+	grown->initialValue = initialValue;
+	grown->keys = grown->storage.data();
+	grown->length = newLength;
+
+	lock_guard<mutex> lock(cacheMutex);
+	shared_ptr<const KeyStream>& cached = streams[initialValue];
+	if (cached != nullptr && cached->length >= newLength) return cached;
+	cached = grown;
+	dirty = true;
+	return cached;
+}
+
+/// <summary>
+/// Loads the cache file at pathName (if it exists) and makes save write the cache back to it.
+/// </summary>
+/// <param name="pathName">The cache file path</param>
+/// <returns>true if an existing cache file was loaded</returns>  
+bool KeyStreamCache::enablePersistence(const string& pathName)
+{
+	lock_guard<mutex> lock(cacheMutex);
+	persistPath = pathName;
+	return load(pathName);
+}
+
+/// <summary>Maps a cache file and adds every valid key stream in it that is longer than the cached one.</summary>
+/// <param name="pathName">The cache file path</param>
+/// <returns>true on success, false on failed</returns>  
+bool KeyStreamCache::load(const string& pathName)
+{
+	shared_ptr<MappedFile> cacheFile = make_shared<MappedFile>();
+	if (!cacheFile->open(pathName) || cacheFile->size() < sizeof(CacheFileHead)) return 0;
+
+	CacheFileHead head;
+	memcpy(&head, cacheFile->data(), sizeof(head));
+	if (memcmp(head.magic, CACHE_FILE_MAGIC, sizeof(head.magic)) != 0) return 0;
+	if (head.numStreams > (cacheFile->size() - sizeof(head)) / sizeof(CacheFileStream)) return 0;
+
+	for (unsigned long long streamIndex = 0; streamIndex < head.numStreams; streamIndex++)
+	{
+		CacheFileStream record;
+		memcpy(&record, cacheFile->data() + sizeof(head) + streamIndex * sizeof(record), sizeof(record));
+
+		//Skip records that point outside of the file, are too long, or whose keys are not the keys of their initial value.
+		if (record.keysPtr > cacheFile->size() || record.length > cacheFile->size() - record.keysPtr) continue;
+		if ((long long)record.length > MAX_STREAM_LENGTH || record.initialValue > 0xFFFFFFFFull) continue;
+		if (!keysAreValid((unsigned int)record.initialValue, cacheFile->data() + record.keysPtr, (long long)record.length, record.checksum)) continue;
+
+		shared_ptr<const KeyStream>& current = streams[(unsigned int)record.initialValue];
+		if (current != nullptr && current->length >= (long long)record.length) continue;
+
+		shared_ptr<MappedKeyStream> mapped = make_shared<MappedKeyStream>();
+		mapped->initialValue = (unsigned int)record.initialValue;
+		mapped->keys = cacheFile->data() + record.keysPtr;
+		mapped->length = (long long)record.length;
+		mapped->cacheFile = cacheFile;
+		current = mapped;
+	}
+	return 1;
+}
+
+/// <summary>
+/// Writes every cached key stream to the persistence file if anything was generated since it was loaded. On failed the cache
+/// keeps every key stream and stays dirty, so a later save can retry.
+/// </summary>
+/// <returns>true on success, false on failed</returns>  
+bool KeyStreamCache::save()
+{
+	lock_guard<mutex> lock(cacheMutex);
+	if (persistPath == "" || !dirty) return 1;
+
+	//Write to a temporary file first so a running process that mapped the old file never sees a partial file.
+	//The name is unique, so processes sharing a cache file never write into the same temporary file.
+	string tempPath = makeTempPath(persistPath);
+	ofstream cacheFile(tempPath, ios::out | ios::binary | ios::trunc);
+	if (!cacheFile.is_open()) return 0;
+
+	CacheFileHead head;
+	memcpy(head.magic, CACHE_FILE_MAGIC, sizeof(head.magic));
+	head.numStreams = streams.size();
+	cacheFile.write((const char*)&head, sizeof(head));
+
+	unsigned long long keysPtr = sizeof(head) + streams.size() * sizeof(CacheFileStream);
+	for (auto& stream : streams)
+	{
+		CacheFileStream record;
+		record.initialValue = stream.first;
+		record.length = (unsigned long long)stream.second->length;
+		record.keysPtr = keysPtr;
+		record.checksum = XXH64(stream.second->keys, (size_t)stream.second->length);
+		cacheFile.write((const char*)&record, sizeof(record));
+		keysPtr += record.length;
+	}
+	for (auto& stream : streams)
+	{
+		cacheFile.write((const char*)stream.second->keys, stream.second->length);
+	}
+	cacheFile.close();
+	if (cacheFile.fail())
+	{
+		remove(tempPath.c_str());
+		return 0;
+	}
+
+	//Drop our references to the old mapping before replacing the file, as a mapped file cannot be replaced on Windows. The generated
+	//streams stay cached; the mapped ones are put back if the file could not be replaced, so a failed save never loses keys.
+	map<unsigned int, shared_ptr<const KeyStream>> mappedStreams;
+	for (auto stream = streams.begin(); stream != streams.end();)
+	{
+		if (dynamic_cast<const MappedKeyStream*>(stream->second.get()) == nullptr) stream++;
+		else
+		{
+			mappedStreams.insert(*stream);
+			stream = streams.erase(stream);
+		}
+	}
+	if (!replaceFile(tempPath, persistPath))
+	{
+		streams.insert(mappedStreams.begin(), mappedStreams.end());
+		return 0;
+	}
+	dirty = false;
+	return 1;
+}
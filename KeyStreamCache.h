@@ -0,0 +1,85 @@
+#pragma once
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+using namespace std;
+
+/// <summary>
+/// A read-only key stream generated from a LSFR initial value. keys[n] is the n-th key, so data at position n
+/// of a stream is encrypted/decrypted with data[n] ^ keys[n].
+/// </summary>
+class KeyStream
+{
+public:
+	unsigned int initialValue;		//The password the keys were generated from
+	const unsigned char* keys;		//The key stream
+	long long length;				//The number of keys
+
+	virtual ~KeyStream() {}
+};
+
+/// <summary>
+/// XORs length bytes of data with the keys of a stream starting at key byteOffset into output. output may equal data.
+/// Cached keys are used where the stream has them; keys past its end are generated from LSFRJump, so any position works.
+/// </summary>
+/// <param name="keyStream">The key stream</param>
+/// <param name="byteOffset">The position of data in the stream</param>
+/// <param name="data">The data to encrypt/decrypt</param>
+/// <param name="output">The encrypted/decrypted data, length characters big</param>
+/// <param name="length">The number of characters</param>
+void cryptWithKeyStream(const KeyStream& keyStream, long long byteOffset, const unsigned char* data, unsigned char* output, int length);
+
+/// <summary>
+/// A process-wide, thread-safe cache of key streams keyed by initial value. A key stream grows on demand up to a fixed limit
+/// (the size of the largest KDB entry) and is shared read-only, so every stream encrypted with the same password only XORs against the
+/// cached keys. Use cryptWithKeyStream, which generates any keys past the limit. Keys are generated outside the cache's lock.
+/// The cache can be persisted to a file that later processes map to start warm. Loaded keys are checked against a checksum and
+/// keys re-derived from their initial value.
+/// Set the KDB_KEYSTREAM_CACHE environment variable to a file path to enable persistence for the process. Nothing is written at exit:
+/// the tools call save before they return.
+/// </summary>
+class KeyStreamCache
+{
+public:
+	/// <summary>An empty cache without persistence. The tools share the one returned by instance().</summary>
+	KeyStreamCache();
+
+	/// <summary>Returns the cache shared by the whole process.</summary>
+	static KeyStreamCache& instance();
+
+	/// <summary>
+	/// Returns the key stream for initialValue with at least minLength keys, or the cache limit if that is less. The returned stream stays valid while it is held,
+	/// even if the cache grows the stream for another caller.
+	/// </summary>
+	/// <param name="initialValue">The password of the key stream</param>
+	/// <param name="minLength">The smallest number of keys needed</param>
+	/// <returns>The shared key stream</returns>  
+	shared_ptr<const KeyStream> acquire(unsigned int initialValue, long long minLength);
+
+	/// <summary>
+	/// Loads the cache file at pathName (if it exists) and makes save write the cache back to it.
+	/// </summary>
+	/// <param name="pathName">The cache file path</param>
+	/// <returns>true if an existing cache file was loaded</returns>  
+	bool enablePersistence(const string& pathName);
+
+	/// <summary>
+	/// Writes every cached key stream to the persistence file if anything was generated since it was loaded. On failed the cache
+	/// keeps every key stream and stays dirty, so a later save can retry.
+	/// </summary>
+	/// <returns>true on success, false on failed</returns>  
+	bool save();
+
+private:
+	KeyStreamCache(const KeyStreamCache&) = delete;
+	KeyStreamCache& operator=(const KeyStreamCache&) = delete;
+
+	bool load(const string& pathName);
+
+	mutex cacheMutex;									//Guards every member below
+	map<unsigned int, shared_ptr<const KeyStream>> streams;	//The current key stream of every initial value
+	string persistPath;									//The cache file, "" if persistence is disabled
+	bool dirty;											//true if keys were generated since the last load/save
+};
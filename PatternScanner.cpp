@@ -0,0 +1,279 @@
+#include <algorithm>
+#include <cstring>
+#include <queue>
+#include "PatternScanner.h"
+#include "CpuFeatures.h"
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+/*
+* ===================
+* HELPER FUNCTIONS
+* ===================
+*/
+
+/// <summary>
+/// Returns the index of the lowest set bit of a non-zero mask
+/// </summary>
+static int lowestSetBit(unsigned int mask)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (int)index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+/// <summary>
+/// Scalar search. Skips to each occurrence of the first byte with memchr and compares the rest of the pattern there.
+/// </summary>
+static long long findPatternScalar(const unsigned char* data, long long length, long long start, const unsigned char* pattern, int patternSize)
+{
+	const unsigned char* lastStart = data + length - patternSize;	//The last position a match can start at
+	const unsigned char* pos = data + start;
+
+	while (pos <= lastStart)
+	{
+		pos = (const unsigned char*)memchr(pos, pattern[0], (size_t)(lastStart - pos + 1));
+		if (pos == nullptr) return -1;
+		if (memcmp(pos + 1, pattern + 1, patternSize - 1) == 0) return pos - data;
+		pos++;
+	}
+	return -1;
+}
+
+#ifdef CPU_X86
+/// <summary>
+/// AVX2 search. Compares the first and the last byte of the pattern at 32 positions per step.
+/// </summary>
+TARGET_AVX2 static long long findPatternAVX2(const unsigned char* data, long long length, const unsigned char* pattern, int patternSize)
+{
+	const __m256i firstByte = _mm256_set1_epi8((char)pattern[0]);
+	const __m256i lastByte = _mm256_set1_epi8((char)pattern[patternSize - 1]);
+	long long pos = 0;
+
+	for (; pos + patternSize - 1 + 32 <= length; pos += 32)
+	{
+		__m256i first = _mm256_cmpeq_epi8(firstByte, _mm256_loadu_si256((const __m256i*)(data + pos)));
+		__m256i last = _mm256_cmpeq_epi8(lastByte, _mm256_loadu_si256((const __m256i*)(data + pos + patternSize - 1)));
+		unsigned int candidates = (unsigned int)_mm256_movemask_epi8(_mm256_and_si256(first, last));
+
+		while (candidates != 0)
+		{
+			int offset = lowestSetBit(candidates);
+			if (memcmp(data + pos + offset, pattern, patternSize) == 0) return pos + offset;
+			candidates &= candidates - 1;
+		}
+	}
+	return findPatternScalar(data, length, pos, pattern, patternSize);
+}
+
+/// <summary>
+/// SSE2 search. Compares the first and the last byte of the pattern at 16 positions per step.
+/// </summary>
+static long long findPatternSSE2(const unsigned char* data, long long length, const unsigned char* pattern, int patternSize)
+{
+	const __m128i firstByte = _mm_set1_epi8((char)pattern[0]);
+	const __m128i lastByte = _mm_set1_epi8((char)pattern[patternSize - 1]);
+	long long pos = 0;
+
+	for (; pos + patternSize - 1 + 16 <= length; pos += 16)
+	{
+		__m128i first = _mm_cmpeq_epi8(firstByte, _mm_loadu_si128((const __m128i*)(data + pos)));
+		__m128i last = _mm_cmpeq_epi8(lastByte, _mm_loadu_si128((const __m128i*)(data + pos + patternSize - 1)));
+		unsigned int candidates = (unsigned int)_mm_movemask_epi8(_mm_and_si128(first, last));
+
+		while (candidates != 0)
+		{
+			int offset = lowestSetBit(candidates);
+			if (memcmp(data + pos + offset, pattern, patternSize) == 0) return pos + offset;
+			candidates &= candidates - 1;
+		}
+	}
+	return findPatternScalar(data, length, pos, pattern, patternSize);
+}
+#endif
+
+/*
+* ===================
+* MAIN FUNCTIONS
+* ===================
+*/
+
+/// <summary>
+/// Finds the first position of pattern in data, using the fastest search the CPU supports
+/// </summary>
+/// <param name="data">The data to search</param>
+/// <param name="length">The number of bytes in data. A match never extends past it</param>
+/// <param name="pattern">The pattern to search for</param>
+/// <param name="patternSize">The number of bytes in the pattern</param>
+/// <returns>The position of the first match, -1 if there is none</returns>  
+long long findPattern(const unsigned char* data, long long length, const unsigned char* pattern, int patternSize)
+{
+	if (patternSize <= 0 || length < patternSize) return -1;
+
+#ifdef CPU_X86
+	if (CpuHasAVX2()) return findPatternAVX2(data, length, pattern, patternSize);
+	return findPatternSSE2(data, length, pattern, patternSize);
+#else
+	return findPatternScalar(data, length, 0, pattern, patternSize);
+#endif
+}
+
+/*
+* ===================
+* PATTERN MATCHER
+* ===================
+*/
+PatternMatcher::PatternMatcher()
+{
+	maxPatternSize = 0;
+	firstByte = -1;
+}
+
+PatternMatcher::PatternMatcher(const vector<vector<unsigned char>>& patterns) : PatternMatcher()
+{
+	build(patterns);
+}
+
+/// <summary>
+/// Builds the automaton: a trie of the patterns where every missing transition is filled in from the longest suffix that is also in the trie,
+/// so the search follows exactly one transition per byte.
+/// </summary>
+/// <param name="newPatterns">The patterns to match</param>
+void PatternMatcher::build(const vector<vector<unsigned char>>& newPatterns)
+{
+	vector<int> failure;
+	queue<int> states;
+
+	patterns.clear();
+	maxPatternSize = 0;
+	firstByte = -1;
+	for (const vector<unsigned char>& pattern : newPatterns)
+	{
+		bool duplicate = false;
+		for (const vector<unsigned char>& known : patterns) duplicate = duplicate || known == pattern;
+		if (pattern.empty() || duplicate) continue;
+
+		firstByte = (patterns.empty() || firstByte == pattern[0]) ? pattern[0] : -1;
+		patterns.push_back(pattern);
+		maxPatternSize = max(maxPatternSize, (int)pattern.size());
+	}
+
+	//Trie of the patterns. -1 marks a missing transition.
+	transitions.assign(256, -1);
+	longestMatch.assign(1, -1);
+	for (int patternIndex = 0; patternIndex < (int)patterns.size(); patternIndex++)
+	{
+		int state = 0;
+		for (unsigned char byte : patterns[patternIndex])
+		{
+			if (transitions[state * 256 + byte] < 0)
+			{
+				transitions[state * 256 + byte] = (int)longestMatch.size();
+				transitions.resize(transitions.size() + 256, -1);
+				longestMatch.push_back(-1);
+			}
+			state = transitions[state * 256 + byte];
+		}
+		longestMatch[state] = patternIndex;
+	}
+
+	//Breadth first, so the failure state of every state is complete before the state itself.
+	failure.assign(longestMatch.size(), 0);
+	for (int byte = 0; byte < 256; byte++)
+	{
+		int& next = transitions[byte];
+		if (next < 0) next = 0;
+		else states.push(next);
+	}
+	while (!states.empty())
+	{
+		int state = states.front();
+		states.pop();
+
+		//A longer pattern ending at a state beats the ones ending at its suffixes, since it starts first.
+		int suffixMatch = longestMatch[failure[state]];
+		if (longestMatch[state] < 0) longestMatch[state] = suffixMatch;
+
+		for (int byte = 0; byte < 256; byte++)
+		{
+			int& next = transitions[state * 256 + byte];
+			if (next < 0) next = transitions[failure[state] * 256 + byte];
+			else
+			{
+				failure[next] = transitions[failure[state] * 256 + byte];
+				states.push(next);
+			}
+		}
+	}
+}
+
+int PatternMatcher::getNumPatterns() const
+{
+	return (int)patterns.size();
+}
+
+const vector<unsigned char>& PatternMatcher::getPattern(int patternIndex) const
+{
+	return patterns[patternIndex];
+}
+
+int PatternMatcher::getPatternSize(int patternIndex) const
+{
+	return (int)patterns[patternIndex].size();
+}
+
+int PatternMatcher::getMaxPatternSize() const
+{
+	return maxPatternSize;
+}
+
+/// <summary>
+/// Finds the first match of any pattern in data. The automaton reports matches by their end, so after the first one 
+/// the search goes on until no other match can start before it.
+/// </summary>
+/// <param name="data">The data to search</param>
+/// <param name="length">The number of bytes in data. A match never extends past it</param>
+/// <param name="patternIndex">Outputs the index of the pattern that matched</param>
+/// <returns>The position of the first match, -1 if there is none</returns>  
+long long PatternMatcher::find(const unsigned char* data, long long length, int& patternIndex) const
+{
+	long long bestStart = -1;
+	long long stopPos = length;
+	int state = 0;
+
+	patternIndex = -1;
+	if (patterns.size() == 1)
+	{
+		patternIndex = 0;
+		return findPattern(data, length, patterns[0].data(), (int)patterns[0].size());
+	}
+
+	for (long long pos = 0; pos < stopPos; pos++)
+	{
+		//Outside of a partial match only the first byte can start one.
+		if (state == 0 && firstByte >= 0)
+		{
+			const unsigned char* next = (const unsigned char*)memchr(data + pos, firstByte, (size_t)(stopPos - pos));
+			if (next == nullptr) break;
+			pos = next - data;
+		}
+
+		state = transitions[state * 256 + data[pos]];
+		int match = longestMatch[state];
+		if (match < 0) continue;
+
+		long long start = pos - (long long)patterns[match].size() + 1;
+		if (patternIndex < 0 || start < bestStart || (start == bestStart && patterns[match].size() > patterns[patternIndex].size()))
+		{
+			bestStart = start;
+			patternIndex = match;
+			stopPos = min(length, start + maxPatternSize);
+		}
+	}
+	return bestStart;
+}
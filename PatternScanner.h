@@ -0,0 +1,51 @@
+#pragma once
+#include <vector>
+
+using namespace std;
+
+/// <summary>
+/// Finds the first position of pattern in data. Candidates are found by comparing the first and the last byte of the pattern
+/// at 32 (AVX2) or 16 (SSE2) positions at once, and only candidates are compared in full. The instruction set is chosen at runtime.
+/// Without SIMD the first byte is skipped to with memchr.
+/// </summary>
+/// <param name="data">The data to search</param>
+/// <param name="length">The number of bytes in data. A match never extends past it</param>
+/// <param name="pattern">The pattern to search for</param>
+/// <param name="patternSize">The number of bytes in the pattern</param>
+/// <returns>The position of the first match, -1 if there is none</returns>  
+long long findPattern(const unsigned char* data, long long length, const unsigned char* pattern, int patternSize);
+
+/// <summary>
+/// Matches a set of patterns in a single pass with an Aho–Corasick automaton. find returns the match that starts first;
+/// if several patterns start at the same position the longest one wins. A set of one pattern is searched with findPattern.
+/// </summary>
+class PatternMatcher
+{
+public:
+	PatternMatcher();
+	explicit PatternMatcher(const vector<vector<unsigned char>>& patterns);
+
+	/// <summary>Builds the automaton. Empty and duplicate patterns are dropped, so indexes follow the first occurrence of each pattern.</summary>
+	void build(const vector<vector<unsigned char>>& patterns);
+
+	int getNumPatterns() const;									//Number of distinct patterns
+	const vector<unsigned char>& getPattern(int patternIndex) const;	//The pattern's bytes
+	int getPatternSize(int patternIndex) const;					//The pattern's length in bytes
+	int getMaxPatternSize() const;								//Length of the longest pattern, 0 if there are none
+
+	/// <summary>
+	/// Finds the first match of any pattern in data
+	/// </summary>
+	/// <param name="data">The data to search</param>
+	/// <param name="length">The number of bytes in data. A match never extends past it</param>
+	/// <param name="patternIndex">Outputs the index of the pattern that matched</param>
+	/// <returns>The position of the first match, -1 if there is none</returns>  
+	long long find(const unsigned char* data, long long length, int& patternIndex) const;
+
+private:
+	vector<vector<unsigned char>> patterns;	//The distinct patterns
+	vector<int> transitions;				//transitions[state * 256 + byte] = next state. State 0 is the root
+	vector<int> longestMatch;				//Per state: the longest pattern ending there, -1 if none
+	int maxPatternSize;						//Length of the longest pattern
+	int firstByte;							//The first byte of every pattern, -1 if they differ. Lets the root skip with memchr
+};
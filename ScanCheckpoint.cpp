@@ -0,0 +1,193 @@
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include "FileIO.h"
+#include "ImageHash.h"
+#include "ScanCheckpoint.h"
+
+const long long FINGERPRINT_SIZE = 64 << 10;	//Largest number of bytes at the start of an image that are fingerprinted
+const char* CHECKPOINT_MAGIC = "SCANCHECKPOINT3";	//The first line of a checkpoint file
+const char* IMAGE_LOG_EXTENSION = ".images";	//Appended to the checkpoint path to get its image log
+
+long long ScanCheckpoint::getResumeOffset() const
+{
+	return findEnd ? pendingOffset : scannedOffset;
+}
+
+/// <summary>
+/// Loads a checkpoint file. It is text, one "key value" line per field, so it can be inspected and edited. Its image log is text
+/// too, one "image offset size" line per reported jpeg.
+/// </summary>
+/// <param name="checkpointPath">The checkpoint file</param>
+/// <param name="checkpoint">Outputs the checkpoint</param>
+/// <returns>true on success, false if the file does not exist or is not a checkpoint</returns>  
+bool loadScanCheckpoint(const string& checkpointPath, ScanCheckpoint& checkpoint)
+{
+	ifstream checkpointFile(checkpointPath);
+	string line, key;
+
+	if (!getline(checkpointFile, line) || line != CHECKPOINT_MAGIC) return 0;
+
+	checkpoint = ScanCheckpoint();
+	while (getline(checkpointFile, line))
+	{
+		stringstream fields(line);
+		fields >> key;
+		if (key == "scanned") fields >> checkpoint.scannedOffset;
+		else if (key == "state")
+		{
+			fields >> key;
+			checkpoint.findEnd = key == "end";
+		}
+		else if (key == "pending") fields >> checkpoint.pendingOffset;
+		else if (key == "images") fields >> checkpoint.numImages >> checkpoint.imageLogSize;
+		else if (key == "prefix") fields >> checkpoint.prefixSize >> hex >> checkpoint.prefixHash;
+		if (fields.fail()) return 0;
+	}
+	return checkpoint.scannedOffset >= 0 && checkpoint.pendingOffset >= 0 && checkpoint.getResumeOffset() <= checkpoint.scannedOffset &&
+		checkpoint.numImages >= 0 && checkpoint.imageLogSize >= 0;
+}
+
+/// <summary>
+/// Loads the offset and size of every jpeg a checkpoint lists from its image log. Only the first imageLogSize bytes are read, so the
+/// records of a save that did not finish are ignored.
+/// </summary>
+/// <param name="checkpointPath">The checkpoint file</param>
+/// <param name="checkpoint">The loaded checkpoint</param>
+/// <param name="images">Outputs the offset and size of every jpeg, in image order</param>
+/// <returns>true on success, false if the log is missing, cut off or does not match the checkpoint</returns>  
+bool loadScanCheckpointImages(const string& checkpointPath, const ScanCheckpoint& checkpoint, vector<pair<long long, long long>>& images)
+{
+	ifstream logFile(checkpointPath + IMAGE_LOG_EXTENSION, ios::in | ios::binary);
+	string logData((size_t)checkpoint.imageLogSize, '\0');
+	string line, key;
+
+	images.clear();
+	if (checkpoint.imageLogSize > 0 && !logFile.read(&logData[0], checkpoint.imageLogSize)) return 0;
+
+	stringstream lines(logData);
+	while (getline(lines, line))
+	{
+		pair<long long, long long> image;
+		stringstream fields(line);
+		fields >> key >> image.first >> image.second;
+		if (fields.fail() || key != "image" || image.first < 0 || image.second <= 0) return 0;
+		images.push_back(image);
+	}
+	return (long long)images.size() == checkpoint.numImages;
+}
+
+/// <summary>
+/// Appends jpegs to the image log of a checkpoint. The log is cut back to imageLogSize first, dropping the records of a save that did not finish.
+/// </summary>
+/// <returns>true on success, false on failed</returns>  
+static bool appendImageLog(const string& logPath, ScanCheckpoint& checkpoint, const vector<pair<long long, long long>>& newImages)
+{
+	error_code error;
+	long long logSize = filesystem::exists(logPath, error) ? (long long)filesystem::file_size(logPath, error) : 0;
+
+	if (error || logSize < checkpoint.imageLogSize) return 0;
+	if (logSize > checkpoint.imageLogSize)
+	{
+		filesystem::resize_file(logPath, (uintmax_t)checkpoint.imageLogSize, error);
+		if (error) return 0;
+	}
+
+	stringstream records;
+	for (const pair<long long, long long>& image : newImages) records << "image " << image.first << " " << image.second << "\n";
+	string recordData = records.str();
+
+	ofstream logFile(logPath, ios::out | ios::binary | ios::app);
+	if (!logFile.is_open()) return 0;
+	logFile.write(recordData.data(), recordData.size());
+	logFile.close();
+	if (logFile.fail()) return 0;
+
+	checkpoint.numImages += (long long)newImages.size();
+	checkpoint.imageLogSize += (long long)recordData.size();
+	return 1;
+}
+
+/// <summary>
+/// Saves a checkpoint file. The new jpegs are appended to the image log first, then the file is written under a temporary name 
+/// and moved over the old checkpoint. Every poll therefore writes only its own jpegs, not the whole list again.
+/// </summary>
+/// <param name="checkpointPath">The checkpoint file</param>
+/// <param name="checkpoint">The checkpoint. Its image count and log size are updated</param>
+/// <param name="newImages">The offset and size of every jpeg reported since the last save, in image order</param>
+/// <returns>true on success, false on failed</returns>  
+bool saveScanCheckpoint(const string& checkpointPath, ScanCheckpoint& checkpoint, const vector<pair<long long, long long>>& newImages)
+{
+	ScanCheckpoint saved = checkpoint;
+	if (!appendImageLog(checkpointPath + IMAGE_LOG_EXTENSION, saved, newImages)) return 0;
+
+	string tempPath = makeTempPath(checkpointPath);
+	ofstream checkpointFile(tempPath, ios::out | ios::trunc);
+	if (!checkpointFile.is_open()) return 0;
+
+	checkpointFile << CHECKPOINT_MAGIC << "\n";
+	checkpointFile << "scanned " << saved.scannedOffset << "\n";
+	checkpointFile << "state " << (saved.findEnd ? "end" : "magic") << "\n";
+	checkpointFile << "pending " << saved.pendingOffset << "\n";
+	checkpointFile << "images " << saved.numImages << " " << saved.imageLogSize << "\n";
+	checkpointFile << "prefix " << saved.prefixSize << " " << hex << saved.prefixHash << dec << "\n";
+	checkpointFile.close();
+	if (checkpointFile.fail())
+	{
+		remove(tempPath.c_str());
+		return 0;
+	}
+	if (!replaceFile(tempPath, checkpointPath)) return 0;
+	checkpoint = saved;
+	return 1;
+}
+
+/// <summary>
+/// Hashes the first prefixSize bytes of an image
+/// </summary>
+/// <returns>true on success, false if the image has fewer bytes</returns>  
+static bool hashImagePrefix(const string& imagePath, long long prefixSize, unsigned long long& prefixHash)
+{
+	vector<char> prefix((size_t)prefixSize);
+	ifstream imageFile(imagePath, ios::in | ios::binary);
+
+	if (!imageFile.read(prefix.data(), prefixSize)) return 0;
+	prefixHash = XXH64(prefix.data(), prefix.size());
+	return 1;
+}
+
+/// <summary>
+/// Fingerprints the first bytes of an image (up to FINGERPRINT_SIZE) into the checkpoint. An image that is still smaller is fingerprinted
+/// as far as it goes, and again by a later checkpoint once it has grown.
+/// </summary>
+/// <param name="imagePath">The filepath of the image</param>
+/// <param name="checkpoint">The checkpoint to fingerprint</param>
+/// <returns>true on success, false if the image can't be read</returns>  
+bool fingerprintImage(const string& imagePath, ScanCheckpoint& checkpoint)
+{
+	error_code error;
+	long long imageSize = (long long)filesystem::file_size(imagePath, error);
+	if (error) return 0;
+
+	checkpoint.prefixSize = min(imageSize, FINGERPRINT_SIZE);
+	return hashImagePrefix(imagePath, checkpoint.prefixSize, checkpoint.prefixHash);
+}
+
+/// <summary>
+/// Checks that a checkpoint belongs to an image: the image is at least as large as the scanned bytes and starts with the fingerprinted bytes.
+/// </summary>
+/// <param name="imagePath">The filepath of the image</param>
+/// <param name="checkpoint">The checkpoint</param>
+/// <returns>true if the scan can be resumed, false if the image has to be scanned from the start</returns>  
+bool checkpointMatchesImage(const string& imagePath, const ScanCheckpoint& checkpoint)
+{
+	error_code error;
+	unsigned long long prefixHash;
+	long long imageSize = (long long)filesystem::file_size(imagePath, error);
+
+	if (error || imageSize < checkpoint.scannedOffset) return 0;
+	return hashImagePrefix(imagePath, checkpoint.prefixSize, prefixHash) && prefixHash == checkpoint.prefixHash;
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/// <summary>
+/// The state of a streaming scan of an image that keeps growing, so a later run (or the next poll) only processes the appended bytes.
+/// A magic jpeg that was still waiting for its end string is processed again from its magic string, so the pending jpeg does not
+/// have to be saved. The checkpoint is tied to its image by the size and hash of the image's first bytes.
+/// Every jpeg reported so far is listed in the image log next to the checkpoint file (<checkpoint>.images), so a later run (or whoever
+/// consumes the output) can tell exactly which jpegs are done. Saving only appends the new jpegs to the log; the checkpoint file holds
+/// how much of the log belongs to it, so it stays small however many jpegs were found.
+/// </summary>
+struct ScanCheckpoint
+{
+	long long scannedOffset = 0;			//Every position before it has been searched
+	bool findEnd = false;					//true if a magic jpeg was waiting for its end string
+	long long pendingOffset = 0;			//The position of the magic string of that jpeg
+	long long numImages = 0;				//The number of jpegs reported so far
+	long long imageLogSize = 0;				//The bytes of the image log that list them. Anything after it is left over from a save that did not finish
+	long long prefixSize = 0;				//The number of bytes of the image that are fingerprinted
+	unsigned long long prefixHash = 0;		//The XXH64 hash of those bytes
+
+	long long getResumeOffset() const;		//The position in the image the next run starts reading at
+};
+
+/// <summary>
+/// Loads a checkpoint file
+/// </summary>
+/// <param name="checkpointPath">The checkpoint file</param>
+/// <param name="checkpoint">Outputs the checkpoint</param>
+/// <returns>true on success, false if the file does not exist or is not a checkpoint</returns>  
+bool loadScanCheckpoint(const string& checkpointPath, ScanCheckpoint& checkpoint);
+
+/// <summary>
+/// Saves a checkpoint file. The jpegs reported since the last save are appended to the image log first, then the file is replaced in
+/// one step, so a run that is stopped while saving leaves the previous checkpoint.
+/// </summary>
+/// <param name="checkpointPath">The checkpoint file</param>
+/// <param name="checkpoint">The checkpoint. Its image count and log size are updated</param>
+/// <param name="newImages">The offset and size of every jpeg reported since the last save, in image order</param>
+/// <returns>true on success, false on failed</returns>  
+bool saveScanCheckpoint(const string& checkpointPath, ScanCheckpoint& checkpoint, const vector<pair<long long, long long>>& newImages);
+
+/// <summary>
+/// Loads the offset and size of every jpeg a checkpoint lists from its image log, in image order
+/// </summary>
+/// <returns>true on success, false if the log is missing, cut off or does not match the checkpoint</returns>  
+bool loadScanCheckpointImages(const string& checkpointPath, const ScanCheckpoint& checkpoint, vector<pair<long long, long long>>& images);
+
+/// <summary>
+/// Fingerprints the first bytes of an image (up to 64 KB) into the checkpoint
+/// </summary>
+/// <returns>true on success, false if the image can't be read</returns>  
+bool fingerprintImage(const string& imagePath, ScanCheckpoint& checkpoint);
+
+/// <summary>
+/// Checks that a checkpoint belongs to an image: the image is at least as large as the scanned bytes and starts with the fingerprinted bytes.
+/// An image that was replaced or truncated has to be scanned from the start again.
+/// </summary>
+bool checkpointMatchesImage(const string& imagePath, const ScanCheckpoint& checkpoint);
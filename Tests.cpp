@@ -0,0 +1,1420 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <thread>
+#include "Tests.h"
+#include "Crypt.h"
+#include "DecryptKDB.h"
+#include "FileIO.h"
+#include "ImageExtractor.h"
+#include "ImageHandler.h"
+#include "ImageHash.h"
+#include "ImageStore.h"
+#include "JPEGMarkers.h"
+#include "KDBWriter.h"
+#include "KeyStreamCache.h"
+#include "PatternScanner.h"
+#include "ScanCheckpoint.h"
+
+/*
+ * ===================
+ * CONSTANTS
+ * ==================
+*/
+const unsigned int REFERENCE_FEEDBACK = 0x87654321;		//The LSFR feedback value, stepped one bit at a time by the reference LSFR
+
+/// <summary>A known XXH64 hash</summary>
+struct XXH64Vector
+{
+	const char* input;			//The hashed string
+	unsigned long long hash;	//Its XXH64 hash with seed 0
+};
+
+const XXH64Vector XXH64_VECTORS[] = {
+	{ "", 0xEF46DB3751D8E999ull },
+	{ "a", 0xD24EC4F1A98C6E5Bull },
+	{ "abc", 0x44BC2CF5AD770999ull },
+	{ "Nobody inspects the spammish repetition", 0xFBCEA83C8A378BF1ull },
+};
+
+static string failedCheck;		//The first check that failed in the running test
+
+/// <summary>
+/// RUNS THE TESTS - Known-answer tests and cross-checks of the fast paths against simple reference implementations. Arguments:
+/// [--dir <dir>] [--filter <name>] [--seed <n>] [--rounds <n>]
+/// </summary>
+/// <param name="argc">The number of arguments</param>
+/// <param name="argv">The arguments</param>
+/// <returns>0 if every test passed, 1 on failed</returns>
+int TestMain(int argc, char* argv[])
+{
+	TestOptions options;
+
+	for (int index = 0; index < argc; index++)
+	{
+		bool hasValue = index + 1 < argc;
+		if (strcmp(argv[index], "--dir") == 0 && hasValue) options.workDir = argv[++index];
+		else if (strcmp(argv[index], "--filter") == 0 && hasValue) options.filter = argv[++index];
+		else if (strcmp(argv[index], "--seed") == 0 && hasValue) options.seed = (unsigned int)strtoul(argv[++index], nullptr, 10);
+		else if (strcmp(argv[index], "--rounds") == 0 && hasValue) options.rounds = atoi(argv[++index]);
+		else
+		{
+			cout << "Unknown Test Argument - " << argv[index] << "\n";
+			return 1;
+		}
+	}
+
+	return RunTests(options) ? 0 : 1;
+}
+
+/*
+* ===================
+* HELPER FUNCTIONS
+* ===================
+*/
+
+/// <summary>
+/// Records a failed check of the running test. Only the first one is reported.
+/// </summary>
+/// <param name="condition">The checked condition</param>
+/// <param name="what">What was checked</param>
+/// <returns>condition</returns>
+static bool check(bool condition, const string& what)
+{
+	if (!condition && failedCheck == "") failedCheck = what;
+	return condition;
+}
+
+/// <summary>
+/// Returns count random bytes
+/// </summary>
+static vector<unsigned char> randomBytes(mt19937& random, size_t count)
+{
+	vector<unsigned char> bytes(count);
+	for (unsigned char& byte : bytes) byte = (unsigned char)random();
+	return bytes;
+}
+
+/// <summary>
+/// Returns a random number from 0 to limit - 1, 0 if limit is 0 or less. Small numbers are as likely as large ones, so short and long inputs are both tested.
+/// </summary>
+static long long randomSize(mt19937& random, long long limit)
+{
+	if (limit <= 0) return 0;
+
+	long long scale = 1LL << uniform_int_distribution<int>(0, 62)(random);
+	return uniform_int_distribution<long long>(0, min(scale, limit) - 1)(random);
+}
+
+/// <summary>
+/// Reads a whole file
+/// </summary>
+static vector<unsigned char> readFile(const string& pathName)
+{
+	ifstream file(pathName, ios::in | ios::binary);
+	return vector<unsigned char>(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+}
+
+/// <summary>
+/// Writes a whole file
+/// </summary>
+static bool writeFile(const string& pathName, const vector<unsigned char>& data)
+{
+	ofstream file(pathName, ios::out | ios::binary | ios::trunc);
+	file.write((const char*)data.data(), data.size());
+	file.close();
+	return !file.fail();
+}
+
+/*
+* ===================
+* CRYPT
+* ===================
+*/
+
+/// <summary>
+/// Steps the LSFR one bit at a time, straight from its definition
+/// </summary>
+static unsigned int referenceStep(unsigned int currentValue)
+{
+	return (currentValue & 1) ? (currentValue >> 1) ^ REFERENCE_FEEDBACK : currentValue >> 1;
+}
+
+/// <summary>
+/// Returns the key stream of the reference LSFR: each key is the last byte of the value after 8 steps
+/// </summary>
+static vector<unsigned char> referenceKeys(unsigned int initialValue, size_t numKeys)
+{
+	vector<unsigned char> keys(numKeys);
+	unsigned int currentValue = initialValue;
+
+	for (unsigned char& key : keys)
+	{
+		for (int step = 0; step < 8; step++) currentValue = referenceStep(currentValue);
+		key = (unsigned char)(currentValue & 0xFF);
+	}
+	return keys;
+}
+
+/// <summary>
+/// The GF(2) jump against stepping the reference LSFR, and jumps far past any stream against each other
+/// </summary>
+static bool testLSFRJump(const TestOptions& options, mt19937& random)
+{
+	for (int round = 0; round < options.rounds; round++)
+	{
+		unsigned int initialValue = (unsigned int)random();
+		unsigned int currentValue = initialValue;
+
+		for (long long byteOffset = 0; byteOffset < 1024; byteOffset++)
+		{
+			if (!check(LSFRJump(initialValue, byteOffset) == currentValue, "LSFRJump(" + to_string(initialValue) + ", " + to_string(byteOffset) + ")")) return 0;
+			for (int step = 0; step < 8; step++) currentValue = referenceStep(currentValue);
+		}
+
+		long long firstOffset = randomSize(random, 1LL << 61);
+		long long secondOffset = randomSize(random, 1LL << 61);
+		string what = to_string(initialValue) + ", " + to_string(firstOffset) + " + " + to_string(secondOffset);
+		if (!check(LSFRJump(LSFRJump(initialValue, firstOffset), secondOffset) == LSFRJump(initialValue, firstOffset + secondOffset), "LSFRJump(" + what + ")")) return 0;
+
+		unsigned char key = 0;
+		CryptAt(&key, 1, initialValue, firstOffset);
+		if (!check(key == referenceKeys(LSFRJump(initialValue, firstOffset), 1)[0], "CryptAt key " + to_string(firstOffset))) return 0;
+	}
+	return 1;
+}
+
+/// <summary>
+/// CryptAt on slices at random offsets and CryptInPlaceParallel on any number of threads against the reference key stream
+/// </summary>
+static bool testCryptAt(const TestOptions& options, mt19937& random)
+{
+	for (int round = 0; round < options.rounds; round++)
+	{
+		int length = (int)randomSize(random, 1 << 18);
+		unsigned int initialValue = (unsigned int)random();
+		vector<unsigned char> data = randomBytes(random, length);
+		vector<unsigned char> expected = referenceKeys(initialValue, length);
+		string what = "length " + to_string(length) + ", initial value " + to_string(initialValue);
+
+		for (int index = 0; index < length; index++) expected[index] ^= data[index];
+
+		int numThreads = round % 6;
+		vector<unsigned char> parallel = data;
+		CryptInPlaceParallel(parallel.data(), length, initialValue, numThreads);
+		if (!check(parallel == expected, "CryptInPlaceParallel on " + to_string(numThreads) + " threads, " + what)) return 0;
+
+		for (int slice = 0; slice < 4 && length > 0; slice++)
+		{
+			int offset = (int)(random() % length);
+			int sliceLength = (int)(random() % (length - offset)) + 1;
+			vector<unsigned char> sliceData(data.begin() + offset, data.begin() + offset + sliceLength);
+
+			CryptAt(sliceData.data(), sliceLength, initialValue, offset);
+			if (!check(equal(sliceData.begin(), sliceData.end(), expected.begin() + offset), "CryptAt " + to_string(offset) + ", " + what)) return 0;
+		}
+	}
+	return 1;
+}
+
+/// <summary>
+/// The table-driven LSFR against the reference LSFR, and Crypt against its known answer
+/// </summary>
+static bool testLSFR(const TestOptions& options, mt19937& random)
+{
+	const unsigned char apple[] = { 'a', 'p', 'p', 'l', 'e' };
+	const unsigned char appleCrypted[] = { 0xCD, 0x01, 0xEF, 0xD7, 0x30 };
+	vector<unsigned int> initialValues{ 0, 1, 0x80000000, 0xFFFFFFFF, (unsigned int)LSFR_INIT_VALUE };
+
+	unsigned char* crypted = Crypt((unsigned char*)apple, sizeof(apple), 0x12345678);
+	bool knownAnswer = memcmp(crypted, appleCrypted, sizeof(appleCrypted)) == 0;
+	delete[] crypted;
+	if (!check(knownAnswer, "Crypt(\"apple\", 0x12345678)")) return 0;
+
+	for (int round = 0; round < options.rounds; round++) initialValues.push_back((unsigned int)random());
+	for (unsigned int initialValue : initialValues)
+	{
+		int numKeys = (int)randomSize(random, 4096) + 1;
+		unsigned char* keyStream = LSFR(numKeys, initialValue);
+		bool same = referenceKeys(initialValue, numKeys) == vector<unsigned char>(keyStream, keyStream + numKeys);
+		delete[] keyStream;
+		if (!check(same, "LSFR(" + to_string(numKeys) + ", " + to_string(initialValue) + ")")) return 0;
+	}
+	return 1;
+}
+
+/// <summary>
+/// Crypt, CryptInPlace and XORKeyStream against the reference key stream, on lengths that exercise the SIMD bodies and their tails
+/// </summary>
+static bool testCrypt(const TestOptions& options, mt19937& random)
+{
+	for (int round = 0; round < options.rounds; round++)
+	{
+		int length = (int)randomSize(random, 1 << 18);
+		unsigned int initialValue = (unsigned int)random();
+		vector<unsigned char> data = randomBytes(random, length);
+		vector<unsigned char> expected = referenceKeys(initialValue, length);
+		string what = "length " + to_string(length) + ", initial value " + to_string(initialValue);
+
+		for (int index = 0; index < length; index++) expected[index] ^= data[index];
+
+		if (length > 0)
+		{
+			unsigned char* crypted = Crypt(data.data(), length, initialValue);
+			bool same = memcmp(crypted, expected.data(), length) == 0;
+			delete[] crypted;
+			if (!check(same, "Crypt, " + what)) return 0;
+
+			unsigned char* keyStream = LSFR(length, initialValue);
+			vector<unsigned char> output(length);
+			XORKeyStream(data.data(), keyStream, output.data(), length);
+			delete[] keyStream;
+			if (!check(output == expected, "XORKeyStream, " + what)) return 0;
+		}
+
+		vector<unsigned char> inPlace = data;
+		CryptInPlace(inPlace.data(), length, initialValue);
+		if (!check(inPlace == expected, "CryptInPlace, " + what)) return 0;
+	}
+	return 1;
+}
+
+/// <summary>
+/// CryptContext fed in pieces of random sizes, switching between the in-place and the copying update, and seeked to random offsets
+/// </summary>
+static bool testCryptContext(const TestOptions& options, mt19937& random)
+{
+	for (int round = 0; round < options.rounds; round++)
+	{
+		int length = (int)randomSize(random, 1 << 18);
+		unsigned int initialValue = (unsigned int)random();
+		vector<unsigned char> data = randomBytes(random, length);
+		vector<unsigned char> expected = referenceKeys(initialValue, length);
+		string what = "length " + to_string(length) + ", initial value " + to_string(initialValue);
+
+		for (int index = 0; index < length; index++) expected[index] ^= data[index];
+
+		CryptContext context(initialValue);
+		vector<unsigned char> pieces(length);
+		for (int pos = 0; pos < length;)
+		{
+			int pieceSize = min(length - pos, (int)randomSize(random, 1 << 12) + 1);
+			if (random() % 2) context.update(data.data() + pos, pieces.data() + pos, pieceSize);
+			else
+			{
+				memcpy(pieces.data() + pos, data.data() + pos, pieceSize);
+				context.update(pieces.data() + pos, pieceSize);
+			}
+			pos += pieceSize;
+		}
+		if (!check(pieces == expected && context.position() == length, "CryptContext in pieces, " + what)) return 0;
+
+		for (int slice = 0; slice < 4 && length > 0; slice++)
+		{
+			int offset = (int)(random() % length);
+			int sliceLength = (int)(random() % (length - offset)) + 1;
+			vector<unsigned char> sliceData(data.begin() + offset, data.begin() + offset + sliceLength);
+
+			context.seek(offset);
+			context.update(sliceData.data(), sliceLength);
+			if (!check(equal(sliceData.begin(), sliceData.end(), expected.begin() + offset), "CryptContext::seek " + to_string(offset) + ", " + what)) return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+* ===================
+* KEY STREAM CACHE
+* ===================
+*/
+
+/// <summary>
+/// Returns true if every cached key stream of initialValues is the reference key stream
+/// </summary>
+static bool streamsAreValid(KeyStreamCache& cache, const vector<unsigned int>& initialValues, long long minLength)
+{
+	for (unsigned int initialValue : initialValues)
+	{
+		shared_ptr<const KeyStream> keyStream = cache.acquire(initialValue, minLength);
+		vector<unsigned char> expected = referenceKeys(initialValue, (size_t)keyStream->length);
+		if (keyStream->initialValue != initialValue || keyStream->length < minLength || memcmp(keyStream->keys, expected.data(), expected.size()) != 0) return 0;
+	}
+	return 1;
+}
+
+/// <summary>
+/// The key stream cache saved, loaded by a new cache, loaded from a corrupted file and failing to save, against the reference keys
+/// </summary>
+static bool testKeyStreamCache(mt19937& random, const filesystem::path& workDir)
+{
+	const long long minLength = 100000;
+	string cachePath = (workDir / "keystream.cache").string();
+	vector<unsigned int> initialValues = { 0x12345678, (unsigned int)random() };
+	error_code error;
+	filesystem::remove_all(cachePath, error);
+
+	//Generated by a cache without a file, then loaded by a new cache
+	{
+		KeyStreamCache cache;
+		if (!check(!cache.enablePersistence(cachePath), "enablePersistence without a cache file")) return 0;
+		if (!check(streamsAreValid(cache, initialValues, minLength), "generated key streams")) return 0;
+		if (!check(cache.save() && filesystem::exists(cachePath), "save")) return 0;
+		if (!check(streamsAreValid(cache, initialValues, minLength), "key streams after save")) return 0;
+	}
+	{
+		KeyStreamCache cache;
+		if (!check(cache.enablePersistence(cachePath), "enablePersistence")) return 0;
+		if (!check(streamsAreValid(cache, initialValues, minLength), "loaded key streams")) return 0;
+	}
+
+	//The last key of the file is corrupted, so its stream is generated again
+	vector<unsigned char> cacheData = readFile(cachePath);
+	cacheData.back() ^= 0x01;
+	if (!check(writeFile(cachePath, cacheData), "writing the corrupted cache file")) return 0;
+	{
+		KeyStreamCache cache;
+		if (!check(cache.enablePersistence(cachePath), "enablePersistence of a corrupted cache file")) return 0;
+		if (!check(streamsAreValid(cache, initialValues, minLength), "key streams of a corrupted cache file")) return 0;
+	}
+
+	//A save that cannot replace the file (it became a directory) keeps every stream, including the mapped ones. A mapped file
+	//cannot be removed on Windows, so there only the successful save is tested.
+	{
+		KeyStreamCache cache;
+		cache.enablePersistence(cachePath);
+		vector<shared_ptr<const KeyStream>> loaded;
+		for (unsigned int initialValue : initialValues) loaded.push_back(cache.acquire(initialValue, minLength));
+		cache.acquire(initialValues[0] + 1, minLength);
+
+		if (filesystem::remove(cachePath, error) && filesystem::create_directories(filesystem::path(cachePath) / "child", error))
+		{
+			if (!check(!cache.save(), "save over a directory")) return 0;
+			for (size_t index = 0; index < loaded.size(); index++)
+			{
+				if (!check(cache.acquire(initialValues[index], minLength) == loaded[index], "key streams kept after a failed save")) return 0;
+			}
+			for (auto& entry : filesystem::directory_iterator(workDir))
+			{
+				if (!check(entry.path().extension() != ".tmp", "temporary cache file removed after a failed save")) return 0;
+			}
+			filesystem::remove_all(cachePath, error);
+		}
+	}
+	return 1;
+}
+
+/*
+* ===================
+* KDB FILES
+* ===================
+*/
+
+/// <summary>
+/// A KDB file opened through its sidecar cache, when the sidecar is written, loaded and corrupted, against the KDB file itself
+/// </summary>
+static bool testSidecar(mt19937& random, const filesystem::path& workDir)
+{
+	string kdbPath = (workDir / "sidecar.kdb").string();
+	string sidecarPath = kdbPath + ".kdbcache";
+	vector<pair<string, vector<unsigned char>>> entries;
+	KDBWriter writer;
+
+	entries.push_back({ "MAGIC", { 0xDE, 0xAD, 0xBE } });
+	for (int entryIndex = 0; entryIndex < 8; entryIndex++) entries.push_back({ "ENTRY" + to_string(entryIndex), randomBytes(random, (size_t)randomSize(random, 100000) + 1) });
+	for (auto& entry : entries)
+	{
+		if (!check(writer.addEntry(entry.first, entry.second.data(), (int)entry.second.size()), "KDBWriter::addEntry")) return 0;
+	}
+	if (!check(writer.write(kdbPath), "KDBWriter::write")) return 0;
+	remove(sidecarPath.c_str());
+
+	//Opened without a sidecar, then writing the sidecar, then from the sidecar just written, then from a sidecar cut in half
+	for (int openIndex = 0; openIndex < 4; openIndex++)
+	{
+		KDBReader reader;
+		string what = openIndex == 0 ? "open" : openIndex == 1 ? "openCached writing the sidecar" : openIndex == 2 ? "openCached from the sidecar" : "openCached from a truncated sidecar";
+		if (openIndex == 3) filesystem::resize_file(sidecarPath, filesystem::file_size(sidecarPath) / 2);
+
+		if (!check(openIndex == 0 ? reader.open(kdbPath) : reader.openCached(kdbPath), what)) return 0;
+		if (!check(reader.getNumEntries() == (int)entries.size(), what + ": number of entries")) return 0;
+		for (int entryIndex = 0; entryIndex < (int)entries.size(); entryIndex++)
+		{
+			const KDBEntry* entry = reader.getEntry(entryIndex);
+			bool same = entry != nullptr && reader.getEntryName(entryIndex) == entries[entryIndex].first && entry->dataSize == (int)entries[entryIndex].second.size() &&
+				memcmp(entry->decData, entries[entryIndex].second.data(), entry->dataSize) == 0;
+			if (!check(same, what + ": entry " + to_string(entryIndex))) return 0;
+		}
+		if (openIndex == 1 && !check(filesystem::exists(sidecarPath), "openCached: sidecar written")) return 0;
+	}
+	for (auto& entry : filesystem::directory_iterator(workDir))
+	{
+		if (!check(entry.path().extension() != ".tmp", "temporary sidecar removed")) return 0;
+	}
+	return 1;
+}
+
+/// <summary>
+/// Adds entries of random sizes, split into blocks of random sizes, to a KDB file
+/// </summary>
+/// <returns>The name and plain data of every entry, in entry list order</returns>
+static vector<pair<string, vector<unsigned char>>> addRandomEntries(KDBWriter& writer, mt19937& random, int numEntries)
+{
+	vector<pair<string, vector<unsigned char>>> entries;
+
+	for (int entryIndex = 0; entryIndex < numEntries; entryIndex++)
+	{
+		vector<unsigned char> data = randomBytes(random, (size_t)randomSize(random, 200000) + 1);
+		vector<int> blockSizes;
+		for (int remaining = (int)data.size(); remaining > 0; remaining -= blockSizes.back())
+		{
+			blockSizes.push_back((int)min((long long)remaining, randomSize(random, 0x7FFF) + 1));
+		}
+		entries.push_back({ "ENTRY" + to_string(entryIndex), data });
+		if (!writer.addEntry(entries.back().first, data.data(), blockSizes)) entries.pop_back();
+	}
+	return entries;
+}
+
+/// <summary>
+/// Returns true if every entry of a decrypted KDB file has the name and plain data it was written with
+/// </summary>
+static bool entriesMatch(const KDB& kdb, const vector<pair<string, vector<unsigned char>>>& entries)
+{
+	if (kdb.numEntries != (int)entries.size()) return 0;
+	for (int entryIndex = 0; entryIndex < kdb.numEntries; entryIndex++)
+	{
+		const KDBEntry& entry = kdb.entries[entryIndex];
+		if (string(entry.name, strnlen(entry.name, sizeof(entry.name))) != entries[entryIndex].first) return 0;
+		if (entry.dataSize != (int)entries[entryIndex].second.size() || memcmp(entry.decData, entries[entryIndex].second.data(), entry.dataSize) != 0) return 0;
+	}
+	return 1;
+}
+
+/// <summary>
+/// DecryptKDB of a mapped KDB file on several threads against one thread and against the stream reader, on a sequential and a fragmented file
+/// </summary>
+static bool testParallelDecrypt(mt19937& random, const filesystem::path& workDir)
+{
+	string kdbPath = (workDir / "parallel.kdb").string();
+	KDBWriter writer;
+	vector<pair<string, vector<unsigned char>>> entries = addRandomEntries(writer, random, 40);
+
+	for (bool fragmented : { false, true })
+	{
+		string what = fragmented ? "fragmented" : "sequential";
+		if (!check(fragmented ? writer.writeFragmented(kdbPath, 0.5, random()) : writer.write(kdbPath), what + ": writing the KDB file")) return 0;
+
+		MappedFile kdbFile;
+		fstream kdbStream(kdbPath, ios::in | ios::binary);
+		bool serialError, parallelError, streamError;
+		if (!check(kdbFile.open(kdbPath) && kdbStream.is_open(), what + ": opening the KDB file")) return 0;
+		KDB serial = DecryptKDB(kdbFile, serialError, false, 1);
+		KDB parallel = DecryptKDB(kdbFile, parallelError, false, 4);
+		KDB streamed = DecryptKDB(kdbStream, streamError, false);
+		if (!check(!serialError && !parallelError && !streamError, what + ": DecryptKDB")) return 0;
+		if (!check(entriesMatch(serial, entries), what + ": entries on one thread")) return 0;
+		if (!check(entriesMatch(parallel, entries), what + ": entries on four threads")) return 0;
+		if (!check(entriesMatch(streamed, entries), what + ": entries of the stream reader")) return 0;
+
+		for (int entryIndex = 0; entryIndex < serial.numEntries; entryIndex++)
+		{
+			const KDBEntry& serialEntry = serial.entries[entryIndex];
+			const KDBEntry& parallelEntry = parallel.entries[entryIndex];
+			bool same = serialEntry.numBlocks == parallelEntry.numBlocks && serialEntry.blockListPtr == parallelEntry.blockListPtr;
+			for (int blockIndex = 0; same && blockIndex < serialEntry.numBlocks; blockIndex++)
+			{
+				same = serialEntry.blocks[blockIndex].size == parallelEntry.blocks[blockIndex].size && serialEntry.blocks[blockIndex].dataPtr == parallelEntry.blocks[blockIndex].dataPtr;
+			}
+			if (!check(same, what + ": block list of entry " + to_string(entryIndex))) return 0;
+		}
+	}
+	return 1;
+}
+
+/// <summary>
+/// Returns true if the KDB file at kdbPath holds the entries, each with sequential blocks if requested and with the given number of blocks (-1: any)
+/// </summary>
+static bool readsBack(const string& kdbPath, const vector<pair<string, vector<unsigned char>>>& entries, bool sequential, const vector<int>& numBlocks)
+{
+	KDBReader reader;
+	if (!reader.open(kdbPath) || reader.getNumEntries() != (int)entries.size()) return 0;
+	for (int entryIndex = 0; entryIndex < (int)entries.size(); entryIndex++)
+	{
+		const KDBEntry* entry = reader.getEntry(entryIndex);
+		const vector<unsigned char>& data = entries[entryIndex].second;
+		if (entry == nullptr || reader.getEntryName(entryIndex) != entries[entryIndex].first) return 0;
+		if (entry->dataSize != (int)data.size() || memcmp(entry->decData, data.data(), data.size()) != 0) return 0;
+		if (numBlocks[entryIndex] >= 0 && entry->numBlocks != numBlocks[entryIndex]) return 0;
+		for (int blockIndex = 0; sequential && blockIndex + 1 < entry->numBlocks; blockIndex++)
+		{
+			if (entry->blocks[blockIndex + 1].dataPtr != entry->blocks[blockIndex].dataPtr + entry->blocks[blockIndex].size) return 0;
+		}
+	}
+	return 1;
+}
+
+/// <summary>
+/// A fragmented KDB file reads back, and CompactKDB keeps its entries: with their blocks made sequential, or merged into as few blocks as possible,
+/// into a new file and in place, without leaving temporary files
+/// </summary>
+static bool testCompact(mt19937& random, const filesystem::path& workDir)
+{
+	string fragmentedPath = (workDir / "fragmented.kdb").string();
+	string compactPath = (workDir / "compact.kdb").string();
+	KDBWriter writer;
+	vector<pair<string, vector<unsigned char>>> entries = addRandomEntries(writer, random, 30);
+	vector<int> anyBlocks(entries.size(), -1);
+	vector<int> writtenBlocks, mergedBlocks;
+
+	if (!check(writer.writeFragmented(fragmentedPath, 0.5, random()), "writing the fragmented file")) return 0;
+	if (!check(readsBack(fragmentedPath, entries, false, anyBlocks), "reading the fragmented file")) return 0;
+	KDBReader fragmented;
+	if (!check(fragmented.open(fragmentedPath), "opening the fragmented file")) return 0;
+	for (int entryIndex = 0; entryIndex < (int)entries.size(); entryIndex++)
+	{
+		writtenBlocks.push_back(fragmented.getEntry(entryIndex)->numBlocks);
+		mergedBlocks.push_back((int)((entries[entryIndex].second.size() + 0x7FFE) / 0x7FFF));
+	}
+	fragmented.close();
+
+	if (!check(CompactKDB(fragmentedPath, compactPath, false), "compacting")) return 0;
+	if (!check(readsBack(compactPath, entries, true, writtenBlocks), "reading the compacted file")) return 0;
+	if (!check(CompactKDB(fragmentedPath, compactPath, true), "compacting with merged blocks")) return 0;
+	if (!check(readsBack(compactPath, entries, true, mergedBlocks), "reading the merged file")) return 0;
+	if (!check(readsBack(fragmentedPath, entries, false, writtenBlocks), "the fragmented file is unchanged")) return 0;
+
+	if (!check(CompactKDB(fragmentedPath, fragmentedPath, false), "compacting in place")) return 0;
+	if (!check(readsBack(fragmentedPath, entries, true, writtenBlocks), "reading the file compacted in place")) return 0;
+	if (!check(CompactKDB(fragmentedPath, fragmentedPath, true), "compacting in place with merged blocks")) return 0;
+	if (!check(readsBack(fragmentedPath, entries, true, mergedBlocks), "reading the file merged in place")) return 0;
+
+	for (const filesystem::directory_entry& file : filesystem::directory_iterator(workDir))
+	{
+		if (!check(file.path().extension() != ".tmp", "temporary file left: " + file.path().filename().string())) return 0;
+	}
+	return 1;
+}
+
+/*
+* ===================
+* PATTERN SEARCH
+* ===================
+*/
+
+/// <summary>
+/// Finds the first match of any pattern by comparing every pattern at every position. If several patterns start there the longest one wins.
+/// </summary>
+/// <param name="matchSize">Outputs the size of the pattern that matched</param>
+/// <returns>The position of the first match, -1 if there is none</returns>
+static long long referenceFind(const unsigned char* data, long long length, const vector<vector<unsigned char>>& patterns, int& matchSize)
+{
+	for (long long pos = 0; pos < length; pos++)
+	{
+		matchSize = 0;
+		for (const vector<unsigned char>& pattern : patterns)
+		{
+			if (pattern.empty() || (long long)pattern.size() > length - pos || (int)pattern.size() <= matchSize) continue;
+			if (memcmp(data + pos, pattern.data(), pattern.size()) == 0) matchSize = (int)pattern.size();
+		}
+		if (matchSize > 0) return pos;
+	}
+	return -1;
+}
+
+/// <summary>
+/// Returns random bytes made mostly of a few values, so patterns built from the same values match often
+/// </summary>
+static vector<unsigned char> randomSymbols(mt19937& random, size_t count)
+{
+	const unsigned char symbols[] = { 0xA5, 0x5A, 0xFF, 0x00 };
+	vector<unsigned char> bytes(count);
+	for (unsigned char& byte : bytes) byte = (random() % 16 == 0) ? (unsigned char)random() : symbols[random() % 3];
+	return bytes;
+}
+
+/// <summary>
+/// findPattern against a search that compares the pattern at every position. Lengths and start addresses vary to exercise the SIMD tails.
+/// </summary>
+static bool testFindPattern(const TestOptions& options, mt19937& random)
+{
+	for (int round = 0; round < options.rounds; round++)
+	{
+		vector<unsigned char> data = randomSymbols(random, (size_t)randomSize(random, 1 << 12));
+		long long start = data.empty() ? 0 : (long long)(random() % min(data.size(), (size_t)64));
+		long long length = (long long)data.size() - start;
+
+		//The pattern is often taken from the data itself
+		vector<unsigned char> pattern = randomSymbols(random, (size_t)randomSize(random, 40) + 1);
+		if (random() % 2 && length >= (long long)pattern.size())
+		{
+			long long patternPos = start + (long long)(random() % (length - pattern.size() + 1));
+			pattern.assign(data.begin() + patternPos, data.begin() + patternPos + pattern.size());
+		}
+		int matchSize;
+		long long expected = referenceFind(data.data() + start, length, { pattern }, matchSize);
+		string what = to_string(pattern.size()) + " byte pattern in " + to_string(length) + " bytes";
+		if (!check(findPattern(data.data() + start, length, pattern.data(), (int)pattern.size()) == expected, "findPattern, " + what)) return 0;
+	}
+	return 1;
+}
+
+/// <summary>
+/// PatternMatcher against a search that compares every pattern at every position. The patterns are often prefixes of each other,
+/// so the longest pattern has to win a tie; sets with a shared first byte take the memchr path.
+/// </summary>
+static bool testPatternMatcher(const TestOptions& options, mt19937& random)
+{
+	for (int round = 0; round < options.rounds; round++)
+	{
+		vector<unsigned char> data = randomSymbols(random, (size_t)randomSize(random, 1 << 12));
+		long long start = data.empty() ? 0 : (long long)(random() % min(data.size(), (size_t)64));
+
+		//A set of patterns, with prefixes, duplicates and an empty pattern. Every match of the set is compared in turn.
+		vector<vector<unsigned char>> patterns;
+		int numPatterns = (int)(random() % 6) + 1;
+		bool sameFirstByte = random() % 2 == 0;
+		for (int patternIndex = 0; patternIndex < numPatterns; patternIndex++)
+		{
+			vector<unsigned char> setPattern = randomSymbols(random, (size_t)(random() % 6) + 1);
+			if (sameFirstByte) setPattern[0] = 0xA5;
+			patterns.push_back(setPattern);
+			if (random() % 2) patterns.push_back(vector<unsigned char>(setPattern.begin(), setPattern.begin() + random() % setPattern.size()));
+		}
+		if (random() % 4 == 0) patterns.push_back(patterns[0]);
+
+		PatternMatcher matcher(patterns);
+		for (long long pos = start; pos <= (long long)data.size();)
+		{
+			int variant = -1;
+			int matchSize;
+			long long found = matcher.find(data.data() + pos, (long long)data.size() - pos, variant);
+			long long expected = referenceFind(data.data() + pos, (long long)data.size() - pos, patterns, matchSize);
+			string what = "PatternMatcher of " + to_string(patterns.size()) + " patterns at " + to_string(pos) + " of " + to_string(data.size());
+			if (!check(found == expected, what)) return 0;
+			if (found < 0) break;
+			if (!check(matcher.getPatternSize(variant) == matchSize &&
+				memcmp(matcher.getPattern(variant).data(), data.data() + pos + found, matchSize) == 0, what + ": longest pattern")) return 0;
+			pos += found + 1;
+		}
+	}
+	return 1;
+}
+
+/*
+* ===================
+* JPEG ENDS
+* ===================
+*/
+
+/// <summary>
+/// Appends a marker segment with a length field: FF, the code, the length and the body
+/// </summary>
+static void addSegment(vector<unsigned char>& jpeg, unsigned char code, const vector<unsigned char>& body)
+{
+	size_t length = body.size() + 2;
+	jpeg.insert(jpeg.end(), { 0xFF, code, (unsigned char)(length >> 8), (unsigned char)(length & 0xFF) });
+	jpeg.insert(jpeg.end(), body.begin(), body.end());
+}
+
+/// <summary>
+/// Appends count bytes of entropy-coded data. Every FF is followed by a stuffed 00 or an RSTn code, as an encoder writes them.
+/// </summary>
+static void addEntropyData(vector<unsigned char>& jpeg, mt19937& random, long long count)
+{
+	for (long long index = 0; index < count; index++)
+	{
+		unsigned char byte = (unsigned char)random();
+		jpeg.push_back(byte);
+		if (byte == 0xFF) jpeg.push_back(random() % 4 == 0 ? (unsigned char)(0xD0 + random() % 8) : 0x00);
+	}
+}
+
+/// <summary>
+/// Returns the start of a jpeg: SOI and a JFIF APP0 segment
+/// </summary>
+static vector<unsigned char> makeJPEGStart()
+{
+	return { 0xFF, 0xD8, 0xFF, 0xE0, 0x00, 0x10, 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0 };
+}
+
+/// <summary>
+/// Appends the tables and the frame header of a 16x16 greyscale image: DQT, SOFn and DHT
+/// </summary>
+static void addFrame(vector<unsigned char>& jpeg, mt19937& random, unsigned char frameCode)
+{
+	addSegment(jpeg, 0xDB, randomBytes(random, 65));
+	addSegment(jpeg, frameCode, { 8, 0, 16, 0, 16, 1, 1, 0x11, 0 });
+	addSegment(jpeg, 0xC4, randomBytes(random, 30));
+}
+
+/// <summary>
+/// Appends a scan: its header and count bytes of entropy-coded data
+/// </summary>
+static void addScan(vector<unsigned char>& jpeg, mt19937& random, long long count)
+{
+	addSegment(jpeg, 0xDA, { 1, 1, 0, 0, 0x3F, 0 });
+	addEntropyData(jpeg, random, count);
+}
+
+/// <summary>
+/// Returns jpegs that hold an FF D9 before their end, or that the first FF D9 search handled differently: an EXIF thumbnail
+/// (a whole jpeg inside APP1), FF D9 inside a comment and inside a Huffman table, and a progressive jpeg with several scans,
+/// RSTn markers and fill bytes. Each one starts with SOI and ends with EOI.
+/// </summary>
+static vector<pair<string, vector<unsigned char>>> makeJPEGFixtures(mt19937& random)
+{
+	vector<pair<string, vector<unsigned char>>> fixtures;
+
+	vector<unsigned char> thumbnail{ 0xFF, 0xD8 };
+	addFrame(thumbnail, random, 0xC0);
+	addScan(thumbnail, random, 2000);
+	thumbnail.insert(thumbnail.end(), { 0xFF, 0xD9 });
+	vector<unsigned char> exif{ 'E', 'x', 'i', 'f', 0, 0 };
+	exif.insert(exif.end(), thumbnail.begin(), thumbnail.end());
+	vector<unsigned char> exifThumbnail{ 0xFF, 0xD8 };
+	addSegment(exifThumbnail, 0xE1, exif);
+	addFrame(exifThumbnail, random, 0xC0);
+	addScan(exifThumbnail, random, 20000);
+	exifThumbnail.insert(exifThumbnail.end(), { 0xFF, 0xD9 });
+	fixtures.push_back({ "exif thumbnail", exifThumbnail });
+
+	vector<unsigned char> commentEnd = makeJPEGStart();
+	addSegment(commentEnd, 0xFE, { 'e', 'n', 'd', ' ', 0xFF, 0xD9, ' ', 'h', 'e', 'r', 'e' });
+	addFrame(commentEnd, random, 0xC0);
+	addScan(commentEnd, random, 20000);
+	commentEnd.insert(commentEnd.end(), { 0xFF, 0xD9 });
+	fixtures.push_back({ "end string in COM", commentEnd });
+
+	vector<unsigned char> tableEnd = makeJPEGStart();
+	addFrame(tableEnd, random, 0xC0);
+	vector<unsigned char> table = randomBytes(random, 40);
+	table[0] = 0x10;
+	table[17] = 0xFF;
+	table[18] = 0xD9;
+	addSegment(tableEnd, 0xC4, table);
+	addScan(tableEnd, random, 20000);
+	tableEnd.insert(tableEnd.end(), { 0xFF, 0xD9 });
+	fixtures.push_back({ "end string in DHT", tableEnd });
+
+	vector<unsigned char> progressive = makeJPEGStart();
+	addFrame(progressive, random, 0xC2);
+	addSegment(progressive, 0xDD, { 0, 4 });
+	addScan(progressive, random, 8000);
+	for (int scanIndex = 0; scanIndex < 3; scanIndex++)
+	{
+		progressive.insert(progressive.end(), { 0xFF, 0xFF });
+		progressive.push_back(0xD0 + scanIndex);
+		addEntropyData(progressive, random, 100);
+		addSegment(progressive, 0xC4, randomBytes(random, 30));
+		addScan(progressive, random, 8000);
+	}
+	progressive.insert(progressive.end(), { 0xFF, 0xFF, 0xD9 });
+	fixtures.push_back({ "progressive", progressive });
+	return fixtures;
+}
+
+/// <summary>
+/// Walks a jpeg in pieces of random sizes, the way a stream delivers it
+/// </summary>
+/// <returns>The position of the FF of the EOI marker, -1 if the data is not a well-formed jpeg</returns>
+static long long walkInPieces(const vector<unsigned char>& data, long long markerPos, mt19937& random, int maxPieceSize)
+{
+	JPEGMarkerWalker walker;
+	JPEGWalkResult walkResult = JPEG_WALKING;
+	long long pos = 0;
+
+	walker.reset(markerPos);
+	while (pos < (long long)data.size() && walkResult == JPEG_WALKING)
+	{
+		long long pieceEnd = min((long long)data.size(), pos + 1 + (long long)(random() % maxPieceSize));
+		walkResult = walker.walk(data.data() + pos, pos, pieceEnd);
+		pos = pieceEnd;
+	}
+	return walkResult == JPEG_END ? walker.getEndPos() : -1;
+}
+
+/// <summary>
+/// Checks that findJPEGEnd and a walk in pieces both find the end of a jpeg at expectedEnd
+/// </summary>
+static bool checkJPEGEnd(const string& name, const vector<unsigned char>& jpeg, long long expectedEnd, mt19937& random)
+{
+	if (!check(findJPEGEnd(jpeg.data(), (long long)jpeg.size(), 3) == expectedEnd, name + ": findJPEGEnd")) return 0;
+	for (int maxPieceSize : { 1, 2, 7, 64 })
+	{
+		if (!check(walkInPieces(jpeg, 3, random, maxPieceSize) == expectedEnd, name + ": walk in pieces of up to " + to_string(maxPieceSize))) return 0;
+	}
+	return 1;
+}
+
+/// <summary>
+/// findJPEGEnd on well-formed and broken samples, and the marker walker fed in pieces against the walk over the whole data
+/// </summary>
+static bool testJPEGEnd(const TestOptions& options, mt19937& random)
+{
+	//A baseline jpeg: APP0, DQT, SOF0, DHT, a scan with stuffed bytes and RSTn markers, fill bytes and EOI. Trailing bytes are not part of it.
+	vector<unsigned char> baseline = makeJPEGStart();
+	addFrame(baseline, random, 0xC0);
+	addScan(baseline, random, 5000);
+	baseline.insert(baseline.end(), { 0xFF, 0xFF, 0xD9 });
+	long long baselineEnd = (long long)baseline.size() - 2;
+	baseline.insert(baseline.end(), { 0x12, 0xFF, 0xD9, 0x34 });
+	if (!checkJPEGEnd("baseline", baseline, baselineEnd, random)) return 0;
+
+	vector<unsigned char> truncated(baseline.begin(), baseline.begin() + baselineEnd);
+	if (!checkJPEGEnd("truncated", truncated, -1, random)) return 0;
+
+	vector<unsigned char> scanWithoutFrame{ 0xFF, 0xD8, 0xFF, 0xE0, 0x00, 0x04, 0, 0 };
+	addSegment(scanWithoutFrame, 0xDA, { 1, 1, 0, 0, 0x3F, 0 });
+	addEntropyData(scanWithoutFrame, random, 100);
+	scanWithoutFrame.insert(scanWithoutFrame.end(), { 0xFF, 0xD9 });
+	if (!checkJPEGEnd("scan without frame", scanWithoutFrame, -1, random)) return 0;
+
+	//Random marker soup: whatever the whole walk decides, a walk in pieces decides the same
+	const vector<vector<unsigned char>> tokens{ { 0xFF, 0xD9 }, { 0xFF, 0x00 }, { 0xFF, 0xD0 }, { 0xFF, 0xFF }, { 0xFF, 0xDA, 0, 4 },
+		{ 0xFF, 0xC0, 0, 3 }, { 0xFF, 0xE1, 0, 6 }, { 0xFF, 0xC4, 0, 2 }, { 0xFF, 0x01 }, { 0xFF, 0xD8 }, { 0xFF, 0xFE, 0, 5 } };
+	for (int round = 0; round < options.rounds * 50; round++)
+	{
+		vector<unsigned char> data;
+		size_t length = random() % 60;
+		if (random() % 2) data = { 0xFF, 0xD8, 0xFF, 0xC0, 0, 5, 1, 2, 3, 0xFF, 0xDA, 0, 3, 9 };
+		else data = { 0xFF, 0xD8, 0xFF };
+		while (data.size() < length)
+		{
+			if (random() % 3 == 0)
+			{
+				const vector<unsigned char>& token = tokens[random() % tokens.size()];
+				data.insert(data.end(), token.begin(), token.end());
+			}
+			else data.push_back(random() % 4 == 0 ? 0xFF : (unsigned char)random());
+		}
+		long long expected = findJPEGEnd(data.data(), (long long)data.size(), 3);
+		if (!check(walkInPieces(data, 3, random, 5) == expected, "marker soup " + to_string(round) + ": walk in pieces")) return 0;
+	}
+	return 1;
+}
+
+/// <summary>
+/// The jpeg fixtures end at their EOI, walked whole and in pieces, and the mapped searches (on one thread and on several) and the file
+/// search extract them at full size from an image that spans several chunks of the parallel search
+/// </summary>
+static bool testJPEGFixtures(mt19937& random, const filesystem::path& workDir)
+{
+	const vector<unsigned char> magic{ 0xDE, 0xAD, 0xBE };
+	const unsigned char endString[] = { 0xFF, 0xD9 };
+	const long long imageSize = 12 << 20;
+	string imagePath = (workDir / "fixtures.bin").string();
+	vector<pair<string, vector<unsigned char>>> fixtures = makeJPEGFixtures(random);
+	vector<MagicJPEG> expected;
+	vector<unsigned char> image;
+
+	for (auto& fixture : fixtures)
+	{
+		vector<unsigned char> jpeg = fixture.second;
+		long long jpegEnd = (long long)jpeg.size() - 2;
+		long long firstEnd = findPattern(jpeg.data(), (long long)jpeg.size(), endString, sizeof(endString));
+		if (fixture.first != "progressive" && !check(firstEnd < jpegEnd, fixture.first + ": an end string before the end")) return 0;
+
+		jpeg.insert(jpeg.end(), { 0x12, 0xFF, 0xD9 });
+		if (!checkJPEGEnd(fixture.first, jpeg, jpegEnd, random)) return 0;
+	}
+
+	//The magic string replaces FF D8 FF. The filler never holds its first byte, so only the planted jpegs are found.
+	while ((long long)image.size() < imageSize)
+	{
+		vector<unsigned char> filler = randomBytes(random, (size_t)randomSize(random, 256 << 10));
+		const vector<unsigned char>& jpeg = fixtures[random() % fixtures.size()].second;
+		replace(filler.begin(), filler.end(), magic[0], (unsigned char)0x12);
+		image.insert(image.end(), filler.begin(), filler.end());
+		expected.push_back({ (long long)image.size(), (long long)(image.size() + jpeg.size()), 0 });
+		image.insert(image.end(), magic.begin(), magic.end());
+		image.insert(image.end(), jpeg.begin() + 3, jpeg.end());
+	}
+	if (!check(writeFile(imagePath, image), "writing the image")) return 0;
+
+	PatternMatcher matcher({ magic });
+	MappedFile imageMapping;
+	if (!check(imageMapping.open(imagePath), "mapping the image")) return 0;
+	for (int numThreads : { 1, 4 })
+	{
+		vector<MagicJPEG> found, mappedFound;
+		string what = " on " + to_string(numThreads) + " threads";
+		searchForMagicJPEGS(image.data(), (long long)image.size(), found, matcher, numThreads);
+		searchForMagicJPEGS(imageMapping, mappedFound, matcher, numThreads);
+
+		if (!check(found.size() == expected.size() && mappedFound.size() == expected.size(), "number of jpegs" + what)) return 0;
+		for (size_t jpegIndex = 0; jpegIndex < expected.size(); jpegIndex++)
+		{
+			bool same = found[jpegIndex].startOffset == expected[jpegIndex].startOffset && found[jpegIndex].endOffset == expected[jpegIndex].endOffset &&
+				mappedFound[jpegIndex].startOffset == expected[jpegIndex].startOffset && mappedFound[jpegIndex].endOffset == expected[jpegIndex].endOffset;
+			if (!check(same, "jpeg at " + to_string(expected[jpegIndex].startOffset) + what)) return 0;
+		}
+	}
+
+	//The file search walks the jpegs that cross its read windows on into the next bytes of the file
+	vector<MagicJPEG> fileFound;
+	fstream imageFile(imagePath, ios::in | ios::binary);
+	searchForMagicJPEGS(imageFile, fileFound, matcher);
+	if (!check(fileFound.size() == expected.size(), "number of jpegs of the file search")) return 0;
+	for (size_t jpegIndex = 0; jpegIndex < expected.size(); jpegIndex++)
+	{
+		bool same = fileFound[jpegIndex].startOffset == expected[jpegIndex].startOffset && fileFound[jpegIndex].endOffset == expected[jpegIndex].endOffset;
+		if (!check(same, "jpeg at " + to_string(expected[jpegIndex].startOffset) + " of the file search")) return 0;
+	}
+	return 1;
+}
+
+/*
+* ===================
+* HASHES
+* ===================
+*/
+
+/// <summary>
+/// XXH64 against known hashes, and ImageHasher fed in pieces against the one-shot hash
+/// </summary>
+static bool testXXH64(const TestOptions& options, mt19937& random)
+{
+	for (const XXH64Vector& knownHash : XXH64_VECTORS)
+	{
+		if (!check(XXH64(knownHash.input, strlen(knownHash.input)) == knownHash.hash, "XXH64(\"" + string(knownHash.input) + "\")")) return 0;
+	}
+
+	ImageHasher hasher(vector<HashAlgorithm>{ HASH_XXH64 });
+	for (int round = 0; round < options.rounds; round++)
+	{
+		vector<unsigned char> data = randomBytes(random, (size_t)randomSize(random, 1 << 16));
+		char expected[17];
+		snprintf(expected, sizeof(expected), "%016llX", XXH64(data.data(), data.size()));
+
+		hasher.reset();
+		for (size_t pos = 0; pos < data.size();)
+		{
+			size_t pieceSize = min(data.size() - pos, (size_t)randomSize(random, 100) + 1);
+			hasher.update(data.data() + pos, pieceSize);
+			pos += pieceSize;
+		}
+		if (!check(formatDigest(hasher.finish()[0]) == expected, "ImageHasher XXH64 of " + to_string(data.size()) + " bytes in pieces")) return 0;
+	}
+	return 1;
+}
+
+/*
+* ===================
+* STORE
+* ===================
+*/
+
+/// <summary>
+/// Magic jpegs stored in a content-addressed store from a mapped and from a read image: every copy of a jpeg is one object holding
+/// the repaired jpeg, and every jpeg gets an index line
+/// </summary>
+static bool testStore(mt19937& random, const filesystem::path& workDir)
+{
+	string imagePath = (workDir / "store.bin").string();
+	string storeDir = (workDir / "store").string();
+	const vector<unsigned char> magic{ 0xDE, 0xAD, 0xBE };
+	vector<vector<unsigned char>> bodies{ randomBytes(random, 5000), randomBytes(random, 300) };
+	vector<int> bodyOrder{ 0, 1, 0 };
+	vector<MagicJPEG> jpegs;
+	vector<unsigned char> image;
+	vector<HashAlgorithm> hashAlgorithms{ HASH_XXH64, HASH_MD5 };
+
+	for (int bodyIndex : bodyOrder)
+	{
+		vector<unsigned char> filler = randomBytes(random, 1000);
+		image.insert(image.end(), filler.begin(), filler.end());
+		jpegs.push_back({ (long long)image.size(), (long long)(image.size() + magic.size() + bodies[bodyIndex].size()), 0 });
+		image.insert(image.end(), magic.begin(), magic.end());
+		image.insert(image.end(), bodies[bodyIndex].begin(), bodies[bodyIndex].end());
+	}
+	if (!check(writeFile(imagePath, image), "writing the image")) return 0;
+
+	MappedFile imageMapping;
+	fstream imageFile(imagePath, ios::in | ios::binary);
+	ImageStore store;
+	vector<string> objectPaths;
+	if (!check(imageMapping.open(imagePath) && imageFile.is_open(), "opening the image")) return 0;
+	if (!check(store.open(storeDir), "ImageStore::open")) return 0;
+
+	for (size_t jpegIndex = 0; jpegIndex < jpegs.size() * 2; jpegIndex++)
+	{
+		const MagicJPEG& jpeg = jpegs[jpegIndex % jpegs.size()];
+		vector<ImageDigest> digests;
+		string outputPath;
+		bool stored = jpegIndex < jpegs.size() ?
+			storeJPEG(imageMapping, imagePath, jpeg.startOffset, jpeg.endOffset, (int)magic.size(), store, hashAlgorithms, digests, outputPath) :
+			storeJPEG(imageFile, imagePath, jpeg.startOffset, jpeg.endOffset, (int)magic.size(), store, hashAlgorithms, digests, outputPath);
+		if (!check(stored && digests.size() == 2, "storeJPEG " + to_string(jpegIndex))) return 0;
+
+		vector<unsigned char> repaired{ 0xFF, 0xD8, 0xFF };
+		const vector<unsigned char>& body = bodies[bodyOrder[jpegIndex % jpegs.size()]];
+		repaired.insert(repaired.end(), body.begin(), body.end());
+		if (!check(outputPath == store.getObjectPath(digests[0]) && readFile(outputPath) == repaired, "stored jpeg " + to_string(jpegIndex))) return 0;
+		objectPaths.push_back(outputPath);
+	}
+	store.close();
+
+	if (!check(objectPaths[0] == objectPaths[2] && objectPaths[0] == objectPaths[3] && objectPaths[0] != objectPaths[1], "one object per distinct jpeg")) return 0;
+	long long numObjects = distance(filesystem::directory_iterator(filesystem::path(storeDir) / "objects"), filesystem::directory_iterator());
+	if (!check(numObjects == 2, "number of objects")) return 0;
+
+	ifstream indexFile(filesystem::path(storeDir) / "index.txt");
+	string line;
+	for (size_t jpegIndex = 0; jpegIndex < jpegs.size() * 2; jpegIndex++)
+	{
+		const MagicJPEG& jpeg = jpegs[jpegIndex % jpegs.size()];
+		string objectName = filesystem::path(objectPaths[jpegIndex]).stem().string();
+		string expected = imagePath + "\t" + to_string(jpeg.startOffset) + "\t" + to_string(jpeg.endOffset - jpeg.startOffset) + "\tXXH64\t" + objectName;
+		if (!check(getline(indexFile, line) && line == expected, "index line " + to_string(jpegIndex))) return 0;
+	}
+	return check(!getline(indexFile, line), "no extra index lines");
+}
+
+/*
+* ===================
+* STREAMING
+* ===================
+*/
+
+/// <summary>
+/// StreamingExtractor against the in-memory search followed by repairing and hashing, on the jpeg fixtures and on jpegs that are not
+/// well-formed: broken right after the magic string, broken after more than a read buffer (which goes back to its magic string in the
+/// rewind window) and cut off by the end of the image. The image is streamed whole and in pieces of random sizes, and in pieces with
+/// a rewind window the late break outgrows, which ends it at its first end string (also its last here) and reports it.
+/// </summary>
+static bool testStreaming(mt19937& random, const filesystem::path& workDir)
+{
+	const vector<unsigned char> magic{ 0xDE, 0xAD, 0xBE };
+	const unsigned char jpegStart[] = { 0xFF, 0xD8, 0xFF };
+	string outputDir = (workDir / "stream").string() + "/";
+	vector<vector<unsigned char>> jpegs;
+	vector<unsigned char> image;
+	vector<string> expected;
+	error_code fileError;
+
+	for (auto& fixture : makeJPEGFixtures(random)) jpegs.push_back(fixture.second);
+
+	vector<unsigned char> scanWithoutFrame = makeJPEGStart();
+	addScan(scanWithoutFrame, random, 3000);
+	scanWithoutFrame.insert(scanWithoutFrame.end(), { 0xFF, 0xD9 });
+	jpegs.push_back(scanWithoutFrame);
+
+	vector<unsigned char> lateBreak = makeJPEGStart();
+	addFrame(lateBreak, random, 0xC0);
+	addScan(lateBreak, random, 1500000);
+	lateBreak.insert(lateBreak.end(), { 0xFF, 0x05 });
+	addEntropyData(lateBreak, random, 1000);
+	lateBreak.insert(lateBreak.end(), { 0xFF, 0xD9 });
+	jpegs.push_back(lateBreak);
+
+	int numLateBreaks = 0;
+	for (size_t jpegIndex = 0; jpegIndex < jpegs.size() * 3; jpegIndex++)
+	{
+		vector<unsigned char> filler = randomBytes(random, (size_t)randomSize(random, 64 << 10));
+		const vector<unsigned char>& jpeg = jpegs[random() % jpegs.size()];
+		if (&jpeg == &jpegs.back()) numLateBreaks++;
+		replace(filler.begin(), filler.end(), magic[0], (unsigned char)0x12);
+		image.insert(image.end(), filler.begin(), filler.end());
+		image.insert(image.end(), magic.begin(), magic.end());
+		image.insert(image.end(), jpeg.begin() + 3, jpeg.end());
+	}
+	image.insert(image.end(), magic.begin(), magic.end());
+	image.insert(image.end(), jpegs[0].begin() + 3, jpegs[0].begin() + jpegs[0].size() / 2);
+
+	PatternMatcher matcher({ magic });
+	vector<MagicJPEG> found;
+	ImageHasher hasher;
+	searchForMagicJPEGS(image.data(), (long long)image.size(), found, matcher, 1);
+	for (const MagicJPEG& jpeg : found)
+	{
+		hasher.reset();
+		hasher.update(jpegStart, sizeof(jpegStart));
+		hasher.update(image.data() + jpeg.startOffset + magic.size(), (size_t)(jpeg.endOffset - jpeg.startOffset - magic.size()));
+		expected.push_back(to_string(jpeg.startOffset) + " " + to_string(jpeg.endOffset - jpeg.startOffset) + " " + formatDigest(hasher.finish()[0]));
+	}
+
+	for (int pass = 0; pass < 3; pass++)
+	{
+		vector<string> streamed;
+		string what = pass == 0 ? "streamed whole" : pass == 1 ? "streamed in pieces" : "streamed with a small rewind window";
+		bool sizesMatch = true;
+		int numMessages = 0;
+
+		filesystem::remove_all(outputDir, fileError);
+		filesystem::create_directories(outputDir, fileError);
+		{
+			StreamingExtractor extractor(matcher, outputDir, [&](long long offset, long long size, const vector<ImageDigest>& digests, const string& path) {
+				streamed.push_back(to_string(offset) + " " + to_string(size) + " " + formatDigest(digests[0]));
+				sizesMatch &= (long long)filesystem::file_size(path, fileError) == size - (long long)magic.size() + 3;
+			}, vector<HashAlgorithm>{ HASH_MD5 }, [&](const string&) { numMessages++; }, pass == 2 ? 256 << 10 : STREAM_REWIND_LIMIT);
+			for (size_t pos = 0; pos < image.size();)
+			{
+				size_t pieceSize = pass == 0 ? image.size() : min(image.size() - pos, (size_t)randomSize(random, 3 << 20) + 1);
+				istringstream piece(string((const char*)image.data() + pos, pieceSize));
+				extractor.process(piece);
+				pos += pieceSize;
+			}
+			extractor.finish();
+		}
+
+		if (!check(streamed == expected, what + ": the jpegs of the in-memory search")) return 0;
+		if (!check(sizesMatch, what + ": repaired jpeg sizes")) return 0;
+		if (!check(numMessages == (pass == 2 ? numLateBreaks : 0), what + ": jpegs that outgrew the rewind window")) return 0;
+	}
+	return 1;
+}
+
+/*
+* ===================
+* CHECKPOINTS
+* ===================
+*/
+
+/// <summary>
+/// A scan checkpoint saved and loaded again with its image log, and the fingerprint that ties it to its image
+/// </summary>
+static bool testCheckpoint(mt19937& random, const filesystem::path& workDir)
+{
+	string imagePath = (workDir / "checkpoint.bin").string();
+	string checkpointPath = (workDir / "checkpoint.txt").string();
+	vector<unsigned char> image = randomBytes(random, 100000);
+	vector<pair<long long, long long>> images = { { 100, 2000 }, { 5000, 30000 }, { 60000, 1 } }, loadedImages;
+	ScanCheckpoint checkpoint, loaded;
+	error_code error;
+
+	filesystem::remove(checkpointPath + ".images", error);
+	if (!check(writeFile(imagePath, image), "writing the image")) return 0;
+	checkpoint.scannedOffset = 90000;
+	checkpoint.findEnd = true;
+	checkpoint.pendingOffset = 85000;
+	if (!check(fingerprintImage(imagePath, checkpoint), "fingerprintImage")) return 0;
+
+	//Saved twice, with the first jpeg and then with the rest, then with the records of a save that did not finish left in the log
+	if (!check(saveScanCheckpoint(checkpointPath, checkpoint, { images[0] }), "saveScanCheckpoint")) return 0;
+	ScanCheckpoint firstSave = checkpoint;
+	if (!check(saveScanCheckpoint(checkpointPath, checkpoint, { images[1], images[2] }), "saveScanCheckpoint appending jpegs")) return 0;
+	if (!check(loadScanCheckpoint(checkpointPath, loaded), "loadScanCheckpoint")) return 0;
+
+	bool same = loaded.scannedOffset == checkpoint.scannedOffset && loaded.findEnd == checkpoint.findEnd && loaded.pendingOffset == checkpoint.pendingOffset &&
+		loaded.numImages == 3 && loaded.imageLogSize == checkpoint.imageLogSize && loaded.prefixSize == checkpoint.prefixSize && loaded.prefixHash == checkpoint.prefixHash;
+	if (!check(same, "checkpoint round trip")) return 0;
+	if (!check(loadScanCheckpointImages(checkpointPath, loaded, loadedImages) && loadedImages == images, "loadScanCheckpointImages")) return 0;
+
+	checkpoint = firstSave;
+	if (!check(saveScanCheckpoint(checkpointPath, checkpoint, { images[2] }), "saveScanCheckpoint after a save that did not finish")) return 0;
+	if (!check(loadScanCheckpoint(checkpointPath, loaded) && loadScanCheckpointImages(checkpointPath, loaded, loadedImages), "loading the checkpoint again")) return 0;
+	if (!check(loadedImages == vector<pair<long long, long long>>{ images[0], images[2] }, "image log cut back to the checkpoint")) return 0;
+	if (!check(filesystem::file_size(checkpointPath + ".images") == (uintmax_t)loaded.imageLogSize, "image log size")) return 0;
+	for (auto& entry : filesystem::directory_iterator(workDir))
+	{
+		if (!check(entry.path().extension() != ".tmp", "temporary checkpoint removed")) return 0;
+	}
+
+	if (!check(loaded.getResumeOffset() == 85000, "getResumeOffset")) return 0;
+	if (!check(checkpointMatchesImage(imagePath, loaded), "checkpointMatchesImage on its image")) return 0;
+
+	image.push_back(0x42);
+	writeFile(imagePath, image);
+	if (!check(checkpointMatchesImage(imagePath, loaded), "checkpointMatchesImage on its grown image")) return 0;
+
+	image[10] ^= 1;
+	writeFile(imagePath, image);
+	if (!check(!checkpointMatchesImage(imagePath, loaded), "checkpointMatchesImage on a replaced image")) return 0;
+
+	image[10] ^= 1;
+	image.resize(80000);
+	writeFile(imagePath, image);
+	if (!check(!checkpointMatchesImage(imagePath, loaded), "checkpointMatchesImage on a truncated image")) return 0;
+
+	if (!check(!loadScanCheckpoint(imagePath, loaded), "loadScanCheckpoint on a file that is not a checkpoint")) return 0;
+	return 1;
+}
+
+/*
+* ===================
+* EXTRACTOR
+* ===================
+*/
+
+/// <summary>
+/// Runs the command line of ImageHandlerMain. What it prints is dropped, so only the files it writes are checked.
+/// </summary>
+/// <returns>The result of ImageHandlerMain</returns>
+static int runImageHandlerMain(vector<string> arguments)
+{
+	vector<char*> argv;
+	for (string& argument : arguments) argv.push_back(&argument[0]);
+
+	stringstream printed;
+	streambuf* coutBuffer = cout.rdbuf(printed.rdbuf());
+	int result = ImageHandlerMain((int)argv.size(), argv.data());
+	cout.rdbuf(coutBuffer);
+	return result;
+}
+
+/// <summary>
+/// ImageExtractor with an ImageRecordWriter against the records the command line writes, in JSONL and CSV, mapped and streamed, and
+/// against the jpegs of the in-memory search. A followed scan is stopped once it reported every jpeg and leaves them in its checkpoint.
+/// </summary>
+static bool testExtractor(mt19937& random, const filesystem::path& workDir)
+{
+	const vector<unsigned char> magic{ 0xDE, 0xAD, 0xBE };
+	string kdbPath = (workDir / "extractor.kdb").string();
+	string imagePath = (workDir / "extractor.bin").string();
+	string recordPath = (workDir / "extractor.records").string();
+	string checkpointPath = (workDir / "extractor.checkpoint").string();
+	vector<pair<string, vector<unsigned char>>> fixtures = makeJPEGFixtures(random);
+	vector<pair<long long, long long>> expected;
+	vector<unsigned char> image;
+	KDBWriter writer;
+	error_code error;
+
+	if (!check(writer.addEntry("MAGIC", magic.data(), (int)magic.size()) && writer.write(kdbPath), "writing the KDB file")) return 0;
+	for (int jpegIndex = 0; jpegIndex < 20; jpegIndex++)
+	{
+		vector<unsigned char> filler = randomBytes(random, (size_t)randomSize(random, 64 << 10));
+		const vector<unsigned char>& jpeg = fixtures[random() % fixtures.size()].second;
+		replace(filler.begin(), filler.end(), magic[0], (unsigned char)0x12);
+		image.insert(image.end(), filler.begin(), filler.end());
+		expected.push_back({ (long long)image.size(), (long long)jpeg.size() });
+		image.insert(image.end(), magic.begin(), magic.end());
+		image.insert(image.end(), jpeg.begin() + 3, jpeg.end());
+	}
+	//A followed scan leaves the last bytes for the next poll, so the last jpeg is followed by a few more.
+	image.insert(image.end(), 16, 0x00);
+	if (!check(writeFile(imagePath, image), "writing the image")) return 0;
+
+	for (string format : { "jsonl", "csv" })
+	{
+		for (bool streaming : { false, true })
+		{
+			string what = format + (streaming ? " streamed" : " mapped");
+			vector<string> arguments = { "--kdb", kdbPath, "--image", imagePath, "--format", format, "--records", recordPath, "--hash", "md5,xxh64" };
+			if (streaming) arguments.insert(arguments.begin(), "stream");
+			remove(recordPath.c_str());
+			if (!check(runImageHandlerMain(arguments) == 1, what + ": command line")) return 0;
+			vector<unsigned char> cliRecords = readFile(recordPath);
+
+			ImageHandlerOptions options;
+			RecordFormat recordFormat;
+			ostringstream records;
+			options.streaming = streaming;
+			options.hashAlgorithms = { HASH_MD5, HASH_XXH64 };
+			ImageExtractor extractor(options);
+			if (!check(parseRecordFormat(format, recordFormat) && extractor.open(kdbPath), what + ": ImageExtractor::open")) return 0;
+			{
+				ImageRecordWriter recordWriter(records, recordFormat);
+				vector<pair<long long, long long>> extracted;
+				bool success = extractor.extract(imagePath, [&](const ExtractedImage& extractedImage) {
+					recordWriter.write(imagePath, extractedImage);
+					extracted.push_back({ extractedImage.offset, extractedImage.size });
+				});
+				if (!check(success && extracted == expected, what + ": the jpegs of the in-memory search")) return 0;
+			}
+			if (!check(records.str() == string(cliRecords.begin(), cliRecords.end()), what + ": records of the command line")) return 0;
+		}
+	}
+
+	//The followed scan polls every 10 ms until it is stopped from this thread.
+	ImageHandlerOptions options;
+	options.follow = true;
+	options.pollInterval = 10;
+	options.checkpointPath = checkpointPath;
+	remove(checkpointPath.c_str());
+	remove((checkpointPath + ".images").c_str());
+	ImageExtractor extractor(options);
+	if (!check(extractor.open(kdbPath), "followed: ImageExtractor::open")) return 0;
+
+	atomic<int> numExtracted(0);
+	bool followed = false;
+	thread follower([&]() { followed = extractor.extract(imagePath, [&](const ExtractedImage&) { numExtracted++; }); });
+	for (int waited = 0; waited < 10000 && numExtracted < (int)expected.size(); waited += 10) this_thread::sleep_for(chrono::milliseconds(10));
+	extractor.stop();
+	follower.join();
+
+	ScanCheckpoint checkpoint;
+	vector<pair<long long, long long>> checkpointImages;
+	if (!check(followed && numExtracted == (int)expected.size(), "followed: the jpegs of the in-memory search")) return 0;
+	if (!check(loadScanCheckpoint(checkpointPath, checkpoint) && loadScanCheckpointImages(checkpointPath, checkpoint, checkpointImages), "followed: checkpoint saved")) return 0;
+	return check(checkpointImages == expected && checkpoint.scannedOffset > expected.back().first, "followed: the jpegs of the checkpoint");
+}
+
+/*
+* ===================
+* TEST RUNNER
+* ===================
+*/
+
+/// <summary>
+/// Runs a test with a random generator seeded with options.seed, so a test gets the same inputs whichever tests run before it.
+/// Prints its result. A test that is filtered out is skipped and counts as a success.
+/// </summary>
+/// <param name="options">The settings of the run</param>
+/// <param name="name">The name of the test</param>
+/// <param name="run">The test. Returns false if a check failed</param>
+/// <returns>true on success, false if the test failed</returns>
+static bool runTest(const TestOptions& options, const string& name, const function<bool(mt19937&)>& run)
+{
+	char line[256];
+
+	if (options.filter != "" && name.find(options.filter) == string::npos) return 1;
+
+	mt19937 random(options.seed);
+	failedCheck = "";
+	auto start = chrono::steady_clock::now();
+	bool passed = run(random);
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	snprintf(line, sizeof(line), "%-16s %s %9.3f ms\n", name.c_str(), passed ? "PASSED" : "FAILED", seconds * 1000);
+	cout << line;
+	if (!passed) cout << "    " << failedCheck << "\n";
+	cout.flush();
+	return passed;
+}
+
+bool RunTests(const TestOptions& options)
+{
+	bool removeWorkDir = options.workDir == "";
+	filesystem::path workDir = options.workDir;
+	error_code fileError;
+	bool success = true;
+
+	if (removeWorkDir) workDir = filesystem::temp_directory_path(fileError) / ("kdbtest-" + to_string(chrono::steady_clock::now().time_since_epoch().count()));
+	filesystem::create_directories(workDir, fileError);
+
+	cout << "---------------------------- TESTS ----------------------------\n";
+	cout << "Seed " << options.seed << ", " << options.rounds << " rounds\n\n";
+
+	success &= runTest(options, "lsfr", [&](mt19937& random) { return testLSFR(options, random); });
+	success &= runTest(options, "crypt", [&](mt19937& random) { return testCrypt(options, random); });
+	success &= runTest(options, "crypt-context", [&](mt19937& random) { return testCryptContext(options, random); });
+	success &= runTest(options, "crypt-at", [&](mt19937& random) { return testCryptAt(options, random); });
+	success &= runTest(options, "lsfr-jump", [&](mt19937& random) { return testLSFRJump(options, random); });
+	success &= runTest(options, "keystream-cache", [&](mt19937& random) { return testKeyStreamCache(random, workDir); });
+	success &= runTest(options, "sidecar", [&](mt19937& random) { return testSidecar(random, workDir); });
+	success &= runTest(options, "parallel-decrypt", [&](mt19937& random) { return testParallelDecrypt(random, workDir); });
+	success &= runTest(options, "compact", [&](mt19937& random) { return testCompact(random, workDir); });
+	success &= runTest(options, "find-pattern", [&](mt19937& random) { return testFindPattern(options, random); });
+	success &= runTest(options, "pattern-matcher", [&](mt19937& random) { return testPatternMatcher(options, random); });
+	success &= runTest(options, "jpeg-end", [&](mt19937& random) { return testJPEGEnd(options, random); });
+	success &= runTest(options, "jpeg-fixtures", [&](mt19937& random) { return testJPEGFixtures(random, workDir); });
+	success &= runTest(options, "xxh64", [&](mt19937& random) { return testXXH64(options, random); });
+	success &= runTest(options, "store", [&](mt19937& random) { return testStore(random, workDir); });
+	success &= runTest(options, "stream", [&](mt19937& random) { return testStreaming(random, workDir); });
+	success &= runTest(options, "checkpoint", [&](mt19937& random) { return testCheckpoint(random, workDir); });
+	success &= runTest(options, "extractor", [&](mt19937& random) { return testExtractor(random, workDir); });
+
+	cout << (success ? "\nAll Tests Passed\n" : "\nTests Failed\n");
+	if (removeWorkDir) filesystem::remove_all(workDir, fileError);
+	return success;
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <string>
+
+using namespace std;
+
+/// <summary>Settings of a test run</summary>
+struct TestOptions
+{
+	string workDir;					//Where the test files are written. "" uses a temporary directory that is removed afterwards
+	string filter;					//Only run the tests whose name contains it. "" runs all of them
+	unsigned int seed = 2018;		//The same seed always gives the same random inputs
+	int rounds = 200;				//Random inputs of every randomised test
+};
+
+/// <summary>
+/// RUNS THE TESTS - Known-answer tests, cross-checks of the fast paths against simple reference implementations and round trips
+/// of the file formats. Each test is named after what it checks (see RunTests). Arguments: [--dir <dir>] [--filter <name>] [--seed <n>] [--rounds <n>]
+/// </summary>
+/// <param name="argc">The number of arguments</param>
+/// <param name="argv">The arguments</param>
+/// <returns>0 if every test passed, 1 on failed</returns>
+int TestMain(int argc, char* argv[]);
+
+/// <summary>
+/// Runs every test that matches the filter. Prints one line per test and, for a failed test, the check that failed.
+/// </summary>
+/// <param name="options">The settings of the run</param>
+/// <returns>true if every test passed, false on failed</returns>
+bool RunTests(const TestOptions& options);
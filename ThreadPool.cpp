@@ -0,0 +1,88 @@
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "ThreadPool.h"
+
+/// <summary>
+/// A range of task indexes owned by one worker. next is shared so other workers can steal from it.
+/// </summary>
+struct WorkRange
+{
+	atomic<int> next;	//Next index to run
+	int end;			//One past the last index of the range
+};
+
+/// <summary>
+/// Returns the number of worker threads to use for a requested count. 0 or less means one per hardware thread.
+/// </summary>
+/// <param name="numThreads">The requested number of threads</param>
+/// <returns>The number of threads, at least 1</returns>  
+int resolveThreadCount(int numThreads)
+{
+	if (numThreads <= 0) numThreads = (int)thread::hardware_concurrency();
+	return (numThreads > 0) ? numThreads : 1;
+}
+
+/// <summary>
+/// Runs the tasks of a range until it is empty. Owners and thieves both claim indexes with fetch_add,
+/// so every index runs exactly once.
+/// </summary>
+/// <returns>true if any task was run</returns>  
+static bool runRange(WorkRange& range, const function<void(int)>& task)
+{
+	bool ranTask = false;
+	for (int index = range.next.fetch_add(1); index < range.end; index = range.next.fetch_add(1))
+	{
+		task(index);
+		ranTask = true;
+	}
+	return ranTask;
+}
+
+/// <summary>
+/// Runs task(index) for every index in [0, count) on numThreads worker threads and waits for all of them.
+/// Every worker starts on its own contiguous range of indexes. A worker that runs out of work steals the next 
+/// indexes from the other workers' ranges, so uneven tasks (e.g. entries of very different sizes) stay balanced.
+/// With one thread (or one task) everything runs in order on the calling thread.
+/// </summary>
+/// <param name="count">The number of tasks</param>
+/// <param name="numThreads">The number of worker threads. 0 or less means one per hardware thread</param>
+/// <param name="task">The task to run for each index. It must be safe to call concurrently for different indexes</param>
+void ParallelFor(int count, int numThreads, const function<void(int)>& task)
+{
+	numThreads = resolveThreadCount(numThreads);
+	if (numThreads > count) numThreads = count;
+	if (numThreads <= 1)
+	{
+		for (int index = 0; index < count; index++) task(index);
+		return;
+	}
+
+	//Split the indexes into one contiguous range per worker.
+	unique_ptr<WorkRange[]> ranges(new WorkRange[numThreads]);
+	for (int worker = 0; worker < numThreads; worker++)
+	{
+		ranges[worker].next = (int)((long long)count * worker / numThreads);
+		ranges[worker].end = (int)((long long)count * (worker + 1) / numThreads);
+	}
+
+	//Each worker empties its own range, then visits the others until a full pass finds no work left.
+	auto workerLoop = [&](int worker) {
+		runRange(ranges[worker], task);
+		bool stole = true;
+		while (stole)
+		{
+			stole = false;
+			for (int victim = 1; victim < numThreads; victim++)
+			{
+				if (runRange(ranges[(worker + victim) % numThreads], task)) stole = true;
+			}
+		}
+	};
+
+	vector<thread> workers;
+	for (int worker = 1; worker < numThreads; worker++) workers.emplace_back(workerLoop, worker);
+	workerLoop(0);
+	for (thread& worker : workers) worker.join();
+}
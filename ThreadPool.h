@@ -0,0 +1,77 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+using namespace std;
+
+/// <summary>
+/// Returns the number of worker threads to use for a requested count. 0 or less means one per hardware thread.
+/// </summary>
+/// <param name="numThreads">The requested number of threads</param>
+/// <returns>The number of threads, at least 1</returns>  
+int resolveThreadCount(int numThreads);
+
+/// <summary>
+/// Runs task(index) for every index in [0, count) on numThreads worker threads and waits for all of them.
+/// Every worker starts on its own contiguous range of indexes. A worker that runs out of work steals the next 
+/// indexes from the other workers' ranges, so uneven tasks (e.g. entries of very different sizes) stay balanced.
+/// With one thread (or one task) everything runs in order on the calling thread.
+/// </summary>
+/// <param name="count">The number of tasks</param>
+/// <param name="numThreads">The number of worker threads. 0 or less means one per hardware thread</param>
+/// <param name="task">The task to run for each index. It must be safe to call concurrently for different indexes</param>
+void ParallelFor(int count, int numThreads, const function<void(int)>& task);
+
+/// <summary>
+/// A blocking FIFO queue with a fixed capacity, used to connect pipeline stages. push blocks while the queue is full,
+/// so a fast stage can never run more than capacity items ahead of the stage after it.
+/// </summary>
+template <class T> class BoundedQueue
+{
+public:
+	explicit BoundedQueue(size_t capacity) : capacity(capacity > 0 ? capacity : 1), closed(false) {}
+
+	/// <summary>Adds an item, waiting while the queue is full.</summary>
+	/// <returns>true on success, false if the queue was closed</returns>  
+	bool push(T item)
+	{
+		unique_lock<mutex> lock(queueMutex);
+		notFull.wait(lock, [this]() { return closed || items.size() < capacity; });
+		if (closed) return false;
+		items.push_back(move(item));
+		notEmpty.notify_one();
+		return true;
+	}
+
+	/// <summary>Removes the oldest item, waiting while the queue is empty.</summary>
+	/// <returns>true on success, false if the queue is closed and empty</returns>  
+	bool pop(T& item)
+	{
+		unique_lock<mutex> lock(queueMutex);
+		notEmpty.wait(lock, [this]() { return closed || !items.empty(); });
+		if (items.empty()) return false;
+		item = move(items.front());
+		items.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+
+	/// <summary>Stops the queue. Items already queued can still be popped, new items are rejected.</summary>
+	void close()
+	{
+		lock_guard<mutex> lock(queueMutex);
+		closed = true;
+		notEmpty.notify_all();
+		notFull.notify_all();
+	}
+
+private:
+	mutex queueMutex;					//Guards every member below
+	condition_variable notFull;			//Signalled when an item is removed
+	condition_variable notEmpty;		//Signalled when an item is added
+	deque<T> items;						//The queued items, oldest first
+	size_t capacity;					//Most items the queue holds
+	bool closed;						//true once close was called
+};
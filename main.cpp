@@ -1,10 +1,41 @@
+#include <cstring>
 #include <iostream>
+#include "BatchProcessor.h"
+#include "Benchmark.h"
 #include "ImageHandler.h"
+#include "KDBWriter.h"
+#include "KeyStreamCache.h"
+#include "Tests.h"
 using namespace std;
 
-int main() 
+int main(int argc, char* argv[]) 
 {
-	ImageHandlerMain();
-	cout << "\n";
-	system("pause");
+	//Tools - main compact <in.kdb> <out.kdb> [merge]
+	//        main batch <manifest|directory> [threads] [queue] [hashes] [store] (KDB_SIDECAR_CACHE opens the KDB files through their sidecar caches)
+	//        main bench [--generate] [--dir <dir>] [--iterations <n>] [--threads <n>] [--filter <name>] [--seed <n>] ... (see Benchmark.h)
+	//        main test [--dir <dir>] [--filter <name>] [--seed <n>] [--rounds <n>] (see Tests.h)
+	//        main [stream] [--kdb <path>] [--image <path|->] [--hash <md5,xxh64,blake2b>] [--threads <n>] [--store <dir>]
+	//             (stream extracts the magic jpegs in a single streaming pass, --image - streams the image from stdin)
+	//             [--format <jsonl|csv>] [--records <file>] (writes the jpegs as records instead of printing them)
+	//             [--sidecar] (opens the KDB file through its sidecar cache, as does setting KDB_SIDECAR_CACHE)
+	if (argc > 1 && strcmp(argv[1], "test") == 0) return TestMain(argc - 2, argv + 2);
+
+	int result;
+	if (argc > 1 && strcmp(argv[1], "compact") == 0) result = CompactKDBMain(argc - 2, argv + 2);
+	else if (argc > 1 && strcmp(argv[1], "batch") == 0) result = BatchMain(argc - 2, argv + 2);
+	else if (argc > 1 && strcmp(argv[1], "bench") == 0) result = BenchmarkMain(argc - 2, argv + 2);
+	else
+	{
+		result = ImageHandlerMain(argc - 1, argv + 1) ? 0 : 1;
+		cout << "\n";
+	}
+
+	//The key stream cache (KDB_KEYSTREAM_CACHE) is written here, never from a static destructor, which could run after the Crypt tables are gone.
+	if (!KeyStreamCache::instance().save()) cout << "Saving Key Stream Cache Failed\n";
+
+	//Only an interactive run (started without arguments, e.g. from Explorer) waits, so scripts and pipes are never blocked.
+#ifdef _WIN32
+	if (argc == 1) system("pause");
+#endif
+	return result;
 }
\ No newline at end of file